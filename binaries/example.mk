@@ -21,6 +21,7 @@ CFLAGS+=-fvisibility=hidden   # needed to fix warning caused by pybind
 CFLAGS+=$(shell pkg-config --cflags libvlc)
 CFLAGS+=$(shell pkg-config --cflags python3)
 CFLAGS+=$(shell pkg-config --cflags sqlite3)
+CFLAGS+=$(shell pkg-config --cflags zlib)
 
 # for development
 #CFLAGS+=-DOVERRIDE_TEMPLATES
@@ -43,6 +44,7 @@ LDLIBS:=-lpthread
 LDLIBS_libvlc:=$(shell pkg-config --libs libvlc)
 LDLIBS_python+=$(shell pkg-config --libs python3) $(shell pkg-config --libs python3-embed)
 LDLIBS_sqlite3:=$(shell pkg-config --libs sqlite3)
+LDLIBS_zlib:=$(shell pkg-config --libs zlib)
 
 LTOCFLAGS:=-flto -fuse-linker-plugin -fno-fat-lto-objects
 LTOLDFLAGS:=-flto -fuse-linker-plugin
@@ -6,17 +6,46 @@ CREATE TABLE IF NOT EXISTS media (
 	, title          TEXT
 	, length         INTEGER
 	, filesize       INTEGER
-	, metadata       TEXT
 	, metadataTime   TIMESTAMP
 	, errorMessage   TEXT
-	  CHECK (status >= 0 AND status <= 3)
+	, extractor      TEXT
+	, videoId        TEXT
+	  CHECK (status >= 0 AND status <= 4)
 );
 
 
+-- same video from different URLs is one media
+-- null until known, from the URL or from metadata
+CREATE UNIQUE INDEX IF NOT EXISTS mediaVideoId ON media (extractor, videoId) WHERE videoId IS NOT NULL;
+
+
+-- deflate preset dictionaries for mediaMetadata, trained from it
+CREATE TABLE IF NOT EXISTS metadataDictionary (
+	  id             INTEGER PRIMARY KEY
+	, dictionary     BLOB    NOT NULL
+);
+
+
+-- the fields we use of the yt-dlp info dict as JSON, see compactMetadata()
+-- in Downloader.cpp. rarely needed so kept out of media
+-- raw deflate with metadataDictionary id, 0 is without one, null is not
+-- compressed yet
+CREATE TABLE IF NOT EXISTS mediaMetadata (
+	  media          INTEGER PRIMARY KEY
+	, dictionary     INTEGER
+	, metadata       BLOB    NOT NULL
+	, FOREIGN KEY (media) REFERENCES media
+);
+
+
+-- played in position order, ready mirrors media.status == Ready
+-- so the next playable item comes straight from an index
 CREATE TABLE IF NOT EXISTS playlist (
 	  id             INTEGER PRIMARY KEY
 	, media          INTEGER NOT NULL
 	, queueTime      TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP
+	, position       INTEGER NOT NULL
+	, ready          INTEGER NOT NULL DEFAULT 0
 	, FOREIGN KEY (media) REFERENCES media
 );
 
@@ -33,3 +62,52 @@ CREATE TABLE IF NOT EXISTS history (
 	, FOREIGN KEY (media) REFERENCES media
 	  CHECK (finishReason >= 0 AND finishReason <= 1)
 );
+
+
+-- every modification adds a row here so clients can ask what changed
+-- since a version they've already seen
+CREATE TABLE IF NOT EXISTS changes (
+	  version       INTEGER PRIMARY KEY AUTOINCREMENT
+	, kind          INTEGER NOT NULL
+	, item          INTEGER NOT NULL
+	, media         INTEGER NOT NULL
+	  CHECK (kind >= 0 AND kind <= 6)
+);
+
+
+-- full text search over media, rowid is media id
+-- uploader comes from the metadata, prefix indexes make search-as-you-type cheap
+CREATE VIRTUAL TABLE IF NOT EXISTS mediaSearch USING fts5(title, url, uploader, prefix='2 3');
+
+
+-- aggregates of history per media, updated as each play finishes
+-- averageWatched is the average fraction of length played, 0 to 1
+CREATE TABLE IF NOT EXISTS mediaStats (
+	  media           INTEGER PRIMARY KEY
+	, playCount       INTEGER NOT NULL DEFAULT 0
+	, completedCount  INTEGER NOT NULL DEFAULT 0
+	, skippedCount    INTEGER NOT NULL DEFAULT 0
+	, skipVotes       INTEGER NOT NULL DEFAULT 0
+	, lastPlayed      TIMESTAMP NOT NULL
+	, averageWatched  REAL NOT NULL DEFAULT 0
+	, FOREIGN KEY (media) REFERENCES media
+);
+
+
+CREATE INDEX IF NOT EXISTS playlistReadyPosition  ON playlist (ready, position);
+CREATE INDEX IF NOT EXISTS playlistPosition       ON playlist (position);
+CREATE INDEX IF NOT EXISTS playlistMedia          ON playlist (media);
+
+
+-- maintenance looks for rows not compressed with the current dictionary
+CREATE INDEX IF NOT EXISTS mediaMetadataDictionary ON mediaMetadata (dictionary);
+
+
+-- merging media moves its history, also for the foreign key check on delete
+CREATE INDEX IF NOT EXISTS historyMedia           ON history (media);
+
+
+-- top lists walk these from the end
+CREATE INDEX IF NOT EXISTS mediaStatsPlayCount    ON mediaStats (playCount);
+CREATE INDEX IF NOT EXISTS mediaStatsSkippedCount ON mediaStats (skippedCount);
+CREATE INDEX IF NOT EXISTS mediaStatsLastPlayed   ON mediaStats (lastPlayed);
@@ -72,7 +72,7 @@ CFLAGS+=-isystem$(TOPDIR)/foreign/LURLParser
 CFLAGS+=-isystem$(TOPDIR)/foreign/uri-library
 
 
-EMBED:=listMedia.template create_database.sql footer.template header.template history.template playlist.template standby.png utuputki.css utuputki.js
+EMBED:=listMedia.template create_database.sql footer.template header.template history.template playlist.template search.template standby.png stats.template utuputki.css utuputki.js ytdlp_helper.py
 
 
 # (call directory-module, dirname)
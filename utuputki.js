@@ -1 +1,260 @@
+"use strict";
+
 console.log("Javascript is running");
+
+
+(function () {
+	const MediaStatusFailed = 3;
+
+	let reloadTimer   = null;
+	// when the currently playing media ends, in milliseconds since epoch
+	let nowPlayingEnd = null;
+
+
+	// fallback when we don't have a live connection
+	function scheduleReload() {
+		if (reloadTimer !== null) {
+			return;
+		}
+
+		const seconds = parseInt(document.body.dataset.refreshSeconds, 10);
+		if (seconds > 0) {
+			reloadTimer = window.setTimeout(function () { window.location.reload(); }, seconds * 1000);
+		}
+	}
+
+
+	function cancelReload() {
+		if (reloadTimer !== null) {
+			window.clearTimeout(reloadTimer);
+			reloadTimer = null;
+		}
+	}
+
+
+	function makeLink(media) {
+		const a       = document.createElement("a");
+		a.href        = media.url;
+		a.textContent = (media.title === "") ? media.url : media.title;
+
+		return a;
+	}
+
+
+	function makeMoveForm(item, direction, label) {
+		const form  = document.createElement("form");
+		form.action = "/playlist/move";
+		form.method = "POST";
+
+		for (const [name, value] of [["item", item.id], ["direction", direction]]) {
+			const input = document.createElement("input");
+			input.type  = "hidden";
+			input.name  = name;
+			input.value = value;
+			form.appendChild(input);
+		}
+
+		const submit = document.createElement("input");
+		submit.type  = "submit";
+		submit.value = label;
+		form.appendChild(submit);
+
+		return form;
+	}
+
+
+	function playlistRows() {
+		return document.querySelectorAll("#playlist tr[data-media]");
+	}
+
+
+	function updateEmpty() {
+		const empty = document.getElementById("playlist-empty");
+		empty.style.display = (nowPlayingEnd === null && playlistRows().length === 0) ? "" : "none";
+	}
+
+
+	function updateStartTimes() {
+		let start = Date.now();
+		if (nowPlayingEnd !== null) {
+			start = Math.max(start, nowPlayingEnd);
+		}
+
+		for (const row of playlistRows()) {
+			row.querySelector("td.start").textContent = new Date(start).toLocaleTimeString();
+			start += parseInt(row.dataset.length, 10) * 1000;
+		}
+	}
+
+
+	function addedToPlaylist(item) {
+		const table = document.getElementById("playlist");
+		const row   = table.insertRow(-1);
+		row.dataset.id       = item.id;
+		row.dataset.media    = item.mediaId;
+		row.dataset.length   = item.lengthSeconds;
+		row.dataset.position = item.position;
+
+		row.insertCell(-1).textContent = item.id;
+
+		const title = row.insertCell(-1);
+		title.className = "title";
+		title.appendChild(makeLink(item));
+
+		const status = row.insertCell(-1);
+		status.className   = "status";
+		status.textContent = item.statusString;
+
+		row.insertCell(-1).className = "start";
+
+		const duration = row.insertCell(-1);
+		duration.className   = "duration";
+		duration.textContent = item.lengthReadable;
+
+		const move = row.insertCell(-1);
+		move.className = "move";
+		move.append(makeMoveForm(item, "up", "Up"), makeMoveForm(item, "down", "Down"));
+	}
+
+
+	function playlistMoved(items) {
+		const rows = Array.from(playlistRows());
+		for (const item of items) {
+			for (const row of rows) {
+				if (row.dataset.id === item.id) {
+					row.dataset.position = item.position;
+				}
+			}
+		}
+
+		// appending moves them, header row stays first
+		rows.sort(function (a, b) { return a.dataset.position - b.dataset.position; });
+		for (const row of rows) {
+			row.parentNode.appendChild(row);
+		}
+	}
+
+
+	function mediaUpdated(media) {
+		for (const row of playlistRows()) {
+			if (row.dataset.media !== media.id) {
+				continue;
+			}
+
+			if (media.status === MediaStatusFailed) {
+				row.remove();
+				continue;
+			}
+
+			row.dataset.length = media.lengthSeconds;
+
+			const title = row.querySelector("td.title");
+			title.replaceChildren(makeLink(media));
+
+			row.querySelector("td.status").textContent   = media.statusString;
+			row.querySelector("td.duration").textContent = media.lengthReadable;
+		}
+	}
+
+
+	function nowPlaying(item) {
+		// it's no longer on the playlist
+		for (const row of playlistRows()) {
+			if (row.dataset.media === item.mediaId) {
+				row.remove();
+			}
+		}
+
+		nowPlayingEnd = Date.now() + item.leftSeconds * 1000;
+
+		const span = document.getElementById("nowplaying");
+		span.replaceChildren();
+		span.append("Now playing: ", makeLink(item), " 0:00 / " + item.lengthReadable);
+
+		const form = document.createElement("form");
+		form.className = "skip";
+		form.action    = "/skip";
+		form.method    = "POST";
+
+		const media = document.createElement("input");
+		media.type  = "hidden";
+		media.id    = "media";
+		media.name  = "media";
+		media.value = item.mediaId;
+		form.appendChild(media);
+
+		const submit = document.createElement("input");
+		submit.type  = "submit";
+		submit.value = "Skip";
+		form.appendChild(submit);
+
+		span.append(form, "Skips: " + item.skipCount + " / " + item.skipsNeeded);
+		span.style.display = "";
+	}
+
+
+	function playlistItemFinished() {
+		nowPlayingEnd = null;
+
+		const span = document.getElementById("nowplaying");
+		span.replaceChildren();
+		span.style.display = "none";
+	}
+
+
+	const eventHandlers = {
+		  addedToPlaylist:      addedToPlaylist
+		, mediaUpdated:         mediaUpdated
+		, nowPlaying:           nowPlaying
+		, playlistItemFinished: playlistItemFinished
+		, playlistMoved:        playlistMoved
+	};
+
+
+	function connect() {
+		const protocol = (window.location.protocol === "https:") ? "wss:" : "ws:";
+		const socket   = new WebSocket(protocol + "//" + window.location.host + "/events");
+
+		socket.onopen = function () {
+			console.log("Connected to event stream");
+			cancelReload();
+		};
+
+		socket.onmessage = function (message) {
+			const event   = JSON.parse(message.data);
+			const handler = eventHandlers[event.type];
+			if (!handler) {
+				console.log("Unknown event type " + event.type);
+				return;
+			}
+
+			handler(event.data);
+			updateEmpty();
+			updateStartTimes();
+		};
+
+		socket.onclose = function () {
+			// we might have missed something, go back to reloading
+			console.log("Event stream closed");
+			scheduleReload();
+		};
+	}
+
+
+	document.addEventListener("DOMContentLoaded", function () {
+		const table = document.getElementById("playlist");
+		if (!table || !("WebSocket" in window)) {
+			scheduleReload();
+			return;
+		}
+
+		const span = document.getElementById("nowplaying");
+		if (span.dataset.leftSeconds !== undefined) {
+			nowPlayingEnd = Date.now() + parseInt(span.dataset.leftSeconds, 10) * 1000;
+		}
+
+		// in case the socket never opens
+		scheduleReload();
+		connect();
+	});
+})();
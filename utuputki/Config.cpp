@@ -74,6 +74,26 @@ unsigned int Config::get(const std::string &section, const std::string &key, uns
 }
 
 
+uint64_t Config::getUInt64(const std::string &section, const std::string &key, uint64_t defaultValue) const {
+	assert(impl);
+	assert(!section.empty());
+	assert(!key.empty());
+
+	std::string value = impl->ini.Get(section, key, "");
+
+	if (value.empty()) {
+		return defaultValue;
+	}
+
+	// stoull accepts negative numbers and wraps them around
+	if (value.find('-') != std::string::npos) {
+		throw std::runtime_error(fmt::format("Negative value where unsigned expected in config {}.{}", section, key));
+	}
+
+	return std::stoull(value);
+}
+
+
 bool Config::getBool(const std::string &section, const std::string &key, bool defaultValue) const {
 	assert(impl);
 	assert(!section.empty());
@@ -2,6 +2,7 @@
 #define CONFIG_H
 
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -31,6 +32,9 @@ public:
 
 	unsigned int get(const std::string &section, const std::string &key, unsigned int defaultValue) const;
 
+	// for byte counts and such that don't fit in unsigned int
+	uint64_t getUInt64(const std::string &section, const std::string &key, uint64_t defaultValue) const;
+
 	bool getBool(const std::string &section, const std::string &key, bool defaultValue) const;
 
 	std::vector<std::string> getList(const std::string &section, const std::string &key) const;
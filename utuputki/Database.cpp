@@ -1,8 +1,24 @@
 #include <sqlpp11/sqlite3/sqlite3.h>
 #include <sqlpp11/sqlpp11.h>
 
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "utuputki/Config.h"
 #include "utuputki/Database.h"
@@ -30,7 +46,7 @@ static Timestamp timeFromDB(std::chrono::time_point<std::chrono::system_clock, s
 
 static MediaStatus makeMediaStatus(int value) {
 	assert(value >= 0);
-	assert(value <= static_cast<int>(MediaStatus::Failed));
+	assert(value <= static_cast<int>(MediaStatus::Evicted));
 
 	return static_cast<MediaStatus>(value);
 };
@@ -43,194 +59,2496 @@ template<typename M, typename Row> void mediaFromRow(M &mediaInfo, const Row &ro
 	mediaInfo.title        = row.title;
 	mediaInfo.length       = row.length;
 	mediaInfo.filesize     = row.filesize;
-	mediaInfo.metadata     = row.metadata;
+	// metadata is not loaded here, use getMediaMetadata
 	mediaInfo.metadataTime = timeFromDB(row.metadataTime);
 	mediaInfo.errorMessage = row.errorMessage;
 }
 
 
+// each string upgrades the schema from user_version i to i + 1
+// statements are separated by ';' like in create_database.sql
+// databases newer than this program can't be used
+static const std::array<const char *, 8> migrations = {
+	// 1: move metadata out of media into its own table
+	// the change log came without a migration, databases older than it
+	// get it here since 4 rebuilds it
+	  "CREATE TABLE IF NOT EXISTS changes ("
+	  "  version  INTEGER PRIMARY KEY AUTOINCREMENT"
+	  ", kind     INTEGER NOT NULL"
+	  ", item     INTEGER NOT NULL"
+	  ", media    INTEGER NOT NULL"
+	  "  CHECK (kind >= 0 AND kind <= 5)"
+	  ");"
+	  "CREATE TABLE mediaMetadata ("
+	  "  media     INTEGER PRIMARY KEY"
+	  ", metadata  TEXT    NOT NULL"
+	  ", FOREIGN KEY (media) REFERENCES media"
+	  ");"
+	  "INSERT INTO mediaMetadata (media, metadata)"
+	  " SELECT id, metadata FROM media WHERE metadata IS NOT NULL AND metadata != '';"
+	  "ALTER TABLE media DROP COLUMN metadata;"
+
+	// 2: full text search index
+	, "CREATE VIRTUAL TABLE mediaSearch USING fts5(title, url, uploader, prefix='2 3');"
+	  "INSERT INTO mediaSearch (rowid, title, url, uploader)"
+	  " SELECT media.id, media.title, media.url, COALESCE(json_extract(mediaMetadata.metadata, '$.uploader'), '')"
+	  " FROM media LEFT JOIN mediaMetadata ON mediaMetadata.media = media.id;"
+
+	// 3: play statistics, computed once from history
+	, "CREATE TABLE mediaStats ("
+	  "  media           INTEGER PRIMARY KEY"
+	  ", playCount       INTEGER NOT NULL DEFAULT 0"
+	  ", completedCount  INTEGER NOT NULL DEFAULT 0"
+	  ", skippedCount    INTEGER NOT NULL DEFAULT 0"
+	  ", skipVotes       INTEGER NOT NULL DEFAULT 0"
+	  ", lastPlayed      TIMESTAMP NOT NULL"
+	  ", averageWatched  REAL NOT NULL DEFAULT 0"
+	  ", FOREIGN KEY (media) REFERENCES media"
+	  ");"
+	  "INSERT INTO mediaStats (media, playCount, completedCount, skippedCount, skipVotes, lastPlayed, averageWatched)"
+	  " SELECT history.media, COUNT(*), SUM(history.finishReason IS 0), SUM(history.finishReason IS 1), SUM(history.skipCount), MAX(history.startTime)"
+	  ", AVG(CASE WHEN media.length > 0 THEN MIN(1.0, MAX(0.0, (julianday(history.endTime) - julianday(history.startTime)) * 86400.0 / media.length)) ELSE 0.0 END)"
+	  " FROM history JOIN media ON media.id = history.media"
+	  " WHERE history.endTime IS NOT NULL GROUP BY history.media;"
+
+	// 4: explicit playlist order and ready flag, 2 is MediaStatus::Ready
+	, "ALTER TABLE playlist ADD COLUMN position INTEGER NOT NULL DEFAULT 0;"
+	  "ALTER TABLE playlist ADD COLUMN ready INTEGER NOT NULL DEFAULT 0;"
+	  "UPDATE playlist SET position = ordered.n"
+	  " FROM (SELECT id, row_number() OVER (ORDER BY queueTime, id) AS n FROM playlist) AS ordered"
+	  " WHERE ordered.id = playlist.id;"
+	  "UPDATE playlist SET ready = (SELECT media.status = 2 FROM media WHERE media.id = playlist.media);"
+	  // new change kind, CHECK can't be altered so copy the table
+	  "CREATE TABLE changesNew ("
+	  "  version  INTEGER PRIMARY KEY AUTOINCREMENT"
+	  ", kind     INTEGER NOT NULL"
+	  ", item     INTEGER NOT NULL"
+	  ", media    INTEGER NOT NULL"
+	  "  CHECK (kind >= 0 AND kind <= 6)"
+	  ");"
+	  "INSERT INTO changesNew (version, kind, item, media) SELECT version, kind, item, media FROM changes;"
+	  "DROP TABLE changes;"
+	  "ALTER TABLE changesNew RENAME TO changes;"
+
+	// 5: video ids from metadata, only the oldest of any duplicates gets
+	// one and the rest are merged into it when their metadata is refreshed
+	, "ALTER TABLE media ADD COLUMN extractor TEXT;"
+	  "ALTER TABLE media ADD COLUMN videoId TEXT;"
+	  "UPDATE media SET extractor = ids.extractor, videoId = ids.videoId"
+	  " FROM (SELECT media, extractor, videoId, row_number() OVER (PARTITION BY extractor, videoId ORDER BY media) AS n"
+	  "  FROM (SELECT media, json_extract(metadata, '$.extractor_key') AS extractor, json_extract(metadata, '$.id') AS videoId FROM mediaMetadata)"
+	  "  WHERE videoId IS NOT NULL) AS ids"
+	  " WHERE ids.media = media.id AND ids.n = 1;"
+	// 6: MediaStatus::Evicted, copy the table for the CHECK like in 4
+	, "CREATE TABLE mediaNew ("
+	  "  id             INTEGER PRIMARY KEY"
+	  ", status         INTEGER NOT NULL DEFAULT 0"
+	  ", url            TEXT    UNIQUE NOT NULL"
+	  ", filename       TEXT"
+	  ", title          TEXT"
+	  ", length         INTEGER"
+	  ", filesize       INTEGER"
+	  ", metadataTime   TIMESTAMP"
+	  ", errorMessage   TEXT"
+	  ", extractor      TEXT"
+	  ", videoId        TEXT"
+	  "  CHECK (status >= 0 AND status <= 4)"
+	  ");"
+	  "INSERT INTO mediaNew (id, status, url, filename, title, length, filesize, metadataTime, errorMessage, extractor, videoId)"
+	  " SELECT id, status, url, filename, title, length, filesize, metadataTime, errorMessage, extractor, videoId FROM media;"
+	  "DROP TABLE media;"
+	  "ALTER TABLE mediaNew RENAME TO media;"
+
+	// 7: keep only the fields we use of the full info dicts
+	// same as compactMetadata() in Downloader.cpp, URLs of old ones are long gone
+	, "UPDATE mediaMetadata SET metadata = json_object('v', 1"
+	  ", 'id', CAST(json_extract(metadata, '$.id') AS TEXT)"
+	  ", 'extractor_key', json_extract(metadata, '$.extractor_key')"
+	  ", 'webpage_url', json_extract(metadata, '$.webpage_url')"
+	  ", 'title', json_extract(metadata, '$.title')"
+	  ", 'duration', CAST(COALESCE(json_extract(metadata, '$.duration'), 0) AS INTEGER)"
+	  ", 'uploader', COALESCE(json_extract(metadata, '$.uploader'), '')"
+	  ", 'thumbnail', COALESCE(json_extract(metadata, '$.thumbnail'), '')"
+	  ", 'format_id', COALESCE(json_extract(metadata, '$.format_id'), '')"
+	  ", 'expires', 0)"
+	  " WHERE json_valid(metadata) AND json_extract(metadata, '$.v') IS NULL;"
+
+	// 8: compressed metadata, maintenance compresses the old rows in batches
+	, "CREATE TABLE metadataDictionary ("
+	  "  id          INTEGER PRIMARY KEY"
+	  ", dictionary  BLOB    NOT NULL"
+	  ");"
+	  "CREATE TABLE mediaMetadataNew ("
+	  "  media       INTEGER PRIMARY KEY"
+	  ", dictionary  INTEGER"
+	  ", metadata    BLOB    NOT NULL"
+	  ", FOREIGN KEY (media) REFERENCES media"
+	  ");"
+	  "INSERT INTO mediaMetadataNew (media, dictionary, metadata) SELECT media, NULL, metadata FROM mediaMetadata;"
+	  "DROP TABLE mediaMetadata;"
+	  "ALTER TABLE mediaMetadataNew RENAME TO mediaMetadata;"
+};
+
+
+// runs statements separated by ';'
+static void executeScript(sqlpp::sqlite3::connection &conn, std::string script) {
+	while (true) {
+		auto semicol = script.find_first_of(';');
+		if (semicol == std::string::npos) {
+			break;
+		}
+
+		// TODO: c++17 string_view
+		std::string statement = script.substr(0, semicol);
+		conn.execute(statement);
+		script = script.substr(semicol + 1);
+	}
+}
+
+
+// for pragmas and such which sqlpp11 can't express
+static int64_t queryInteger(sqlpp::sqlite3::connection &conn, const char *sql) {
+	sqlite3_stmt *stmt = nullptr;
+	int retval = sqlite3_prepare_v2(conn.native_handle(), sql, -1, &stmt, nullptr);
+	if (retval != SQLITE_OK) {
+		throw std::runtime_error(fmt::format("Failed to prepare \"{}\": {}", sql, sqlite3_errmsg(conn.native_handle())));
+	}
+
+	int64_t result = 0;
+	retval = sqlite3_step(stmt);
+	if (retval == SQLITE_ROW) {
+		result = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	if (retval != SQLITE_ROW) {
+		throw std::runtime_error(fmt::format("\"{}\" returned no rows", sql));
+	}
+
+	return result;
+}
+
+
+// for statements sqlpp11 can't express, like full text search
+class RawStatement {
+	::sqlite3     *db;
+	sqlite3_stmt  *stmt;
+
+
+	RawStatement()                                     = delete;
+
+	RawStatement(const RawStatement &other)            = delete;
+	RawStatement &operator=(const RawStatement &other) = delete;
+
+	RawStatement(RawStatement &&other)                 = delete;
+	RawStatement &operator=(RawStatement &&other)      = delete;
+
+	void check(int retval) {
+		if (retval != SQLITE_OK) {
+			throw std::runtime_error(fmt::format("Failed to bind \"{}\": {}", sqlite3_sql(stmt), sqlite3_errmsg(db)));
+		}
+	}
+
+public:
+
+	RawStatement(sqlpp::sqlite3::connection &conn, const char *sql)
+	: db(conn.native_handle())
+	, stmt(nullptr)
+	{
+		int retval = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+		if (retval != SQLITE_OK) {
+			throw std::runtime_error(fmt::format("Failed to prepare \"{}\": {}", sql, sqlite3_errmsg(db)));
+		}
+	}
+
+	~RawStatement() {
+		sqlite3_finalize(stmt);
+	}
+
+	// parameter indices start from 1
+	void bind(int index, int64_t value) {
+		check(sqlite3_bind_int64(stmt, index, value));
+	}
+
+	void bind(int index, const std::string &value) {
+		check(sqlite3_bind_text(stmt, index, value.data(), value.size(), SQLITE_TRANSIENT));
+	}
+
+	void bind(int index, const std::vector<uint8_t> &value) {
+		check(sqlite3_bind_blob(stmt, index, value.data(), value.size(), SQLITE_TRANSIENT));
+	}
+
+	void bindNull(int index) {
+		check(sqlite3_bind_null(stmt, index));
+	}
+
+	// true if there's a row, false when done
+	bool step() {
+		int retval = sqlite3_step(stmt);
+		if (retval == SQLITE_ROW) {
+			return true;
+		} else if (retval == SQLITE_DONE) {
+			return false;
+		}
+
+		std::string error = sqlite3_errmsg(db);
+		sqlite3_reset(stmt);
+		throw std::runtime_error(fmt::format("\"{}\" failed: {}", sqlite3_sql(stmt), error));
+	}
+
+	// column indices start from 0
+	int64_t columnInteger(int index) {
+		return sqlite3_column_int64(stmt, index);
+	}
+
+	bool columnIsNull(int index) {
+		return sqlite3_column_type(stmt, index) == SQLITE_NULL;
+	}
+
+	std::vector<uint8_t> columnBlob(int index) {
+		auto data = static_cast<const uint8_t *>(sqlite3_column_blob(stmt, index));
+		int size  = sqlite3_column_bytes(stmt, index);
+		return std::vector<uint8_t>(data, data + size);
+	}
+
+	// must be called when done so the statement releases its locks
+	void reset() {
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+	}
+
+	void execute() {
+		while (step()) {
+		}
+		reset();
+	}
+
+	// of the last execute on this connection
+	int changes() const {
+		return sqlite3_changes(db);
+	}
+
+	int64_t lastInsertId() const {
+		return sqlite3_last_insert_rowid(db);
+	}
+};
+
+
+// raw deflate, the dictionary id is stored next to it instead of in a header
+// dictionary can be null
+static std::vector<uint8_t> deflateMetadata(const std::string &metadata, const std::string *dictionary) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+		throw std::runtime_error("deflateInit2 failed");
+	}
+
+	if (dictionary && deflateSetDictionary(&zs, reinterpret_cast<const Bytef *>(dictionary->data()), dictionary->size()) != Z_OK) {
+		deflateEnd(&zs);
+		throw std::runtime_error("deflateSetDictionary failed");
+	}
+
+	std::vector<uint8_t> compressed(deflateBound(&zs, metadata.size()));
+	zs.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(metadata.data()));
+	zs.avail_in  = metadata.size();
+	zs.next_out  = compressed.data();
+	zs.avail_out = compressed.size();
+
+	int retval = deflate(&zs, Z_FINISH);
+	compressed.resize(zs.total_out);
+	deflateEnd(&zs);
+
+	if (retval != Z_STREAM_END) {
+		throw std::runtime_error(fmt::format("deflate failed: {}", retval));
+	}
+
+	return compressed;
+}
+
+
+static std::string inflateMetadata(const std::vector<uint8_t> &compressed, const std::string *dictionary) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -15) != Z_OK) {
+		throw std::runtime_error("inflateInit2 failed");
+	}
+
+	// raw inflate takes it up front instead of asking for it
+	if (dictionary && inflateSetDictionary(&zs, reinterpret_cast<const Bytef *>(dictionary->data()), dictionary->size()) != Z_OK) {
+		inflateEnd(&zs);
+		throw std::runtime_error("inflateSetDictionary failed");
+	}
+
+	zs.next_in  = const_cast<Bytef *>(compressed.data());
+	zs.avail_in = compressed.size();
+
+	std::string metadata(compressed.size() * 4 + 256, '\0');
+	int retval = Z_OK;
+	while (retval == Z_OK) {
+		if (zs.total_out == metadata.size()) {
+			metadata.resize(metadata.size() * 2);
+		}
+		zs.next_out  = reinterpret_cast<Bytef *>(&metadata[zs.total_out]);
+		zs.avail_out = metadata.size() - zs.total_out;
+
+		retval = inflate(&zs, Z_NO_FLUSH);
+	}
+	metadata.resize(zs.total_out);
+	inflateEnd(&zs);
+
+	if (retval != Z_STREAM_END) {
+		throw std::runtime_error(fmt::format("inflate failed: {}", retval));
+	}
+
+	return metadata;
+}
+
+
+// zlib has no trainer so this is a simplified version of zstd's COVER
+// keeps runs of bytes whose k-mers appear in many samples, best ones last
+// since deflate codes closer matches in fewer bits
+static std::string trainDictionary(const std::vector<std::string> &samples, size_t maxSize) {
+	const size_t k = 8;
+
+	// how many samples each k-mer appears in
+	std::unordered_map<std::string, unsigned int> frequency;
+	for (const auto &sample : samples) {
+		std::unordered_set<std::string> seen;
+		for (size_t i = 0; i + k <= sample.size(); i++) {
+			seen.insert(sample.substr(i, k));
+		}
+		for (const auto &kmer : seen) {
+			frequency[kmer]++;
+		}
+	}
+
+	unsigned int minFrequency = std::max(2u, static_cast<unsigned int>(samples.size() / 20));
+
+	// segments are scored by the frequencies of their k-mers, summed over
+	// every sample they're in
+	std::unordered_map<std::string, uint64_t> segments;
+	for (const auto &sample : samples) {
+		size_t i = 0;
+		while (i + k <= sample.size()) {
+			size_t start   = i;
+			uint64_t score = 0;
+			while (i + k <= sample.size()) {
+				unsigned int f = frequency.at(sample.substr(i, k));
+				if (f < minFrequency) {
+					break;
+				}
+				score += f;
+				i++;
+			}
+
+			if (score == 0) {
+				i++;
+			} else {
+				segments[sample.substr(start, i - start + k - 1)] += score;
+			}
+		}
+	}
+
+	std::vector<std::pair<uint64_t, const std::string *> > ranked;
+	ranked.reserve(segments.size());
+	for (const auto &segment : segments) {
+		ranked.emplace_back(segment.second, &segment.first);
+	}
+	std::sort(ranked.begin(), ranked.end(), [] (const auto &a, const auto &b) {
+		return a.first > b.first || (a.first == b.first && *a.second < *b.second);
+	});
+
+	std::vector<const std::string *> picked;
+	std::string best;
+	for (const auto &r : ranked) {
+		const std::string &segment = *r.second;
+		if (best.size() + segment.size() > maxSize) {
+			continue;
+		}
+
+		// parts of ones already picked come free
+		if (best.find(segment) != std::string::npos) {
+			continue;
+		}
+
+		picked.push_back(&segment);
+		best += segment;
+	}
+
+	std::string dictionary;
+	dictionary.reserve(best.size());
+	for (auto it = picked.rbegin(); it != picked.rend(); it++) {
+		dictionary += **it;
+	}
+
+	return dictionary;
+}
+
+
+// old history is moved here by maintenance, attached as history_archive
+// only what history pages need, times are milliseconds since epoch
+static const char *createArchiveSQL =
+	"CREATE TABLE IF NOT EXISTS history_archive.history ("
+	"  id            INTEGER PRIMARY KEY"
+	", media         INTEGER NOT NULL"
+	", queueTime     INTEGER NOT NULL"
+	", startTime     INTEGER NOT NULL"
+	", endTime       INTEGER"
+	", finishReason  INTEGER"
+	");"
+	"CREATE INDEX IF NOT EXISTS history_archive.historyMedia ON history (media);";
+
+
+// FTS5 query syntax errors on stray punctuation so quote every word
+// and match anything starting with it
+static std::string makeMatchQuery(const std::string &query) {
+	std::string match;
+
+	auto it = query.begin();
+	while (it != query.end()) {
+		it = std::find_if_not(it, query.end(), [] (char c) { return std::isspace(static_cast<unsigned char>(c)); });
+		auto end = std::find_if(it, query.end(), [] (char c) { return std::isspace(static_cast<unsigned char>(c)); });
+		if (it == end) {
+			break;
+		}
+
+		if (!match.empty()) {
+			match += ' ';
+		}
+		match += '"';
+		for (; it != end; it++) {
+			if (*it == '"') {
+				match += '"';
+			}
+			match += *it;
+		}
+		match += "\"*";
+	}
+
+	return match;
+}
+
+
+template <typename C, typename T> static void runCallback(C &callback, const T &value) {
+	callback(value);
+}
+
+
+// callers can pass an empty std::function when they don't need a callback
+template <typename T> static void runCallback(std::function<void(const T &)> &callback, const T &value) {
+	if (callback) {
+		callback(value);
+	}
+}
+
+
+// drain a result so its statement finishes and releases its locks
+// prepared statements are not reset until they are run again
+template <typename Result> void finishResult(Result &result) {
+	while (!result.empty()) {
+		result.pop_front();
+	}
+}
+
+
+SQLPP_ALIAS_PROVIDER(otherMedia)
+SQLPP_ALIAS_PROVIDER(pageSize)
+SQLPP_ALIAS_PROVIDER(lastVersion)
+
+
+// statements are prepared once per connection and reused with new parameters
+// their types are unspeakable so they're derived from these functions
+
+static auto selectMediaByIdQuery() {
+	Media media;
+
+	return select(all_of(media))
+	       .from(media)
+	       .where(media.id == parameter(media.id));
+}
+
+
+static auto selectMediaByURLQuery() {
+	Media media;
+
+	return select(all_of(media))
+	       .from(media)
+	       .where(media.url == parameter(media.url));
+}
+
+
+static auto selectMediaByVideoIdQuery() {
+	Media media;
+
+	return select(all_of(media))
+	       .from(media)
+	       .where(media.extractor == parameter(media.extractor)
+	          and media.videoId   == parameter(media.videoId));
+}
+
+
+static auto selectAllMediaQuery() {
+	Media media;
+
+	return select(all_of(media))
+	       .from(media)
+	       .unconditionally()
+	       .order_by(media.id.asc());
+}
+
+
+// pages walk backwards from newest by primary key
+// so they're rowid range scans regardless of table size
+static auto selectMediaPageQuery() {
+	Media media;
+
+	return select(all_of(media))
+	       .from(media)
+	       .where(media.id < parameter(media.id))
+	       .order_by(media.id.desc())
+	       .limit(parameter(sqlpp::unsigned_integral(), pageSize));
+}
+
+
+// must use prepared statement because sqlpp11 doesn't handle
+// strings correctly without it
+// OR IGNORE so racing inserts of the same URL don't fail
+static auto insertMediaQuery() {
+	Media media;
+
+	return sqlpp::sqlite3::insert_or_ignore_into(media)
+	       .set(media.url       = parameter(media.url)
+	          , media.title     = parameter(media.title)
+	          , media.length    = parameter(media.length)
+	          , media.extractor = parameter(media.extractor)
+	          , media.videoId   = parameter(media.videoId));
+}
+
+
+static auto updateMediaVideoIdQuery() {
+	Media media;
+
+	return update(media)
+	       .set(media.extractor = parameter(media.extractor)
+	          , media.videoId   = parameter(media.videoId))
+	       .where(media.id == parameter(media.id));
+}
+
+
+static auto updateMediaQuery() {
+	Media media;
+
+	return update(media)
+	       .set(media.status       = parameter(media.status)
+	          , media.url          = parameter(media.url)
+	          , media.filename     = parameter(media.filename)
+	          , media.title        = parameter(media.title)
+	          , media.length       = parameter(media.length)
+	          , media.filesize     = parameter(media.filesize)
+	          , media.metadataTime = parameter(media.metadataTime)
+	          , media.errorMessage = parameter(media.errorMessage))
+	       .where(media.id == parameter(media.id));
+}
+
+
+static auto selectMediaMetadataQuery() {
+	MediaMetadata mediaMetadata;
+
+	return select(mediaMetadata.dictionary, mediaMetadata.metadata)
+	       .from(mediaMetadata)
+	       .where(mediaMetadata.media == parameter(mediaMetadata.media));
+}
+
+
+static auto replaceMediaMetadataQuery() {
+	MediaMetadata mediaMetadata;
+
+	return sqlpp::sqlite3::insert_or_replace_into(mediaMetadata)
+	       .set(mediaMetadata.media      = parameter(mediaMetadata.media)
+	          , mediaMetadata.dictionary = parameter(mediaMetadata.dictionary)
+	          , mediaMetadata.metadata   = parameter(mediaMetadata.metadata));
+}
+
+
+static auto removeMediaMetadataQuery() {
+	MediaMetadata mediaMetadata;
+
+	return remove_from(mediaMetadata)
+	       .where(mediaMetadata.media == parameter(mediaMetadata.media));
+}
+
+
+static auto removeMediaQuery() {
+	Media media;
+
+	return remove_from(media)
+	       .where(media.id == parameter(media.id));
+}
+
+
+static auto selectPlaylistQuery() {
+	Media     media;
+	Playlist  playlist;
+
+	return select(playlist.id
+	            , playlist.media
+	            , playlist.queueTime
+	            , playlist.position
+	            , media.status
+	            , media.url
+	            , media.filename
+	            , media.title
+	            , media.length
+	            , media.filesize
+	            , media.metadataTime
+	            , media.errorMessage
+	             )
+	       .from(playlist
+	             .join(media)
+	             .on(playlist.media == media.id)
+	            )
+	       .unconditionally()
+	       .order_by(playlist.position.asc());
+}
+
+
+static auto selectPlaylistItemQuery() {
+	Media     media;
+	Playlist  playlist;
+
+	return select(playlist.id
+	            , playlist.media
+	            , playlist.queueTime
+	            , playlist.position
+	            , media.status
+	            , media.url
+	            , media.filename
+	            , media.title
+	            , media.length
+	            , media.filesize
+	            , media.metadataTime
+	            , media.errorMessage
+	             )
+	       .from(playlist
+	             .join(media)
+	             .on(playlist.media == media.id)
+	            )
+	       .where(playlist.id == parameter(playlist.id));
+}
+
+
+static auto selectNextPlaylistItemQuery() {
+	Media     media;
+	Playlist  playlist;
+
+	return select(playlist.id
+	            , playlist.media
+	            , playlist.queueTime
+	            , playlist.position
+	            , media.status
+	            , media.url
+	            , media.filename
+	            , media.title
+	            , media.length
+	            , media.filesize
+	            , media.metadataTime
+	            , media.errorMessage
+	             )
+	       .from(playlist
+	             .join(media)
+	             .on(playlist.media == media.id)
+	            )
+	       .where(playlist.ready == 1)
+	       .order_by(playlist.position.asc())
+	       .limit(1U);
+}
+
+
+static auto selectPlaylistIdByMediaQuery() {
+	Playlist  playlist;
+
+	return select(playlist.id)
+	       .from(playlist)
+	       .where(playlist.media == parameter(playlist.media));
+}
+
+
+static auto selectPlaylistIdsByTwoMediaQuery() {
+	Playlist  playlist;
+
+	return select(playlist.id)
+	       .from(playlist)
+	       .where(playlist.media == parameter(playlist.media)
+	           || playlist.media == parameter(sqlpp::integer(), otherMedia))
+	       .order_by(playlist.position.asc());
+}
+
+
+static auto selectPlaylistPositionQuery() {
+	Playlist  playlist;
+
+	return select(playlist.id
+	            , playlist.media
+	            , playlist.position
+	             )
+	       .from(playlist)
+	       .where(playlist.id == parameter(playlist.id));
+}
+
+
+// neighbours for moving, both are single index lookups
+static auto selectPlaylistBeforeQuery() {
+	Playlist  playlist;
+
+	return select(playlist.id
+	            , playlist.media
+	            , playlist.position
+	             )
+	       .from(playlist)
+	       .where(playlist.position < parameter(playlist.position))
+	       .order_by(playlist.position.desc())
+	       .limit(1U);
+}
+
+
+static auto selectPlaylistAfterQuery() {
+	Playlist  playlist;
+
+	return select(playlist.id
+	            , playlist.media
+	            , playlist.position
+	             )
+	       .from(playlist)
+	       .where(playlist.position > parameter(playlist.position))
+	       .order_by(playlist.position.asc())
+	       .limit(1U);
+}
+
+
+static auto updatePlaylistPositionQuery() {
+	Playlist  playlist;
+
+	return update(playlist)
+	       .set(playlist.position = parameter(playlist.position))
+	       .where(playlist.id == parameter(playlist.id));
+}
+
+
+static auto updatePlaylistReadyQuery() {
+	Playlist  playlist;
+
+	return update(playlist)
+	       .set(playlist.ready   = parameter(playlist.ready))
+	       .where(playlist.media == parameter(playlist.media));
+}
+
+
+static auto removePlaylistItemQuery() {
+	Playlist  playlist;
+
+	return remove_from(playlist)
+	       .where(playlist.id == parameter(playlist.id));
+}
+
+
+static auto removePlaylistMediaQuery() {
+	Playlist  playlist;
+
+	return remove_from(playlist)
+	       .where(playlist.media == parameter(playlist.media));
+}
+
+
+static auto replacePlaylistMediaQuery() {
+	Playlist  playlist;
+
+	return update(playlist)
+	       .set(playlist.media   = parameter(playlist.media))
+	       .where(playlist.media == parameter(sqlpp::integer(), otherMedia));
+}
+
+
+static auto selectHistoryPageQuery() {
+	Media    media;
+	History  history;
+
+	return select(history.id
+	            , history.media
+	            , history.queueTime
+	            , history.startTime
+	            , history.endTime
+	            , history.finishReason
+	            , history.skipCount
+	            , history.skipsNeeded
+	            , media.status
+	            , media.url
+	            , media.filename
+	            , media.title
+	            , media.length
+	            , media.filesize
+	            , media.metadataTime
+	            , media.errorMessage
+	             )
+	       .from(history
+	             .join(media)
+	             .on(history.media == media.id)
+	            )
+	       .where(history.id < parameter(history.id))
+	       .order_by(history.id.desc())
+	       .limit(parameter(sqlpp::unsigned_integral(), pageSize));
+}
+
+
+static auto insertHistoryQuery() {
+	History  history;
+
+	return insert_into(history)
+	       .set(history.media     = parameter(history.media)
+	          , history.queueTime = parameter(history.queueTime));
+}
+
+
+static auto replaceHistoryMediaQuery() {
+	History  history;
+
+	return update(history)
+	       .set(history.media   = parameter(history.media))
+	       .where(history.media == parameter(sqlpp::integer(), otherMedia));
+}
+
+
+static auto updateHistoryQuery() {
+	History  history;
+
+	return update(history)
+	       .set(history.endTime      = parameter(history.endTime)
+	          , history.finishReason = parameter(history.finishReason)
+	          , history.skipCount    = parameter(history.skipCount)
+	          , history.skipsNeeded  = parameter(history.skipsNeeded))
+	       .where(history.id == parameter(history.id));
+}
+
+
+static auto insertChangeQuery() {
+	Changes  changes;
+
+	return insert_into(changes)
+	       .set(changes.kind  = parameter(changes.kind)
+	          , changes.item  = parameter(changes.item)
+	          , changes.media = parameter(changes.media));
+}
+
+
+static auto selectChangesQuery() {
+	Changes  changes;
+
+	return select(all_of(changes))
+	       .from(changes)
+	       .where(changes.version > parameter(changes.version)
+	          and changes.version <= parameter(sqlpp::integer(), lastVersion))
+	       .order_by(changes.version.asc())
+	       .limit(parameter(sqlpp::unsigned_integral(), pageSize));
+}
+
+
+// mediaSearch rowid is the media id
+static const char *searchMediaSQL =
+	"SELECT rowid FROM mediaSearch WHERE mediaSearch MATCH ?1 ORDER BY rank LIMIT ?2 OFFSET ?3;";
+
+
+// uploader is only in the metadata, keep the old one if it's not given
+static const char *replaceMediaSearchSQL =
+	"INSERT OR REPLACE INTO mediaSearch (rowid, title, url, uploader) VALUES (?1, ?2, ?3,"
+	" COALESCE(json_extract(?4, '$.uploader'), (SELECT uploader FROM mediaSearch WHERE rowid = ?1), ''));";
+
+
+// goes last, max position comes from the end of the index
+// 2 is MediaStatus::Ready
+static const char *insertPlaylistSQL =
+	"INSERT INTO playlist (media, position, ready)"
+	" SELECT id, COALESCE((SELECT MAX(position) FROM playlist), 0) + 1, status = 2 FROM media WHERE id = ?1;";
+
+
+static const char *removeMediaSearchSQL =
+	"DELETE FROM mediaSearch WHERE rowid = ?1;";
+
+
+// adds one finished history item to its media's stats
+// in DO UPDATE plain column names are the old values
+static const char *updateMediaStatsSQL =
+	"INSERT INTO mediaStats (media, playCount, completedCount, skippedCount, skipVotes, lastPlayed, averageWatched)"
+	" SELECT history.media, 1, history.finishReason IS 0, history.finishReason IS 1, history.skipCount, history.startTime"
+	", CASE WHEN media.length > 0 THEN MIN(1.0, MAX(0.0, (julianday(history.endTime) - julianday(history.startTime)) * 86400.0 / media.length)) ELSE 0.0 END"
+	" FROM history JOIN media ON media.id = history.media WHERE history.id = ?1"
+	" ON CONFLICT (media) DO UPDATE SET"
+	"  playCount      = playCount + 1"
+	", completedCount = completedCount + excluded.completedCount"
+	", skippedCount   = skippedCount + excluded.skippedCount"
+	", skipVotes      = skipVotes + excluded.skipVotes"
+	", lastPlayed     = MAX(lastPlayed, excluded.lastPlayed)"
+	", averageWatched = (averageWatched * playCount + excluded.averageWatched) / (playCount + 1);";
+
+
+// ids of history always grow so archive is everything up to some id
+// last one stays so new ids don't start over
+static const char *selectArchiveEndSQL =
+	"SELECT MAX(id) FROM (SELECT id FROM main.history"
+	" WHERE startTime < datetime('now', ?1) AND id < (SELECT MAX(id) FROM main.history)"
+	" ORDER BY id LIMIT ?2);";
+
+
+#define MILLISECONDS(column) "CAST(strftime('%s', " column ") AS INTEGER) * 1000 + CAST(substr(strftime('%f', " column "), 4) AS INTEGER)"
+
+// ignore because a crash can leave rows in both
+static const char *archiveHistorySQL =
+	"INSERT OR IGNORE INTO history_archive.history (id, media, queueTime, startTime, endTime, finishReason)"
+	" SELECT id, media, " MILLISECONDS("queueTime") ", " MILLISECONDS("startTime") ", " MILLISECONDS("endTime") ", finishReason"
+	" FROM main.history WHERE id <= ?1;";
+
+#undef MILLISECONDS
+
+
+static const char *removeArchivedHistorySQL =
+	"DELETE FROM main.history WHERE id <= ?1;";
+
+
+static const char *replaceArchiveMediaSQL =
+	"UPDATE history_archive.history SET media = ?1 WHERE media = ?2;";
+
+
+// continues below the live history, rows left in both by a crash are skipped
+static const char *selectArchivePageSQL =
+	"SELECT id, media, queueTime, startTime, endTime, finishReason FROM history_archive.history"
+	" WHERE id < MIN(?1, COALESCE((SELECT MIN(id) FROM main.history), ?1))"
+	" ORDER BY id DESC LIMIT ?2;";
+
+
+// adds stats of ?2 to ?1 when merging media
+static const char *mergeMediaStatsSQL =
+	"INSERT INTO mediaStats (media, playCount, completedCount, skippedCount, skipVotes, lastPlayed, averageWatched)"
+	" SELECT ?1, playCount, completedCount, skippedCount, skipVotes, lastPlayed, averageWatched FROM mediaStats WHERE media = ?2"
+	" ON CONFLICT (media) DO UPDATE SET"
+	"  playCount      = playCount + excluded.playCount"
+	", completedCount = completedCount + excluded.completedCount"
+	", skippedCount   = skippedCount + excluded.skippedCount"
+	", skipVotes      = skipVotes + excluded.skipVotes"
+	", lastPlayed     = MAX(lastPlayed, excluded.lastPlayed)"
+	", averageWatched = (averageWatched * playCount + excluded.averageWatched * excluded.playCount) / MAX(playCount + excluded.playCount, 1);";
+
+
+static const char *removeMediaStatsSQL =
+	"DELETE FROM mediaStats WHERE media = ?1;";
+
+
+template <typename Order> static auto selectMediaStatsQuery(Order order) {
+	Media       media;
+	MediaStats  mediaStats;
+
+	return select(mediaStats.media
+	            , mediaStats.playCount
+	            , mediaStats.completedCount
+	            , mediaStats.skippedCount
+	            , mediaStats.skipVotes
+	            , mediaStats.lastPlayed
+	            , mediaStats.averageWatched
+	            , media.status
+	            , media.url
+	            , media.filename
+	            , media.title
+	            , media.length
+	            , media.filesize
+	            , media.metadataTime
+	            , media.errorMessage
+	             )
+	       .from(mediaStats
+	             .join(media)
+	             .on(mediaStats.media == media.id)
+	            )
+	       .unconditionally()
+	       .order_by(order)
+	       .limit(parameter(sqlpp::unsigned_integral(), pageSize));
+}
+
+
+static auto selectMostPlayedQuery() {
+	MediaStats  mediaStats;
+
+	return selectMediaStatsQuery(mediaStats.playCount.desc());
+}
+
+
+static auto selectMostSkippedQuery() {
+	MediaStats  mediaStats;
+
+	return selectMediaStatsQuery(mediaStats.skippedCount.desc());
+}
+
+
+static auto selectRecentlyPlayedQuery() {
+	MediaStats  mediaStats;
+
+	return selectMediaStatsQuery(mediaStats.lastPlayed.desc());
+}
+
+
+// null sorts first so never played ones come before the rest
+static auto selectCachedMediaQuery() {
+	Media       media;
+	MediaStats  mediaStats;
+
+	return select(all_of(media), mediaStats.lastPlayed)
+	       .from(media
+	             .left_outer_join(mediaStats)
+	             .on(mediaStats.media == media.id)
+	            )
+	       .where(media.status == static_cast<int>(MediaStatus::Ready))
+	       .order_by(mediaStats.lastPlayed.asc());
+}
+
+
+template <typename Query> using PreparedStatement = decltype(std::declval<sqlpp::sqlite3::connection &>().prepare(std::declval<Query>()));
+
+
+// statements used by queries
+// prepared on every reader and on the writer
+struct ReadStatements {
+	PreparedStatement<decltype(selectAllMediaQuery())>        selectAllMedia;
+	PreparedStatement<decltype(selectCachedMediaQuery())>     selectCachedMedia;
+	PreparedStatement<decltype(selectChangesQuery())>         selectChanges;
+	PreparedStatement<decltype(selectHistoryPageQuery())>     selectHistoryPage;
+	PreparedStatement<decltype(selectMediaByIdQuery())>       selectMediaById;
+	PreparedStatement<decltype(selectMediaMetadataQuery())>   selectMediaMetadata;
+	PreparedStatement<decltype(selectMediaPageQuery())>       selectMediaPage;
+	PreparedStatement<decltype(selectMostPlayedQuery())>      selectMostPlayed;
+	PreparedStatement<decltype(selectMostSkippedQuery())>     selectMostSkipped;
+	PreparedStatement<decltype(selectPlaylistQuery())>        selectPlaylist;
+	PreparedStatement<decltype(selectRecentlyPlayedQuery())>  selectRecentlyPlayed;
+	RawStatement                                              searchMedia;
+	RawStatement                                              selectArchivePage;
+
+
+	explicit ReadStatements(sqlpp::sqlite3::connection &conn)
+	: selectAllMedia(conn.prepare(selectAllMediaQuery()))
+	, selectCachedMedia(conn.prepare(selectCachedMediaQuery()))
+	, selectChanges(conn.prepare(selectChangesQuery()))
+	, selectHistoryPage(conn.prepare(selectHistoryPageQuery()))
+	, selectMediaById(conn.prepare(selectMediaByIdQuery()))
+	, selectMediaMetadata(conn.prepare(selectMediaMetadataQuery()))
+	, selectMediaPage(conn.prepare(selectMediaPageQuery()))
+	, selectMostPlayed(conn.prepare(selectMostPlayedQuery()))
+	, selectMostSkipped(conn.prepare(selectMostSkippedQuery()))
+	, selectPlaylist(conn.prepare(selectPlaylistQuery()))
+	, selectRecentlyPlayed(conn.prepare(selectRecentlyPlayedQuery()))
+	, searchMedia(conn, searchMediaSQL)
+	, selectArchivePage(conn, selectArchivePageSQL)
+	{
+	}
+
+	ReadStatements()                                       = delete;
+
+	ReadStatements(const ReadStatements &other)            = delete;
+	ReadStatements &operator=(const ReadStatements &other) = delete;
+
+	ReadStatements(ReadStatements &&other)                 = delete;
+	ReadStatements &operator=(ReadStatements &&other)      = delete;
+
+	~ReadStatements()                                      = default;
+};
+
+
+// statements used by modifications
+// only prepared on the writer
+struct WriteStatements {
+	PreparedStatement<decltype(insertChangeQuery())>                 insertChange;
+	PreparedStatement<decltype(insertHistoryQuery())>                insertHistory;
+	PreparedStatement<decltype(insertMediaQuery())>                  insertMedia;
+	PreparedStatement<decltype(removeMediaQuery())>                  removeMedia;
+	PreparedStatement<decltype(removeMediaMetadataQuery())>          removeMediaMetadata;
+	PreparedStatement<decltype(removePlaylistItemQuery())>           removePlaylistItem;
+	PreparedStatement<decltype(removePlaylistMediaQuery())>          removePlaylistMedia;
+	PreparedStatement<decltype(replaceHistoryMediaQuery())>          replaceHistoryMedia;
+	PreparedStatement<decltype(replaceMediaMetadataQuery())>         replaceMediaMetadata;
+	PreparedStatement<decltype(replacePlaylistMediaQuery())>         replacePlaylistMedia;
+	PreparedStatement<decltype(selectMediaByIdQuery())>              selectMediaById;
+	PreparedStatement<decltype(selectMediaByURLQuery())>             selectMediaByURL;
+	PreparedStatement<decltype(selectMediaByVideoIdQuery())>         selectMediaByVideoId;
+	PreparedStatement<decltype(selectNextPlaylistItemQuery())>       selectNextPlaylistItem;
+	PreparedStatement<decltype(selectPlaylistIdByMediaQuery())>      selectPlaylistIdByMedia;
+	PreparedStatement<decltype(selectPlaylistAfterQuery())>          selectPlaylistAfter;
+	PreparedStatement<decltype(selectPlaylistBeforeQuery())>         selectPlaylistBefore;
+	PreparedStatement<decltype(selectPlaylistIdsByTwoMediaQuery())>  selectPlaylistIdsByTwoMedia;
+	PreparedStatement<decltype(selectPlaylistItemQuery())>           selectPlaylistItem;
+	PreparedStatement<decltype(selectPlaylistPositionQuery())>       selectPlaylistPosition;
+	PreparedStatement<decltype(updateHistoryQuery())>                updateHistory;
+	PreparedStatement<decltype(updateMediaQuery())>                  updateMedia;
+	PreparedStatement<decltype(updateMediaVideoIdQuery())>           updateMediaVideoId;
+	PreparedStatement<decltype(updatePlaylistPositionQuery())>       updatePlaylistPosition;
+	PreparedStatement<decltype(updatePlaylistReadyQuery())>          updatePlaylistReady;
+	RawStatement                                                     archiveHistory;
+	RawStatement                                                     insertPlaylist;
+	RawStatement                                                     mergeMediaStats;
+	RawStatement                                                     removeArchivedHistory;
+	RawStatement                                                     removeMediaSearch;
+	RawStatement                                                     removeMediaStats;
+	RawStatement                                                     replaceArchiveMedia;
+	RawStatement                                                     replaceMediaSearch;
+	RawStatement                                                     selectArchiveEnd;
+	RawStatement                                                     updateMediaStats;
+
+
+	explicit WriteStatements(sqlpp::sqlite3::connection &conn)
+	: insertChange(conn.prepare(insertChangeQuery()))
+	, insertHistory(conn.prepare(insertHistoryQuery()))
+	, insertMedia(conn.prepare(insertMediaQuery()))
+	, removeMedia(conn.prepare(removeMediaQuery()))
+	, removeMediaMetadata(conn.prepare(removeMediaMetadataQuery()))
+	, removePlaylistItem(conn.prepare(removePlaylistItemQuery()))
+	, removePlaylistMedia(conn.prepare(removePlaylistMediaQuery()))
+	, replaceHistoryMedia(conn.prepare(replaceHistoryMediaQuery()))
+	, replaceMediaMetadata(conn.prepare(replaceMediaMetadataQuery()))
+	, replacePlaylistMedia(conn.prepare(replacePlaylistMediaQuery()))
+	, selectMediaById(conn.prepare(selectMediaByIdQuery()))
+	, selectMediaByURL(conn.prepare(selectMediaByURLQuery()))
+	, selectMediaByVideoId(conn.prepare(selectMediaByVideoIdQuery()))
+	, selectNextPlaylistItem(conn.prepare(selectNextPlaylistItemQuery()))
+	, selectPlaylistIdByMedia(conn.prepare(selectPlaylistIdByMediaQuery()))
+	, selectPlaylistAfter(conn.prepare(selectPlaylistAfterQuery()))
+	, selectPlaylistBefore(conn.prepare(selectPlaylistBeforeQuery()))
+	, selectPlaylistIdsByTwoMedia(conn.prepare(selectPlaylistIdsByTwoMediaQuery()))
+	, selectPlaylistItem(conn.prepare(selectPlaylistItemQuery()))
+	, selectPlaylistPosition(conn.prepare(selectPlaylistPositionQuery()))
+	, updateHistory(conn.prepare(updateHistoryQuery()))
+	, updateMedia(conn.prepare(updateMediaQuery()))
+	, updateMediaVideoId(conn.prepare(updateMediaVideoIdQuery()))
+	, updatePlaylistPosition(conn.prepare(updatePlaylistPositionQuery()))
+	, updatePlaylistReady(conn.prepare(updatePlaylistReadyQuery()))
+	, archiveHistory(conn, archiveHistorySQL)
+	, insertPlaylist(conn, insertPlaylistSQL)
+	, mergeMediaStats(conn, mergeMediaStatsSQL)
+	, removeArchivedHistory(conn, removeArchivedHistorySQL)
+	, removeMediaSearch(conn, removeMediaSearchSQL)
+	, removeMediaStats(conn, removeMediaStatsSQL)
+	, replaceArchiveMedia(conn, replaceArchiveMediaSQL)
+	, replaceMediaSearch(conn, replaceMediaSearchSQL)
+	, selectArchiveEnd(conn, selectArchiveEndSQL)
+	, updateMediaStats(conn, updateMediaStatsSQL)
+	{
+	}
+
+	WriteStatements()                                        = delete;
+
+	WriteStatements(const WriteStatements &other)            = delete;
+	WriteStatements &operator=(const WriteStatements &other) = delete;
+
+	WriteStatements(WriteStatements &&other)                 = delete;
+	WriteStatements &operator=(WriteStatements &&other)      = delete;
+
+	~WriteStatements()                                       = default;
+};
+
+
+// every modification must call this in the same transaction
+static void recordChange(sqlpp::sqlite3::connection &conn, WriteStatements &stmts, ChangeKind kind, uint64_t item, uint64_t media) {
+	stmts.insertChange.params.kind  = static_cast<int>(kind);
+	stmts.insertChange.params.item  = item;
+	stmts.insertChange.params.media = media;
+	conn(stmts.insertChange);
+}
+
+
+// empty metadata keeps the old uploader
+static void updateSearch(WriteStatements &stmts, int64_t id, const std::string &title, const std::string &url, const std::string &metadata) {
+	auto &stmt = stmts.replaceMediaSearch;
+	stmt.bind(1, id);
+	stmt.bind(2, title);
+	stmt.bind(3, url);
+	if (metadata.empty()) {
+		stmt.bindNull(4);
+	} else {
+		stmt.bind(4, metadata);
+	}
+	stmt.execute();
+}
+
+
 struct Database::DatabaseImpl {
 	typedef  sqlpp::sqlite3::connection  Connection;
 
-	std::string                        dbFilename;
-	sqlpp::sqlite3::connection_config  dbConfig;
+	std::string                        dbFilename;
+	// in memory mode db lives in RAM and is saved to dbFilename by snapshot()
+	bool                               inMemory;
+	sqlpp::sqlite3::connection_config  dbConfig;
+
+	bool                               debugReverse;
+
+	// single writer connection, also used by reads if there are no readers
+	// modifications only happen on writerThread
+	std::mutex                         dbMutex;
+	Connection                         db;
+	// statements must be destroyed before their connection
+	std::unique_ptr<ReadStatements>    dbReadStatements;
+	std::unique_ptr<WriteStatements>   dbWriteStatements;
+
+	struct Reader {
+		Connection                       conn;
+		std::unique_ptr<ReadStatements>  statements;
+
+
+		explicit Reader(const sqlpp::sqlite3::connection_config &config)
+		: conn(config)
+		{
+		}
+
+		Reader()                               = delete;
+
+		Reader(const Reader &other)            = delete;
+		Reader &operator=(const Reader &other) = delete;
+
+		Reader(Reader &&other)                 = delete;
+		Reader &operator=(Reader &&other)      = delete;
+
+		~Reader() {
+			statements.reset();
+		}
+	};
+
+	// pool of read-only connections
+	// WAL mode lets these run concurrently with the writer
+	sqlpp::sqlite3::connection_config  readerConfig;
+	std::mutex                         readersMutex;
+	std::condition_variable            readersCV;
+	std::vector<std::unique_ptr<Reader> >  readers;
+	std::vector<Reader *>              freeReaders;
+
+	// a queued modification
+	struct WriteTask {
+		// runs inside the batch transaction
+		std::function<void(Connection &, WriteStatements &)>  run;
+		// runs after the batch is committed or rolled back
+		// with the exception if this task or the commit failed
+		std::function<void(std::exception_ptr)>               finish;
+	};
+
+	// modifications are queued to a single writer thread which runs
+	// several per transaction so they share a commit
+	std::mutex                         writeQueueMutex;
+	std::condition_variable            writeQueueCV;
+	std::deque<WriteTask>              writeQueue;
+	bool                               shutdownWriter;
+	unsigned int                       maxBatchSize;
+	std::thread                        writerThread;
+
+	// latest change whose commit callbacks have run
+	std::atomic<uint64_t>              committedVersion;
+	// changes up to this have been removed by maintenance
+	std::atomic<uint64_t>              prunedVersion;
+
+	// only used in memory mode, snapshot state is only touched by writerThread
+	::sqlite3                          *diskDb;
+	std::chrono::seconds               snapshotInterval;
+	bool                               snapshotPending;
+	std::chrono::steady_clock::time_point  nextSnapshot;
+	// maintenance changed something, writerThread makes a snapshot pending
+	std::atomic<bool>                  maintenanceWrote;
+
+	// done in short steps while the player is idle, protected by dbMutex
+	enum class MaintenanceStep : uint8_t {
+		  Archive
+		, PruneChanges
+		, CompressMetadata
+		, Optimize
+		, Vacuum
+		, Checkpoint
+	};
+
+	std::chrono::seconds               maintenanceInterval;
+	unsigned int                       vacuumPages;
+	MaintenanceStep                    maintenanceStep;
+	// 0 keeps all history
+	unsigned int                       historyDays;
+	std::string                        archiveFile;
+	unsigned int                       archiveBatch;
+	// clients further behind than this get a reset
+	unsigned int                       keepChanges;
+	unsigned int                       metadataBatch;
+	std::chrono::steady_clock::time_point  nextMaintenance;
+
+	// metadata compression dictionaries, trained once there's enough
+	// metadata. readers decompress so they have their own mutex
+	std::mutex                         dictionaryMutex;
+	std::unordered_map<int64_t, std::shared_ptr<const std::string> >  dictionaries;
+	// used for new rows, 0 is none
+	int64_t                            currentDictionary;
+	// metadata rows when training last found nothing in common, not tried
+	// again until there are twice as many. protected by dbMutex
+	int64_t                            untrainedRows;
+
+	Media                              media;
+	Playlist                           playlist;
+	History                            history;
+
+
+	DatabaseImpl()                                     = delete;
+
+	DatabaseImpl(const DatabaseImpl &other)            = delete;
+	DatabaseImpl &operator=(const DatabaseImpl &other) = delete;
+
+	DatabaseImpl(DatabaseImpl &&other)                 = delete;
+	DatabaseImpl &operator=(DatabaseImpl &&other)      = delete;
+
+	DatabaseImpl(const Config &config, const std::string &filename);
+
+	~DatabaseImpl();
+
+
+	template <typename T, typename F> T transactionValue(F && f) {
+		std::unique_lock<std::mutex> lock(dbMutex);
+		auto tx = start_transaction(db);
+
+		try {
+			auto result = f(db, *dbWriteStatements);
+
+			tx.commit();
+
+			return result;
+		} catch (...) {
+			tx.rollback();
+
+			throw;
+		}
+	}
+
+
+	void queueWriteTask(WriteTask &&task) {
+		std::unique_lock<std::mutex> lock(writeQueueMutex);
+		assert(!shutdownWriter);
+
+		writeQueue.emplace_back(std::move(task));
+		writeQueueCV.notify_one();
+	}
+
+
+	// queues f to run on the writer thread
+	// onCommit runs on the writer thread after the result is committed
+	// callbacks run in the order the writes were queued
+	// they must not wait for other writes or they deadlock
+	template <typename T, typename F, typename C> std::future<T> queueTransactionValue(F &&f, C &&onCommit) {
+		auto promise = std::make_shared<std::promise<T> >();
+		auto result  = std::make_shared<tl::optional<T> >();
+
+		WriteTask task;
+		task.run    = [f = std::forward<F>(f), result] (Connection &conn, WriteStatements &stmts) mutable {
+			*result = f(conn, stmts);
+		};
+		task.finish = [onCommit = std::forward<C>(onCommit), promise, result] (std::exception_ptr e) mutable {
+			if (e) {
+				promise->set_exception(e);
+				return;
+			}
+
+			try {
+				runCallback(onCommit, **result);
+			} catch (std::exception &callbackException) {
+				LOG_ERROR("Exception from database commit callback: {}", callbackException.what());
+			} catch (...) {
+				LOG_ERROR("Unknown exception from database commit callback");
+			}
+
+			promise->set_value(std::move(**result));
+		};
+
+		auto future = promise->get_future();
+		queueWriteTask(std::move(task));
+
+		return future;
+	}
+
+
+	template <typename F> std::future<void> queueTransaction(F &&f) {
+		auto promise = std::make_shared<std::promise<void> >();
+
+		WriteTask task;
+		task.run    = std::forward<F>(f);
+		task.finish = [promise] (std::exception_ptr e) {
+			if (e) {
+				promise->set_exception(e);
+			} else {
+				promise->set_value();
+			}
+		};
+
+		auto future = promise->get_future();
+		queueWriteTask(std::move(task));
+
+		return future;
+	}
+
+
+	void writerThreadFunc();
+
+	void runWriteBatch(std::vector<WriteTask> &batch);
+
+	void copyDatabase(::sqlite3 *dest, ::sqlite3 *src);
+
+	void snapshot();
+
+	bool snapshotDue() const {
+		return snapshotPending && std::chrono::steady_clock::now() >= nextSnapshot;
+	}
+
+	void markMaintenanceWrite();
+
+	void attachArchive(Connection &conn);
+
+	bool archiveHistory();
+
+	bool pruneChanges();
+
+	void loadDictionaries();
+
+	int64_t compressMetadata(const std::string &metadata, std::vector<uint8_t> &compressed);
+
+	std::string decompressMetadata(int64_t dictionary, const std::vector<uint8_t> &compressed);
+
+	int64_t dictionaryTrainingRows();
+
+	bool trainMetadataDictionary();
+
+	bool compressMetadataBatch();
+
+	bool runMaintenanceStep();
+
+
+	class ReaderLease {
+		DatabaseImpl  &impl;
+		Reader        *reader;
+
+
+		ReaderLease()                                    = delete;
+
+		ReaderLease(const ReaderLease &other)            = delete;
+		ReaderLease &operator=(const ReaderLease &other) = delete;
+
+		ReaderLease(ReaderLease &&other)                 = delete;
+		ReaderLease &operator=(ReaderLease &&other)      = delete;
+
+	public:
+
+		explicit ReaderLease(DatabaseImpl &impl_)
+		: impl(impl_)
+		, reader(nullptr)
+		{
+			std::unique_lock<std::mutex> lock(impl.readersMutex);
+			while (impl.freeReaders.empty()) {
+				impl.readersCV.wait(lock);
+			}
+
+			reader = impl.freeReaders.back();
+			impl.freeReaders.pop_back();
+		}
+
+
+		~ReaderLease() {
+			assert(reader);
+
+			std::unique_lock<std::mutex> lock(impl.readersMutex);
+			impl.freeReaders.push_back(reader);
+			impl.readersCV.notify_one();
+		}
+
+
+		Reader &get() {
+			assert(reader);
+			return *reader;
+		}
+	};
+
+
+	// for queries which don't modify the database
+	// runs on a reader connection without taking dbMutex
+	// safe to call from commit callbacks
+	template <typename T, typename F> T readTransactionValue(F && f) {
+		if (readers.empty()) {
+			return transactionValue<T>([&] (Connection &conn, WriteStatements & /* stmts */) {
+				return f(conn, *dbReadStatements);
+			});
+		}
+
+		ReaderLease lease(*this);
+		Reader &reader = lease.get();
+		Connection &conn = reader.conn;
+		auto tx = start_transaction(conn);
+
+		try {
+			auto result = f(conn, *reader.statements);
+
+			tx.commit();
+
+			return result;
+		} catch (...) {
+			tx.rollback();
+
+			throw;
+		}
+	}
+
+
+	// merges mediaInfo into oldId and changes its id to that
+	static void mergeMedia(Connection &conn, WriteStatements &stmts, MediaInfoId &mediaInfo, int oldId);
+
+	static MediaInfoId getOrAddMedia(Connection &conn, WriteStatements &stmts, const MediaInfo &entry);
+
+	// nothing if it's already there
+	static tl::optional<PlaylistItemMedia> appendToPlaylist(Connection &conn, WriteStatements &stmts, MediaId mediaId);
+
+	MediaInfoId getOrAddMediaByURL(const std::string &url, const std::string &extractor, const std::string &videoId);
+
+	std::future<tl::optional<PlaylistItemMedia> > addToPlaylist(MediaId media, std::function<void(const tl::optional<PlaylistItemMedia> &)> &&onCommit);
+
+	std::future<PlaylistBatch> addMediaToPlaylist(const std::vector<MediaInfo> &entries, std::function<void(const PlaylistBatch &)> &&onCommit);
+
+	std::future<std::vector<PlaylistItem> > movePlaylistItem(PlaylistItemId item, MoveDirection direction, std::function<void(const std::vector<PlaylistItem> &)> &&onCommit);
+
+	std::vector<PlaylistItemMedia> getPlaylist();
+
+	std::vector<HistoryItemMedia> getHistory(uint64_t before, unsigned int limit);
+
+	static void getArchivedHistory(Connection &conn, ReadStatements &stmts, int64_t before, unsigned int limit, std::vector<HistoryItemMedia> &retval);
+
+	std::vector<MediaInfoId> getAllMedia();
+
+	std::vector<MediaInfoId> getMedia(uint64_t before, unsigned int limit);
+
+	std::future<MediaInfoId> updateMediaInfo(const MediaInfoId &media, std::function<void(const MediaInfoId &)> &&onCommit);
+
+	MediaInfoId getMediaInfo(MediaId id);
+
+	std::string getMediaMetadata(MediaId id);
+
+	std::vector<Change> getChanges(uint64_t since, unsigned int limit);
+
+	std::vector<MediaInfoId> searchMedia(const std::string &query, unsigned int offset, unsigned int limit);
+
+	std::vector<PlayStatsMedia> getPlayStats(StatsOrder order, unsigned int limit);
+
+	std::vector<PlayStatsMedia> getCachedMedia();
+
+	void migrate();
+
+	std::future<tl::optional<HistoryItemMedia> > popNextPlaylistItem(std::function<void(const tl::optional<HistoryItemMedia> &)> &&onCommit);
+
+	void playlistItemFinished(const HistoryItemMedia &item);
+
+	void flush();
+};
+
+
+static bool parseMemoryMode(const std::string &mode) {
+	if (mode == "file") {
+		return false;
+	} else if (mode == "memory") {
+		return true;
+	}
+
+	throw std::runtime_error(fmt::format("Unknown database mode \"{}\"", mode));
+}
+
+
+Database::DatabaseImpl::DatabaseImpl(const Config &config, const std::string &filename)
+: dbFilename(filename)
+, inMemory(parseMemoryMode(config.get("database", "mode", "file")))
+, dbConfig(inMemory ? ":memory:" : dbFilename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)
+, debugReverse(config.getBool("database", "reverse", false))
+, db(dbConfig)
+, readerConfig(dbFilename, SQLITE_OPEN_READONLY)
+, shutdownWriter(false)
+, maxBatchSize(config.get("database", "maxBatchSize", 64))
+, committedVersion(0)
+, prunedVersion(0)
+, diskDb(nullptr)
+, snapshotInterval(std::max(config.get("database", "snapshotSeconds", 300u), 1u))
+, snapshotPending(false)
+, maintenanceWrote(false)
+, maintenanceInterval(config.get("database", "maintenanceSeconds", 3600u))
+, vacuumPages(std::max(config.get("database", "vacuumPages", 256u), 1u))
+, maintenanceStep(MaintenanceStep::Archive)
+, historyDays(config.get("database", "historyDays", 0u))
+, archiveFile(config.get("database", "archiveFile", "utuputki-archive.sqlite"))
+, archiveBatch(std::max(config.get("database", "archiveBatch", 1000u), 1u))
+, keepChanges(std::max(config.get("database", "keepChanges", 10000u), 1u))
+, metadataBatch(std::max(config.get("database", "metadataBatch", 1000u), 1u))
+, nextMaintenance(std::chrono::steady_clock::now())
+, currentDictionary(0)
+, untrainedRows(0)
+{
+	if (maxBatchSize == 0) {
+		maxBatchSize = 1;
+	}
+
+	LOG_INFO("Opening database {}", dbFilename);
+	LOG_INFO("Sqlite header version {}", sqlite3_version);
+	LOG_INFO("Sqlite linked library version {}", sqlite3_libversion());
+
+	static_assert(SQLITE_VERSION_NUMBER >= 300300, "sqlite 3.3 required for CREATE TABLE IF NOT EXISTS");
+	// TODO: do we need a tighter check here?
+	if (sqlite3_libversion_number() < SQLITE_VERSION_NUMBER) {
+		throw std::runtime_error(fmt::format("Runtime sqlite version {} is older than linktime version {}", sqlite3_version, sqlite3_libversion()));
+	}
+
+	// don't instantly fail on busy
+	db.execute("PRAGMA busy_timeout = 1000;");
+
+	// enable foreign key constraints
+	db.execute("PRAGMA foreign_keys = ON;");
+
+	// debugging option
+	if (debugReverse) {
+		LOG_DEBUG("PRAGMA reverse_unordered_selects = ON");
+		db.execute("PRAGMA reverse_unordered_selects = ON;");
+	}
+
+	// lets maintenance free pages a few at a time
+	// only takes effect on VACUUM or before anything is written, which
+	// includes switching to WAL
+	if (queryInteger(db, "PRAGMA auto_vacuum;") != 2) {
+		db.execute("PRAGMA auto_vacuum = INCREMENTAL;");
+	}
+
+	if (inMemory) {
+		LOG_INFO("Loading database into memory, saving every {} seconds", snapshotInterval.count());
+
+		if (sqlite3_open_v2(dbFilename.c_str(), &diskDb, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+			std::string error = sqlite3_errmsg(diskDb);
+			sqlite3_close(diskDb);
+			diskDb = nullptr;
+			throw std::runtime_error(fmt::format("Failed to open {}: {}", dbFilename, error));
+		}
+		sqlite3_busy_timeout(diskDb, 1000);
+
+		try {
+			auto start = std::chrono::steady_clock::now();
+			copyDatabase(db.native_handle(), diskDb);
+			auto end = std::chrono::steady_clock::now();
+			LOG_INFO("Loaded database in {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+		} catch (...) {
+			sqlite3_close(diskDb);
+			diskDb = nullptr;
+			throw;
+		}
+
+		// make sure migrations and created tables reach the disk
+		snapshotPending = true;
+		nextSnapshot    = std::chrono::steady_clock::now() + snapshotInterval;
+	} else {
+		// readers don't block the writer and vice versa
+		// this is persistent in the database file
+		db.execute("PRAGMA journal_mode = WAL;");
+	}
+
+	// keeps ANALYZE run by PRAGMA optimize short on big tables
+	db.execute("PRAGMA analysis_limit = 1000;");
+
+	// bring existing databases up to date before create script
+	// since it would create new tables with the new layout
+	migrate();
+
+	// create tables
+	// uses CREATE TABLE IF NOT EXISTS so should be idempotent
+	executeScript(db, std::string(reinterpret_cast<const char *>(&create_database_sql[0]), create_database_sql_length));
+	db.execute(fmt::format("PRAGMA user_version = {};", migrations.size()));
+
+	// always attached so history pages and merges don't need to check
+	attachArchive(db);
+	executeScript(db, createArchiveSQL);
+	if (!inMemory) {
+		db.execute("PRAGMA history_archive.journal_mode = WAL;");
+	}
+
+	// migration might already have done this
+	if (queryInteger(db, "PRAGMA auto_vacuum;") != 2) {
+		LOG_INFO("Vacuuming database to enable incremental vacuum");
+		db.execute("VACUUM;");
+	}
+
+	loadDictionaries();
+
+	// tables must exist before statements can be prepared
+	dbReadStatements.reset(new ReadStatements(db));
+	dbWriteStatements.reset(new WriteStatements(db));
+
+	committedVersion = queryInteger(db, "SELECT COALESCE(MAX(version), 0) FROM changes;");
+	prunedVersion    = queryInteger(db, "SELECT COALESCE(MIN(version) - 1, 0) FROM changes;");
+
+	// open readers only after tables exist, they can't create anything
+	unsigned int numReaders = config.get("database", "readers", 4);
+	if (inMemory) {
+		// other connections can't see the in-memory database
+		// reads from RAM are cheap enough to share the writer connection
+		numReaders = 0;
+	}
+	LOG_INFO("Opening {} reader connections", numReaders);
+	for (unsigned int i = 0; i < numReaders; i++) {
+		std::unique_ptr<Reader> reader(new Reader(readerConfig));
+
+		reader->conn.execute("PRAGMA busy_timeout = 1000;");
+		attachArchive(reader->conn);
+
+		if (debugReverse) {
+			reader->conn.execute("PRAGMA reverse_unordered_selects = ON;");
+		}
+
+		reader->statements.reset(new ReadStatements(reader->conn));
+
+		freeReaders.push_back(reader.get());
+		readers.emplace_back(std::move(reader));
+	}
+
+	writerThread = std::thread(std::bind(&DatabaseImpl::writerThreadFunc, this));
+}
+
+
+void Database::DatabaseImpl::migrate() {
+	int64_t version = queryInteger(db, "PRAGMA user_version;");
+	if (version > static_cast<int64_t>(migrations.size())) {
+		throw std::runtime_error(fmt::format("Database version {} is newer than supported version {}", version, migrations.size()));
+	}
+
+	bool existing = queryInteger(db, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'media';") != 0;
+	if (!existing) {
+		// new database, create script makes the current version
+		return;
+	}
+
+	if (version == static_cast<int64_t>(migrations.size())) {
+		return;
+	}
+
+	// needed to drop columns
+	static_assert(SQLITE_VERSION_NUMBER >= 3035000, "sqlite 3.35 required for ALTER TABLE DROP COLUMN");
+
+	// copying a table other tables refer to would fail the drop
+	// can't be changed inside a transaction so check by hand instead
+	db.execute("PRAGMA foreign_keys = OFF;");
+
+	for (; version < static_cast<int64_t>(migrations.size()); version++) {
+		LOG_INFO("Migrating database from version {} to {}", version, version + 1);
+
+		auto tx = start_transaction(db);
+		try {
+			executeScript(db, migrations[version]);
+			if (queryInteger(db, "SELECT COUNT(*) FROM pragma_foreign_key_check;") != 0) {
+				throw std::runtime_error(fmt::format("Migration to version {} broke foreign keys", version + 1));
+			}
+			db.execute(fmt::format("PRAGMA user_version = {};", version + 1));
+
+			tx.commit();
+		} catch (...) {
+			tx.rollback();
+			db.execute("PRAGMA foreign_keys = ON;");
+
+			throw;
+		}
+	}
+
+	db.execute("PRAGMA foreign_keys = ON;");
+
+	// migrations can leave lots of free pages behind
+	LOG_INFO("Vacuuming database after migration");
+	db.execute("VACUUM;");
+}
+
+
+Database::DatabaseImpl::~DatabaseImpl() {
+	// writer finishes what's already queued before exiting
+	{
+		std::unique_lock<std::mutex> lock(writeQueueMutex);
+		shutdownWriter = true;
+		writeQueueCV.notify_one();
+	}
+
+	writerThread.join();
+	assert(writeQueue.empty());
+
+	// all leases must have been returned
+	assert(freeReaders.size() == readers.size());
+
+	if (diskDb) {
+		if (snapshotPending || maintenanceWrote) {
+			try {
+				snapshot();
+			} catch (std::exception &e) {
+				LOG_ERROR("Failed to save database on shutdown: {}", e.what());
+			}
+		}
+
+		sqlite3_close(diskDb);
+		diskDb = nullptr;
+	}
 
-	bool                               debugReverse;
+	dbWriteStatements.reset();
+	dbReadStatements.reset();
+}
 
-	std::mutex                         dbMutex;
-	Connection                         db;
 
-	Media                              media;
-	Playlist                           playlist;
-	History                            history;
+Database::Database(const Config &config)
+: impl(new DatabaseImpl(config, config.get("database", "file", "utuputki.sqlite")))
+{
+}
 
 
-	DatabaseImpl()                                     = delete;
+Database::Database(const Config &config, const std::string &filename)
+: impl(new DatabaseImpl(config, filename))
+{
+}
 
-	DatabaseImpl(const DatabaseImpl &other)            = delete;
-	DatabaseImpl &operator=(const DatabaseImpl &other) = delete;
 
-	DatabaseImpl(DatabaseImpl &&other)                 = delete;
-	DatabaseImpl &operator=(DatabaseImpl &&other)      = delete;
+Database::~Database() {
+}
 
-	explicit DatabaseImpl(const Config &config);
 
-	~DatabaseImpl();
+void Database::DatabaseImpl::writerThreadFunc() {
+	std::vector<WriteTask> batch;
+	batch.reserve(maxBatchSize);
 
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(writeQueueMutex);
+			while (writeQueue.empty() && !shutdownWriter && !snapshotDue() && !maintenanceWrote) {
+				if (snapshotPending) {
+					writeQueueCV.wait_until(lock, nextSnapshot);
+				} else {
+					writeQueueCV.wait(lock);
+				}
+			}
 
-	template <typename T, typename F> T transactionValue(F && f) {
-		std::unique_lock<std::mutex> lock(dbMutex);
-		auto tx = start_transaction(db);
+			if (writeQueue.empty() && shutdownWriter) {
+				// shutting down and everything is written
+				// destructor saves the final snapshot
+				break;
+			}
 
-		try {
-			auto result = f(db);
+			while (!writeQueue.empty() && batch.size() < maxBatchSize) {
+				batch.emplace_back(std::move(writeQueue.front()));
+				writeQueue.pop_front();
+			}
+		}
 
-			tx.commit();
+		if (!batch.empty()) {
+			runWriteBatch(batch);
+			batch.clear();
+		}
 
-			return result;
-		} catch (...) {
-			tx.rollback();
+		if (maintenanceWrote.exchange(false) && !snapshotPending) {
+			snapshotPending = true;
+			nextSnapshot    = std::chrono::steady_clock::now() + snapshotInterval;
+		}
 
-			throw;
+		if (snapshotDue()) {
+			try {
+				snapshot();
+			} catch (std::exception &e) {
+				// keep running from memory and try again later
+				LOG_ERROR("Failed to save database snapshot: {}", e.what());
+				nextSnapshot = std::chrono::steady_clock::now() + snapshotInterval;
+			}
 		}
 	}
+}
+
+
+void Database::DatabaseImpl::copyDatabase(::sqlite3 *dest, ::sqlite3 *src) {
+	sqlite3_backup *backup = sqlite3_backup_init(dest, "main", src, "main");
+	if (!backup) {
+		throw std::runtime_error(fmt::format("Failed to start database copy: {}", sqlite3_errmsg(dest)));
+	}
+
+	// all in one step, source is locked for the duration
+	int retval = sqlite3_backup_step(backup, -1);
+	sqlite3_backup_finish(backup);
+
+	if (retval != SQLITE_DONE) {
+		throw std::runtime_error(fmt::format("Database copy failed: {}", sqlite3_errstr(retval)));
+	}
+}
+
 
+void Database::DatabaseImpl::snapshot() {
+	assert(inMemory);
+	assert(diskDb);
 
-	template <typename F> void transaction(F && f) {
+	auto start = std::chrono::steady_clock::now();
+
+	{
+		std::unique_lock<std::mutex> lock(dbMutex);
+		copyDatabase(diskDb, db.native_handle());
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	LOG_INFO("Saved database snapshot to {} in {} ms", dbFilename, std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+
+	snapshotPending = false;
+}
+
+
+void Database::DatabaseImpl::runWriteBatch(std::vector<WriteTask> &batch) {
+	LOG_DEBUG("writing batch of {}", batch.size());
+
+	// each task gets a savepoint so a failing one doesn't take the others with it
+	std::vector<std::exception_ptr> errors(batch.size());
+	std::exception_ptr batchError;
+	uint64_t batchVersion = 0;
+
+	{
 		std::unique_lock<std::mutex> lock(dbMutex);
-		auto tx = start_transaction(db);
 
 		try {
-			f(db);
+			auto tx = start_transaction(db);
+
+			try {
+				for (unsigned int i = 0; i < batch.size(); i++) {
+					db.execute("SAVEPOINT task;");
+
+					try {
+						batch[i].run(db, *dbWriteStatements);
+					} catch (std::exception &e) {
+						LOG_ERROR("Database write failed: {}", e.what());
+						errors[i] = std::current_exception();
+					} catch (...) {
+						LOG_ERROR("Database write failed with unknown exception");
+						errors[i] = std::current_exception();
+					}
+
+					if (errors[i]) {
+						db.execute("ROLLBACK TO task;");
+					}
+					db.execute("RELEASE task;");
+				}
 
-			tx.commit();
+				tx.commit();
+
+				batchVersion = queryInteger(db, "SELECT COALESCE(MAX(version), 0) FROM changes;");
+			} catch (...) {
+				tx.rollback();
+
+				throw;
+			}
+		} catch (std::exception &e) {
+			LOG_ERROR("Database batch commit failed: {}", e.what());
+			batchError = std::current_exception();
 		} catch (...) {
-			tx.rollback();
+			LOG_ERROR("Database batch commit failed with unknown exception");
+			batchError = std::current_exception();
+		}
+	}
 
-			throw;
+	// outside dbMutex so callbacks can read
+	for (unsigned int i = 0; i < batch.size(); i++) {
+		batch[i].finish(batchError ? batchError : errors[i]);
+	}
+
+	// only now are all changes in this batch visible to everyone
+	if (batchVersion != 0) {
+		committedVersion.store(batchVersion);
+	}
+
+	// loss window starts from the first change not on disk
+	if (inMemory && !batchError && !snapshotPending) {
+		snapshotPending = true;
+		nextSnapshot    = std::chrono::steady_clock::now() + snapshotInterval;
+	}
+}
+
+
+// maintenance doesn't go through the writer so tell it there's something
+// to save, called with dbMutex held
+void Database::DatabaseImpl::markMaintenanceWrite() {
+	if (!inMemory) {
+		return;
+	}
+
+	maintenanceWrote = true;
+
+	std::unique_lock<std::mutex> lock(writeQueueMutex);
+	writeQueueCV.notify_one();
+}
+
+
+void Database::DatabaseImpl::attachArchive(Connection &conn) {
+	RawStatement attach(conn, "ATTACH DATABASE ?1 AS history_archive;");
+	attach.bind(1, archiveFile);
+	attach.execute();
+}
+
+
+// moves one batch, true if something was moved
+// called with dbMutex held
+bool Database::DatabaseImpl::archiveHistory() {
+	auto &stmts = *dbWriteStatements;
+
+	auto &end = stmts.selectArchiveEnd;
+	end.bind(1, fmt::format("-{} days", historyDays));
+	end.bind(2, archiveBatch);
+	bool found = end.step() && !end.columnIsNull(0);
+	int64_t lastId = found ? end.columnInteger(0) : 0;
+	end.reset();
+
+	if (!found) {
+		return false;
+	}
+
+	auto tx = start_transaction(db);
+	try {
+		stmts.archiveHistory.bind(1, lastId);
+		stmts.archiveHistory.execute();
+
+		stmts.removeArchivedHistory.bind(1, lastId);
+		stmts.removeArchivedHistory.execute();
+		LOG_DEBUG("Archived {} history items up to {}", stmts.removeArchivedHistory.changes(), lastId);
+
+		tx.commit();
+	} catch (...) {
+		tx.rollback();
+
+		throw;
+	}
+
+	return true;
+}
+
+
+// changes removed per maintenance step
+static const uint64_t changesBatch = 10000;
+
+
+// removes one batch of changes older than keepChanges versions, true if
+// something was removed
+// called with dbMutex held
+bool Database::DatabaseImpl::pruneChanges() {
+	uint64_t committed = committedVersion.load();
+	if (committed <= keepChanges) {
+		return false;
+	}
+
+	uint64_t pruned = prunedVersion.load();
+	uint64_t end    = std::min(committed - keepChanges, pruned + changesBatch);
+	if (end <= pruned) {
+		return false;
+	}
+
+	// before the delete so readers which might not see those rows anymore
+	// know to reset
+	prunedVersion.store(end);
+
+	RawStatement remove(db, "DELETE FROM changes WHERE version <= ?1;");
+	remove.bind(1, static_cast<int64_t>(end));
+	remove.execute();
+	LOG_DEBUG("Removed {} changes up to version {}", remove.changes(), end);
+
+	return true;
+}
+
+
+void Database::DatabaseImpl::loadDictionaries() {
+	RawStatement select(db, "SELECT id, dictionary FROM metadataDictionary ORDER BY id;");
+	while (select.step()) {
+		auto dictionary = select.columnBlob(1);
+		currentDictionary = select.columnInteger(0);
+		dictionaries[currentDictionary] = std::make_shared<const std::string>(dictionary.begin(), dictionary.end());
+	}
+	select.reset();
+
+	if (currentDictionary != 0) {
+		LOG_INFO("Metadata dictionary {} is {} bytes", currentDictionary, dictionaries[currentDictionary]->size());
+	}
+}
+
+
+// returns the dictionary used
+int64_t Database::DatabaseImpl::compressMetadata(const std::string &metadata, std::vector<uint8_t> &compressed) {
+	int64_t id = 0;
+	std::shared_ptr<const std::string> dictionary;
+	{
+		std::unique_lock<std::mutex> lock(dictionaryMutex);
+		id = currentDictionary;
+		if (id != 0) {
+			dictionary = dictionaries.at(id);
 		}
 	}
 
+	compressed = deflateMetadata(metadata, dictionary.get());
 
-	MediaInfoId getOrAddMediaByURL(const std::string &url);
+	return id;
+}
 
-	void addToPlaylist(MediaId media);
 
-	std::vector<PlaylistItemMedia> getPlaylist();
+std::string Database::DatabaseImpl::decompressMetadata(int64_t dictionary, const std::vector<uint8_t> &compressed) {
+	std::shared_ptr<const std::string> d;
+	if (dictionary != 0) {
+		std::unique_lock<std::mutex> lock(dictionaryMutex);
+		auto it = dictionaries.find(dictionary);
+		if (it == dictionaries.end()) {
+			throw std::runtime_error(fmt::format("Unknown metadata dictionary {}", dictionary));
+		}
+		d = it->second;
+	}
 
-	std::vector<HistoryItemMedia> getHistory();
+	return inflateMetadata(compressed, d.get());
+}
 
-	std::vector<MediaInfoId> getAllMedia();
 
-	void updateMediaInfo(MediaInfoId &media);
+// fewer than this don't say much about the rest
+static const int64_t minDictionarySamples = 100;
 
-	MediaInfoId getMediaInfo(MediaId id);
 
-	tl::optional<HistoryItemMedia> popNextPlaylistItem();
+// metadata rows to train a dictionary from, 0 if it's not time for that
+// called with dbMutex held
+int64_t Database::DatabaseImpl::dictionaryTrainingRows() {
+	{
+		std::unique_lock<std::mutex> lock(dictionaryMutex);
+		if (currentDictionary != 0) {
+			return 0;
+		}
+	}
+
+	// counting all of them would read the whole table
+	int64_t needed = std::max(minDictionarySamples, 2 * untrainedRows);
+	RawStatement count(db, "SELECT COUNT(*) FROM (SELECT 1 FROM mediaMetadata LIMIT ?1);");
+	count.bind(1, needed);
+	int64_t rows = count.step() ? count.columnInteger(0) : 0;
+	count.reset();
 
-	void playlistItemFinished(const HistoryItemMedia &item);
-};
+	return (rows >= needed) ? rows : 0;
+}
 
 
-Database::DatabaseImpl::DatabaseImpl(const Config &config)
-: dbFilename(config.get("database", "file", "utuputki.sqlite"))
-, dbConfig(dbFilename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)
-, debugReverse(config.getBool("database", "reverse", false))
-, db(dbConfig)
-{
-	LOG_INFO("Opening database {}", dbFilename);
-	LOG_INFO("Sqlite header version {}", sqlite3_version);
-	LOG_INFO("Sqlite linked library version {}", sqlite3_libversion());
+// true if one was made
+// called without dbMutex, only the insert takes it
+bool Database::DatabaseImpl::trainMetadataDictionary() {
+	auto start = std::chrono::steady_clock::now();
 
-	static_assert(SQLITE_VERSION_NUMBER >= 300300, "sqlite 3.3 required for CREATE TABLE IF NOT EXISTS");
-	// TODO: do we need a tighter check here?
-	if (sqlite3_libversion_number() < SQLITE_VERSION_NUMBER) {
-		throw std::runtime_error(fmt::format("Runtime sqlite version {} is older than linktime version {}", sqlite3_version, sqlite3_libversion()));
+	auto samples = readTransactionValue<std::vector<std::string> >([&] (Connection &conn, ReadStatements & /* stmts */) {
+		std::vector<std::string> retval;
+		RawStatement select(conn, "SELECT dictionary, metadata FROM mediaMetadata ORDER BY media DESC LIMIT 1000;");
+		while (select.step()) {
+			auto metadata = select.columnBlob(1);
+			if (select.columnIsNull(0)) {
+				retval.emplace_back(metadata.begin(), metadata.end());
+			} else {
+				retval.push_back(decompressMetadata(select.columnInteger(0), metadata));
+			}
+		}
+		select.reset();
+
+		return retval;
+	});
+
+	// deflate can't look further back than its window
+	std::string dictionary = trainDictionary(samples, 32768);
+	if (dictionary.empty()) {
+		LOG_INFO("Metadata has nothing in common, not making a dictionary");
+		return false;
 	}
 
-	// don't instantly fail on busy
-	db.execute("PRAGMA busy_timeout = 1000;");
+	size_t size = dictionary.size();
+	int64_t id  = 0;
+	{
+		std::unique_lock<std::mutex> lock(dbMutex);
+		RawStatement insert(db, "INSERT INTO metadataDictionary (dictionary) VALUES (?1);");
+		insert.bind(1, std::vector<uint8_t>(dictionary.begin(), dictionary.end()));
+		insert.execute();
+		id = insert.lastInsertId();
+	}
 
-	// enable foreign key constraints
-	db.execute("PRAGMA foreign_keys = ON;");
+	{
+		std::unique_lock<std::mutex> lock(dictionaryMutex);
+		dictionaries[id]  = std::make_shared<const std::string>(std::move(dictionary));
+		currentDictionary = id;
+	}
 
-	// debugging option
-	if (debugReverse) {
-		LOG_DEBUG("PRAGMA reverse_unordered_selects = ON");
-		db.execute("PRAGMA reverse_unordered_selects = ON;");
+	LOG_INFO("Trained {} byte metadata dictionary {} from {} samples in {} ms", size, id, samples.size(), std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+	return true;
+}
+
+
+// compresses one batch of rows not using the current dictionary
+// true if something was done
+// called with dbMutex held
+bool Database::DatabaseImpl::compressMetadataBatch() {
+	int64_t current = 0;
+	{
+		std::unique_lock<std::mutex> lock(dictionaryMutex);
+		current = currentDictionary;
 	}
 
-	// create tables
-	// uses CREATE TABLE IF NOT EXISTS so should be idempotent
-	std::string createTables(reinterpret_cast<const char *>(&create_database_sql[0]), create_database_sql_length);
-	while (true) {
-		auto semicol = createTables.find_first_of(';');
-		if (semicol == std::string::npos) {
-			break;
+	std::vector<std::pair<int64_t, std::string> > rows;
+	uint64_t oldBytes = 0;
+	RawStatement select(db, "SELECT media, dictionary, metadata FROM mediaMetadata WHERE dictionary IS NULL OR dictionary < ?1 OR dictionary > ?1 LIMIT ?2;");
+	select.bind(1, current);
+	select.bind(2, metadataBatch);
+	while (select.step()) {
+		auto metadata = select.columnBlob(2);
+		oldBytes += metadata.size();
+		if (select.columnIsNull(1)) {
+			rows.emplace_back(select.columnInteger(0), std::string(metadata.begin(), metadata.end()));
+		} else {
+			rows.emplace_back(select.columnInteger(0), decompressMetadata(select.columnInteger(1), metadata));
 		}
+	}
+	select.reset();
 
-		// TODO: c++17 string_view
-		std::string table = createTables.substr(0, semicol);
-		db.execute(table);
-		createTables = createTables.substr(semicol + 1);
+	if (rows.empty()) {
+		return false;
+	}
+
+	uint64_t newBytes = 0;
+	auto tx = start_transaction(db);
+	try {
+		RawStatement update(db, "UPDATE mediaMetadata SET dictionary = ?2, metadata = ?3 WHERE media = ?1;");
+		for (const auto &row : rows) {
+			std::vector<uint8_t> compressed;
+			int64_t dictionary = compressMetadata(row.second, compressed);
+			newBytes += compressed.size();
+
+			update.bind(1, row.first);
+			update.bind(2, dictionary);
+			update.bind(3, compressed);
+			update.execute();
+		}
+
+		tx.commit();
+	} catch (...) {
+		tx.rollback();
+
+		throw;
+	}
+
+	LOG_DEBUG("Compressed metadata of {} media from {} to {} bytes", rows.size(), oldBytes, newBytes);
+
+	return true;
+}
+
+
+bool Database::DatabaseImpl::runMaintenanceStep() {
+	std::unique_lock<std::mutex> lock(dbMutex);
+
+	auto start = std::chrono::steady_clock::now();
+	if (start < nextMaintenance) {
+		return false;
+	}
+
+	try {
+		switch (maintenanceStep) {
+		case MaintenanceStep::Archive:
+			if (historyDays > 0 && archiveHistory()) {
+				markMaintenanceWrite();
+				LOG_DEBUG("Archived history in {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+				break;
+			}
+
+			maintenanceStep = MaintenanceStep::PruneChanges;
+			break;
+
+		case MaintenanceStep::PruneChanges:
+			if (pruneChanges()) {
+				markMaintenanceWrite();
+				LOG_DEBUG("Pruned changes in {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+				break;
+			}
+
+			maintenanceStep = MaintenanceStep::CompressMetadata;
+			break;
+
+		case MaintenanceStep::CompressMetadata: {
+			int64_t trainingRows = dictionaryTrainingRows();
+			if (trainingRows != 0) {
+				// sampling and training take a while, let writes through
+				lock.unlock();
+				bool trained = false;
+				try {
+					trained = trainMetadataDictionary();
+				} catch (...) {
+					lock.lock();
+					throw;
+				}
+				lock.lock();
+
+				if (trained) {
+					markMaintenanceWrite();
+					break;
+				}
+
+				untrainedRows = trainingRows;
+			}
+
+			if (compressMetadataBatch()) {
+				markMaintenanceWrite();
+				LOG_DEBUG("Metadata compression step took {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+				break;
+			}
+
+			maintenanceStep = MaintenanceStep::Optimize;
+		} break;
+
+		case MaintenanceStep::Optimize:
+			db.execute("PRAGMA optimize;");
+			LOG_DEBUG("PRAGMA optimize took {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+			maintenanceStep = MaintenanceStep::Vacuum;
+			break;
+
+		case MaintenanceStep::Vacuum: {
+			int64_t freePages = queryInteger(db, "PRAGMA freelist_count;");
+			if (freePages > 0) {
+				// frees one page per step, RawStatement steps until done
+				RawStatement vacuum(db, fmt::format("PRAGMA incremental_vacuum({});", vacuumPages).c_str());
+				vacuum.execute();
+				LOG_DEBUG("Freed {} of {} free pages in {} ms", std::min(freePages, int64_t(vacuumPages)), freePages, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+				if (freePages > vacuumPages) {
+					break;
+				}
+			}
+
+			maintenanceStep = MaintenanceStep::Checkpoint;
+		} break;
+
+		case MaintenanceStep::Checkpoint:
+			// passive doesn't wait for readers
+			if (!inMemory) {
+				RawStatement checkpoint(db, "PRAGMA wal_checkpoint(PASSIVE);");
+				if (checkpoint.step()) {
+					LOG_DEBUG("Checkpointed {} of {} WAL pages in {} ms", checkpoint.columnInteger(2), checkpoint.columnInteger(1), std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+				}
+				checkpoint.reset();
+			}
+
+			LOG_INFO("Database maintenance done");
+			maintenanceStep = MaintenanceStep::Archive;
+			nextMaintenance = std::chrono::steady_clock::now() + maintenanceInterval;
+			return false;
+		}
+	} catch (std::exception &e) {
+		LOG_ERROR("Database maintenance failed: {}", e.what());
+		maintenanceStep = MaintenanceStep::Archive;
+		nextMaintenance = std::chrono::steady_clock::now() + maintenanceInterval;
+		return false;
 	}
+
+	return true;
+}
+
+
+void Database::DatabaseImpl::flush() {
+	// queue is processed in order so when this is done everything before it is too
+	queueTransaction([] (Connection & /* conn */, WriteStatements & /* stmts */) {
+	}).get();
+}
+
+
+MediaInfoId Database::getOrAddMediaByURL(const std::string &url, const std::string &extractor, const std::string &videoId) {
+	assert(impl);
+	assert(!url.empty());
+
+	return impl->getOrAddMediaByURL(url, extractor, videoId);
+}
+
+
+tl::optional<PlaylistItemMedia> Database::addToPlaylist(MediaId mediaId, std::function<void(const tl::optional<PlaylistItemMedia> &)> onCommit) {
+	assert(impl);
+
+	return impl->addToPlaylist(mediaId, std::move(onCommit)).get();
+}
+
+
+PlaylistBatch Database::addMediaToPlaylist(const std::vector<MediaInfo> &entries, std::function<void(const PlaylistBatch &)> onCommit) {
+	assert(impl);
+
+	return impl->addMediaToPlaylist(entries, std::move(onCommit)).get();
+}
+
+
+std::vector<PlaylistItem> Database::movePlaylistItem(PlaylistItemId item, MoveDirection direction, std::function<void(const std::vector<PlaylistItem> &)> onCommit) {
+	assert(impl);
+
+	return impl->movePlaylistItem(item, direction, std::move(onCommit)).get();
+}
+
+
+std::vector<PlaylistItemMedia> Database::getPlaylist() {
+	assert(impl);
+
+	return impl->getPlaylist();
+}
+
+
+std::vector<HistoryItemMedia> Database::getHistory(uint64_t before, unsigned int limit) {
+	assert(impl);
+
+	return impl->getHistory(before, limit);
 }
 
 
-Database::DatabaseImpl::~DatabaseImpl() {
+std::vector<MediaInfoId> Database::getAllMedia() {
+	assert(impl);
+
+	return impl->getAllMedia();
 }
 
 
-Database::Database(const Config &config)
-: impl(new DatabaseImpl(config))
-{
+std::vector<MediaInfoId> Database::getMedia(uint64_t before, unsigned int limit) {
+	assert(impl);
+
+	return impl->getMedia(before, limit);
 }
 
 
-Database::~Database() {
+std::future<MediaInfoId> Database::updateMediaInfo(const MediaInfoId &media, std::function<void(const MediaInfoId &)> onCommit) {
+	assert(impl);
+
+	return impl->updateMediaInfo(media, std::move(onCommit));
 }
 
 
-MediaInfoId Database::getOrAddMediaByURL(const std::string &url) {
+std::vector<PlayStatsMedia> Database::getCachedMedia() {
 	assert(impl);
-	assert(!url.empty());
 
-	return impl->getOrAddMediaByURL(url);
+	return impl->getCachedMedia();
 }
 
 
-void Database::addToPlaylist(MediaId mediaId) {
+std::vector<PlayStatsMedia> Database::getPlayStats(StatsOrder order, unsigned int limit) {
 	assert(impl);
 
-	return impl->addToPlaylist(mediaId);
+	return impl->getPlayStats(order, limit);
 }
 
 
-std::vector<PlaylistItemMedia> Database::getPlaylist() {
+std::vector<MediaInfoId> Database::searchMedia(const std::string &query, unsigned int offset, unsigned int limit) {
 	assert(impl);
 
-	return impl->getPlaylist();
+	return impl->searchMedia(query, offset, limit);
 }
 
 
-std::vector<HistoryItemMedia> Database::getHistory() {
+uint64_t Database::getVersion() {
 	assert(impl);
 
-	return impl->getHistory();
+	return impl->committedVersion.load();
 }
 
 
-std::vector<MediaInfoId> Database::getAllMedia() {
+std::vector<Change> Database::getChanges(uint64_t since, unsigned int limit) {
 	assert(impl);
 
-	return impl->getAllMedia();
+	return impl->getChanges(since, limit);
 }
 
 
-void Database::updateMediaInfo(MediaInfoId &media) {
+std::string Database::getMediaMetadata(MediaId id) {
 	assert(impl);
 
-	return impl->updateMediaInfo(media);
+	return impl->getMediaMetadata(id);
 }
 
 
@@ -241,10 +2559,18 @@ MediaInfoId Database::getMediaInfo(MediaId id) {
 }
 
 
-tl::optional<HistoryItemMedia> Database::popNextPlaylistItem() {
+tl::optional<HistoryItemMedia> Database::popNextPlaylistItem(std::function<void(const tl::optional<HistoryItemMedia> &)> onCommit) {
 	assert(impl);
 
-	return impl->popNextPlaylistItem();
+	try {
+		return impl->popNextPlaylistItem(std::move(onCommit)).get();
+	} catch (sqlpp::exception &e) {
+		LOG_ERROR("caught sqlpp_exception in popNextPlaylistItem: {}", e.what());
+		return tl::optional<HistoryItemMedia>();
+	} catch (...) {
+        LOG_ERROR("caught unknown exception in popNextPlaylistItem");
+		return tl::optional<HistoryItemMedia>();
+	}
 }
 
 
@@ -255,103 +2581,241 @@ void Database::playlistItemFinished(const HistoryItemMedia &item) {
 }
 
 
-MediaInfoId Database::DatabaseImpl::getOrAddMediaByURL(const std::string &url) {
-	return transactionValue<MediaInfoId>([&] (Connection &conn) {
-		auto stmt = conn.prepare(select(all_of(media))
-		                        .from(media)
-		                        .where(media.url == parameter(media.url))
-		                        );
+void Database::flush() {
+	assert(impl);
 
-		stmt.params.url = url;
+	impl->flush();
+}
 
-		auto result = conn(stmt);
 
-		if (result.empty()) {
-			// does not exist yet, create it
-			// must use prepared statement because sqlpp11 doesn't handle
-			// strings correctly without it
-			auto ins = conn.prepare(insert_into(media)
-			                       .set(media.url = parameter(media.url))
-			                       );
+bool Database::maintenanceStep() {
+	assert(impl);
+
+	return impl->runMaintenanceStep();
+}
+
+
+MediaInfoId Database::DatabaseImpl::getOrAddMedia(Connection &conn, WriteStatements &stmts, const MediaInfo &entry) {
+	const std::string &url       = entry.url;
+	const std::string &extractor = entry.extractor;
+	const std::string &videoId   = entry.videoId;
+	assert(!url.empty());
+
+	if (!videoId.empty()) {
+		// might already have it under another url
+		stmts.selectMediaByVideoId.params.extractor = extractor;
+		stmts.selectMediaByVideoId.params.videoId   = videoId;
+		auto result = conn(stmts.selectMediaByVideoId);
+		if (!result.empty()) {
+			const auto &row = result.front();
 
-			ins.params.url = url;
-			auto newId = conn(ins);
+			MediaInfoId ret(MediaId(row.id));
+			mediaFromRow(ret, row);
+			finishResult(result);
 
-			// fetch the newly added row
-			result = conn(select(all_of(media))
-			             .from(media)
-			             .where(media.id == newId)
-			             );
-			assert(!result.empty());
+			ret.extractor = extractor;
+			ret.videoId   = videoId;
+
+			return ret;
 		}
+	}
 
-		const auto &row = result.front();
+	stmts.selectMediaByURL.params.url = url;
+
+	auto result = conn(stmts.selectMediaByURL);
+
+	if (result.empty()) {
+		// does not exist yet, create it
+		auto &ins = stmts.insertMedia.params;
+		ins.url = url;
+		// playlist entries come with these, metadata replaces them later
+		if (entry.title.empty()) {
+			ins.title.set_null();
+			ins.length.set_null();
+		} else {
+			ins.title  = entry.title;
+			ins.length = entry.length;
+		}
+		if (videoId.empty()) {
+			ins.extractor.set_null();
+			ins.videoId.set_null();
+		} else {
+			ins.extractor = extractor;
+			ins.videoId   = videoId;
+		}
+		conn(stmts.insertMedia);
 
-		MediaInfoId ret(MediaId(row.id));
-		mediaFromRow(ret, row);
+		// fetch the newly added row
+		result = conn(stmts.selectMediaByURL);
+		assert(!result.empty());
 
-		// must be the only one
-		result.pop_front();
-		assert(result.empty());
+		recordChange(conn, stmts, ChangeKind::MediaUpdated, result.front().id, result.front().id);
 
-		return ret;
-	});
+		updateSearch(stmts, result.front().id, entry.title, url, std::string());
+	} else if (!videoId.empty() && result.front().videoId.is_null()) {
+		// added before video ids were known
+		stmts.updateMediaVideoId.params.id        = result.front().id;
+		stmts.updateMediaVideoId.params.extractor = extractor;
+		stmts.updateMediaVideoId.params.videoId   = videoId;
+		conn(stmts.updateMediaVideoId);
+	}
+
+	const auto &row = result.front();
+
+	MediaInfoId ret(MediaId(row.id));
+	mediaFromRow(ret, row);
+	ret.extractor = extractor;
+	ret.videoId   = videoId;
+
+	// must be the only one
+	result.pop_front();
+	assert(result.empty());
+
+	return ret;
 }
 
 
-void Database::DatabaseImpl::addToPlaylist(MediaId mediaId) {
+tl::optional<PlaylistItemMedia> Database::DatabaseImpl::appendToPlaylist(Connection &conn, WriteStatements &stmts, MediaId mediaId) {
 	assert(mediaId.id != 0);
 
-	transaction([&mediaId, this] (Connection &conn) {
-		auto sel = conn.prepare(select(playlist.id)
-		                        .from(playlist)
-		                        .where(playlist.media == parameter(playlist.media))
-		                       );
+	stmts.selectPlaylistIdByMedia.params.media = mediaId.id;
+	auto result = conn(stmts.selectPlaylistIdByMedia);
+	if (!result.empty()) {
+		LOG_INFO("{} is already on playlist", mediaId.id);
+		finishResult(result);
+		return tl::optional<PlaylistItemMedia>();
+	}
 
-		sel.params.media = mediaId.id;
-		auto result = conn(sel);
-		if (!result.empty()) {
-			LOG_INFO("{} is already on playlist", mediaId.id);
-			return;
+	stmts.insertPlaylist.bind(1, mediaId.id);
+	stmts.insertPlaylist.execute();
+	if (stmts.insertPlaylist.changes() == 0) {
+		throw std::runtime_error(fmt::format("No media {} to add to playlist", mediaId.id));
+	}
+	auto newId = stmts.insertPlaylist.lastInsertId();
+	recordChange(conn, stmts, ChangeKind::PlaylistAdded, newId, mediaId.id);
+
+	LOG_DEBUG("new playlist id {}", newId);
+
+	// fetch the newly added row
+	stmts.selectPlaylistItem.params.id = newId;
+	auto newResult = conn(stmts.selectPlaylistItem);
+	assert(!newResult.empty());
+
+	const auto &row = newResult.front();
+	PlaylistItemMedia p(PlaylistItemId(row.id), MediaId(row.media));
+	p.queueTime = timeFromDB(row.queueTime);
+	p.position  = row.position;
+	mediaFromRow(p, row);
+
+	finishResult(newResult);
+
+	return tl::optional<PlaylistItemMedia>(std::move(p));
+}
+
+
+MediaInfoId Database::DatabaseImpl::getOrAddMediaByURL(const std::string &url, const std::string &extractor, const std::string &videoId) {
+	MediaInfo entry;
+	entry.url       = url;
+	entry.extractor = extractor;
+	entry.videoId   = videoId;
+
+	return queueTransactionValue<MediaInfoId>([entry] (Connection &conn, WriteStatements &stmts) {
+		return getOrAddMedia(conn, stmts, entry);
+	}, [] (const MediaInfoId & /* media */) {
+	}).get();
+}
+
+
+std::future<tl::optional<PlaylistItemMedia> > Database::DatabaseImpl::addToPlaylist(MediaId mediaId, std::function<void(const tl::optional<PlaylistItemMedia> &)> &&onCommit) {
+	assert(mediaId.id != 0);
+
+	return queueTransactionValue<tl::optional<PlaylistItemMedia> >([mediaId] (Connection &conn, WriteStatements &stmts) {
+		return appendToPlaylist(conn, stmts, mediaId);
+	}, std::move(onCommit));
+}
+
+
+std::future<PlaylistBatch> Database::DatabaseImpl::addMediaToPlaylist(const std::vector<MediaInfo> &entries, std::function<void(const PlaylistBatch &)> &&onCommit) {
+	return queueTransactionValue<PlaylistBatch>([entries] (Connection &conn, WriteStatements &stmts) {
+		PlaylistBatch batch;
+		batch.media.reserve(entries.size());
+		for (const auto &entry : entries) {
+			auto mediaInfo = getOrAddMedia(conn, stmts, entry);
+			auto item      = appendToPlaylist(conn, stmts, mediaInfo.id);
+			if (item) {
+				batch.added.emplace_back(std::move(*item));
+			}
+			batch.media.emplace_back(std::move(mediaInfo));
 		}
 
-		auto ins = conn.prepare(insert_into(playlist)
-		                        .set(playlist.media = parameter(playlist.media))
-		                       );
+		return batch;
+	}, std::move(onCommit));
+}
+
 
-		ins.params.media = mediaId.id;
-		auto newId = conn(ins);
+std::future<std::vector<PlaylistItem> > Database::DatabaseImpl::movePlaylistItem(PlaylistItemId item, MoveDirection direction, std::function<void(const std::vector<PlaylistItem> &)> &&onCommit) {
+	assert(item.id != 0);
 
-		LOG_DEBUG("new playlist id {}", newId);
-	});
+	return queueTransactionValue<std::vector<PlaylistItem> >([item, direction] (Connection &conn, WriteStatements &stmts) {
+		std::vector<PlaylistItem> moved;
+
+		stmts.selectPlaylistPosition.params.id = item.id;
+		auto result = conn(stmts.selectPlaylistPosition);
+		if (result.empty()) {
+			LOG_INFO("Playlist item {} not found for moving", item.id);
+			return moved;
+		}
+
+		moved.emplace_back(PlaylistItemId(result.front().id), MediaId(result.front().media));
+		moved[0].position = result.front().position;
+		finishResult(result);
+
+		// swap places with the neighbour in that direction, if any
+		auto swapWith = [&] (auto &stmt) {
+			stmt.params.position = moved[0].position;
+			auto neighbour = conn(stmt);
+			if (neighbour.empty()) {
+				return;
+			}
+
+			moved.emplace_back(PlaylistItemId(neighbour.front().id), MediaId(neighbour.front().media));
+			moved[1].position = neighbour.front().position;
+			finishResult(neighbour);
+		};
+
+		if (direction == MoveDirection::Up) {
+			swapWith(stmts.selectPlaylistBefore);
+		} else {
+			swapWith(stmts.selectPlaylistAfter);
+		}
+
+		if (moved.size() < 2) {
+			// already at the end
+			moved.clear();
+			return moved;
+		}
+
+		std::swap(moved[0].position, moved[1].position);
+		for (const auto &m : moved) {
+			stmts.updatePlaylistPosition.params.id       = m.id.id;
+			stmts.updatePlaylistPosition.params.position = m.position;
+			conn(stmts.updatePlaylistPosition);
+
+			recordChange(conn, stmts, ChangeKind::PlaylistMoved, m.id.id, m.media.id);
+		}
+
+		return moved;
+	}, std::move(onCommit));
 }
 
 
 std::vector<PlaylistItemMedia> Database::DatabaseImpl::getPlaylist() {
-	return transactionValue<std::vector<PlaylistItemMedia> > ([&] (Connection &conn) {
+	return readTransactionValue<std::vector<PlaylistItemMedia> > ([&] (Connection &conn, ReadStatements &stmts) {
 		std::vector<PlaylistItemMedia> retval;
-		for (const auto &row : conn(select(playlist.id
-										, playlist.media
-										, playlist.queueTime
-										, media.status
-										, media.url
-										, media.filename
-										, media.title
-										, media.length
-										, media.filesize
-										, media.metadata
-										, media.metadataTime
-										, media.errorMessage
-									   )
-								  .from(playlist
-										.join(media)
-										.on(playlist.media == media.id)
-									   )
-								  .unconditionally()
-								  .order_by(playlist.queueTime.asc())
-								)) {
+		for (const auto &row : conn(stmts.selectPlaylist)) {
 			PlaylistItemMedia p(PlaylistItemId(row.id), MediaId(row.media));
 			p.queueTime = timeFromDB(row.queueTime);
+			p.position  = row.position;
 			mediaFromRow(p, row);
 			retval.emplace_back(std::move(p));
 		}
@@ -361,34 +2825,24 @@ std::vector<PlaylistItemMedia> Database::DatabaseImpl::getPlaylist() {
 }
 
 
-std::vector<HistoryItemMedia> Database::DatabaseImpl::getHistory() {
-	return transactionValue<std::vector<HistoryItemMedia> > ([&] (Connection &conn) {
+// ids start at 1 so 0 can mean "start from the newest"
+static int64_t pageStart(uint64_t before) {
+	if (before == 0 || before > uint64_t(std::numeric_limits<int64_t>::max())) {
+		return std::numeric_limits<int64_t>::max();
+	}
+
+	return static_cast<int64_t>(before);
+}
+
+
+std::vector<HistoryItemMedia> Database::DatabaseImpl::getHistory(uint64_t before, unsigned int limit) {
+	return readTransactionValue<std::vector<HistoryItemMedia> > ([&] (Connection &conn, ReadStatements &stmts) {
+		stmts.selectHistoryPage.params.id       = pageStart(before);
+		stmts.selectHistoryPage.params.pageSize = limit;
+
 		std::vector<HistoryItemMedia> retval;
-		for (const auto &row : conn(select(history.id
-										, history.media
-										, history.queueTime
-										, history.startTime
-										, history.endTime
-										, history.finishReason
-										, history.skipCount
-										, history.skipsNeeded
-										, media.status
-										, media.url
-										, media.filename
-										, media.title
-										, media.length
-										, media.filesize
-										, media.metadata
-										, media.metadataTime
-										, media.errorMessage
-									   )
-								  .from(history
-										.join(media)
-										.on(history.media == media.id)
-									   )
-								  .unconditionally()
-								  .order_by(history.queueTime.asc())
-								)) {
+		retval.reserve(limit);
+		for (const auto &row : conn(stmts.selectHistoryPage)) {
 			HistoryItemMedia p(HistoryItemId(row.id), MediaId(row.media));
 			p.queueTime     = timeFromDB(row.queueTime);
 			p.startTime     = timeFromDB(row.startTime);
@@ -400,19 +2854,105 @@ std::vector<HistoryItemMedia> Database::DatabaseImpl::getHistory() {
 			retval.emplace_back(std::move(p));
 		}
 
+		if (retval.size() < limit) {
+			getArchivedHistory(conn, stmts, retval.empty() ? pageStart(before) : retval.back().id.id, limit - retval.size(), retval);
+		}
+
 		return retval;
 	});
 }
 
 
+static Timestamp timeFromMilliseconds(int64_t ms) {
+	return Timestamp(std::chrono::duration_cast<Duration>(std::chrono::milliseconds(ms)));
+}
+
+
+void Database::DatabaseImpl::getArchivedHistory(Connection &conn, ReadStatements &stmts, int64_t before, unsigned int limit, std::vector<HistoryItemMedia> &retval) {
+	struct Archived {
+		int64_t  id;
+		int64_t  media;
+		int64_t  queueTime;
+		int64_t  startTime;
+		// not finished if null
+		tl::optional<int64_t>  endTime;
+		tl::optional<int64_t>  finishReason;
+	};
+
+	std::vector<Archived> archived;
+	archived.reserve(limit);
+
+	auto &page = stmts.selectArchivePage;
+	page.bind(1, before);
+	page.bind(2, limit);
+	try {
+		while (page.step()) {
+			Archived a;
+			a.id           = page.columnInteger(0);
+			a.media        = page.columnInteger(1);
+			a.queueTime    = page.columnInteger(2);
+			a.startTime    = page.columnInteger(3);
+			if (!page.columnIsNull(4)) {
+				a.endTime      = page.columnInteger(4);
+			}
+			if (!page.columnIsNull(5)) {
+				a.finishReason = page.columnInteger(5);
+			}
+			archived.push_back(a);
+		}
+	} catch (...) {
+		page.reset();
+		throw;
+	}
+	page.reset();
+
+	// skip counts are not archived
+	for (const auto &a : archived) {
+		stmts.selectMediaById.params.id = a.media;
+		auto result = conn(stmts.selectMediaById);
+		if (result.empty()) {
+			continue;
+		}
+
+		HistoryItemMedia p(HistoryItemId(a.id), MediaId(a.media));
+		p.queueTime     = timeFromMilliseconds(a.queueTime);
+		p.startTime     = timeFromMilliseconds(a.startTime);
+		if (a.endTime) {
+			p.endTime       = timeFromMilliseconds(*a.endTime);
+		}
+		if (a.finishReason) {
+			p.historyStatus = static_cast<HistoryStatus>(*a.finishReason);
+		}
+		mediaFromRow(p, result.front());
+		retval.emplace_back(std::move(p));
+
+		finishResult(result);
+	}
+}
+
+
 std::vector<MediaInfoId> Database::DatabaseImpl::getAllMedia() {
-	return transactionValue<std::vector<MediaInfoId> > ([&] (Connection &conn) {
+	return readTransactionValue<std::vector<MediaInfoId> > ([&] (Connection &conn, ReadStatements &stmts) {
+		std::vector<MediaInfoId> retval;
+		for (const auto &row : conn(stmts.selectAllMedia)) {
+			MediaInfoId m(MediaId(row.id));
+			mediaFromRow(m, row);
+			retval.emplace_back(std::move(m));
+		}
+
+		return retval;
+	});
+}
+
+
+std::vector<MediaInfoId> Database::DatabaseImpl::getMedia(uint64_t before, unsigned int limit) {
+	return readTransactionValue<std::vector<MediaInfoId> > ([&] (Connection &conn, ReadStatements &stmts) {
+		stmts.selectMediaPage.params.id       = pageStart(before);
+		stmts.selectMediaPage.params.pageSize = limit;
+
 		std::vector<MediaInfoId> retval;
-		for (const auto &row : conn(select(all_of(media))
-								  .from(media)
-								  .unconditionally()
-								  .order_by(media.id.asc())
-								)) {
+		retval.reserve(limit);
+		for (const auto &row : conn(stmts.selectMediaPage)) {
 			MediaInfoId m(MediaId(row.id));
 			mediaFromRow(m, row);
 			retval.emplace_back(std::move(m));
@@ -423,88 +2963,112 @@ std::vector<MediaInfoId> Database::DatabaseImpl::getAllMedia() {
 }
 
 
-void Database::DatabaseImpl::updateMediaInfo(MediaInfoId &mediaInfo) {
-	transaction([&] (Connection &conn) {
-		auto oldResult = conn(select(all_of(media))
-							.from(media)
-							.where(media.id == mediaInfo.id.id)
-						   );
+// caller updates oldId with the rest of mediaInfo
+void Database::DatabaseImpl::mergeMedia(Connection &conn, WriteStatements &stmts, MediaInfoId &mediaInfo, int oldId) {
+	// playlist can contain both the old and new ids
+	// if dupes, need to remove second
+	stmts.selectPlaylistIdsByTwoMedia.params.media      = oldId;
+	stmts.selectPlaylistIdsByTwoMedia.params.otherMedia = mediaInfo.id.id;
+
+	std::vector<int> oldIds;
+	for (const auto &row : conn(stmts.selectPlaylistIdsByTwoMedia)) {
+		oldIds.push_back(row.id);
+	}
+
+	LOG_DEBUG("oldIds.size() = {}", oldIds.size());
+	if (oldIds.size() > 1) {
+		assert(oldIds.size() == 2);
+		stmts.removePlaylistItem.params.id = oldIds[1];
+		conn(stmts.removePlaylistItem);
+	}
+
+	// update playlist to point old to new
+	stmts.replacePlaylistMedia.params.media      = oldId;
+	stmts.replacePlaylistMedia.params.otherMedia = mediaInfo.id.id;
+	conn(stmts.replacePlaylistMedia);
+
+	// new has been played if it was found by video id
+	stmts.replaceHistoryMedia.params.media      = oldId;
+	stmts.replaceHistoryMedia.params.otherMedia = mediaInfo.id.id;
+	conn(stmts.replaceHistoryMedia);
+
+	stmts.replaceArchiveMedia.bind(1, oldId);
+	stmts.replaceArchiveMedia.bind(2, mediaInfo.id.id);
+	stmts.replaceArchiveMedia.execute();
+
+	stmts.mergeMediaStats.bind(1, oldId);
+	stmts.mergeMediaStats.bind(2, mediaInfo.id.id);
+	stmts.mergeMediaStats.execute();
+
+	stmts.removeMediaStats.bind(1, mediaInfo.id.id);
+	stmts.removeMediaStats.execute();
+
+	// delete new
+	// metadata of the old one is replaced by caller if we have any
+	stmts.removeMediaMetadata.params.media = mediaInfo.id.id;
+	conn(stmts.removeMediaMetadata);
+
+	stmts.removeMedia.params.id = mediaInfo.id.id;
+	conn(stmts.removeMedia);
+
+	stmts.removeMediaSearch.bind(1, mediaInfo.id.id);
+	stmts.removeMediaSearch.execute();
+
+	// set id to old so the following update updates it
+	mediaInfo.id = MediaId(oldId);
+
+	// playlist items were moved around, let clients reload
+	recordChange(conn, stmts, ChangeKind::Reset, oldId, oldId);
+}
+
+
+std::future<MediaInfoId> Database::DatabaseImpl::updateMediaInfo(const MediaInfoId &newMediaInfo, std::function<void(const MediaInfoId &)> &&onCommit) {
+	return queueTransactionValue<MediaInfoId>([this, mediaInfo = newMediaInfo] (Connection &conn, WriteStatements &stmts) mutable {
+		stmts.selectMediaById.params.id = mediaInfo.id.id;
+		auto oldResult = conn(stmts.selectMediaById);
 
-		assert(!oldResult.empty());
+		// could have been merged into another by an earlier queued update
+		if (oldResult.empty()) {
+			throw std::runtime_error(fmt::format("No media {} to update", mediaInfo.id.id));
+		}
 		auto &old = oldResult.front();
 		assert(mediaInfo.id.id == static_cast<unsigned int>(old.id));
+		std::string oldURL = old.url;
 
-		if (mediaInfo.url != static_cast<std::string>(old.url)) {
-			// if url changed need to check if we should remove this one
-			LOG_INFO("Media {} URL changed from \"{}\" to \"{}\"", mediaInfo.id.id, static_cast<std::string>(old.url), mediaInfo.url);
-			// fetch old id
-			auto otherGet = conn.prepare(select(all_of(media))
-										 .from(media)
-										 .where(media.url == parameter(media.url))
-										);
+		// must be only one result from fetch
+		oldResult.pop_front();
+		assert(oldResult.empty());
 
-			otherGet.params.url = mediaInfo.url;
-			auto otherResult = conn(otherGet);
+		if (mediaInfo.url != oldURL) {
+			// if url changed need to check if we should remove this one
+			LOG_INFO("Media {} URL changed from \"{}\" to \"{}\"", mediaInfo.id.id, oldURL, mediaInfo.url);
+			stmts.selectMediaByURL.params.url = mediaInfo.url;
+			auto otherResult = conn(stmts.selectMediaByURL);
 
 			if (!otherResult.empty()) {
-				LOG_INFO("otherResult has things");
-
-				const auto &otherRow = otherResult.front();
-				int oldId            = otherRow.id;
-				// history can't contain the new id yet
-
-				// playlist can contain both the old and new ids
-				// if dupes, need to remove second
-				auto oldPlaylist = conn(select(playlist.id)
-										.from(playlist)
-										.where(playlist.media == oldId
-											   || playlist.media == mediaInfo.id.id)
-										.order_by(playlist.queueTime.asc())
-									   );
-
-				std::vector<int> oldIds;
-				for (const auto &row : oldPlaylist) {
-					oldIds.push_back(row.id);
-				}
+				int oldId = otherResult.front().id;
+				finishResult(otherResult);
 
-				LOG_DEBUG("oldIds.size() = {}", oldIds.size());
-				if (oldIds.size() > 1) {
-					assert(oldIds.size() == 2);
-					conn(remove_from(playlist)
-						 .where(playlist.id == oldIds[1])
-						);
-				}
+				mergeMedia(conn, stmts, mediaInfo, oldId);
+			}
+		}
 
-				// update playlist to point old to new
-				conn(update(playlist)
-					 .set(playlist.media   =  oldId)
-					 .where(playlist.media == mediaInfo.id.id)
-					);
+		// same video under a different url
+		if (!mediaInfo.videoId.empty()) {
+			stmts.selectMediaByVideoId.params.extractor = mediaInfo.extractor;
+			stmts.selectMediaByVideoId.params.videoId   = mediaInfo.videoId;
+			auto otherResult = conn(stmts.selectMediaByVideoId);
 
-				// delete new
-				conn(remove_from(media)
-					 .where(media.id == mediaInfo.id.id)
-					);
+			if (!otherResult.empty() && static_cast<unsigned int>(otherResult.front().id) != mediaInfo.id.id) {
+				int oldId = otherResult.front().id;
+				finishResult(otherResult);
 
-				// set id to old so the following update updates it
-				mediaInfo.id = MediaId(oldId);
-			} else {
-				LOG_INFO("otherResult is empty");
+				LOG_INFO("Media {} is the same video {} {} as {}", mediaInfo.id.id, mediaInfo.extractor, mediaInfo.videoId, oldId);
+				mergeMedia(conn, stmts, mediaInfo, oldId);
 			}
 		}
 
-		auto up = conn.prepare(update(media)
-							 .set(media.status   = parameter(media.status)
-								, media.url      = parameter(media.url)
-								, media.filename = parameter(media.filename)
-								, media.title    = parameter(media.title)
-								, media.length   = parameter(media.length)
-								, media.filesize = parameter(media.filesize)
-								, media.metadata = parameter(media.metadata)
-								, media.metadataTime = parameter(media.metadataTime)
-								, media.errorMessage = parameter(media.errorMessage))
-							 .where(media.id == parameter(media.id))
-							);
+		auto &up = stmts.updateMedia;
 
 		up.params.id           = mediaInfo.id.id;
 		up.params.url          = mediaInfo.url;
@@ -513,33 +3077,66 @@ void Database::DatabaseImpl::updateMediaInfo(MediaInfoId &mediaInfo) {
 		up.params.length       = mediaInfo.length;
 		up.params.filesize     = mediaInfo.filesize;
 		up.params.status       = static_cast<int>(mediaInfo.status);
-		up.params.metadata     = mediaInfo.metadata;
 		up.params.metadataTime = timeToDB(mediaInfo.metadataTime);
 		up.params.errorMessage = mediaInfo.errorMessage;
 
 		conn(up);
+		recordChange(conn, stmts, ChangeKind::MediaUpdated, mediaInfo.id.id, mediaInfo.id.id);
+
+		// empty means it wasn't loaded, keep the old one
+		if (!mediaInfo.videoId.empty()) {
+			stmts.updateMediaVideoId.params.id        = mediaInfo.id.id;
+			stmts.updateMediaVideoId.params.extractor = mediaInfo.extractor;
+			stmts.updateMediaVideoId.params.videoId   = mediaInfo.videoId;
+			conn(stmts.updateMediaVideoId);
+		}
+
+		stmts.updatePlaylistReady.params.ready = (mediaInfo.status == MediaStatus::Ready);
+		stmts.updatePlaylistReady.params.media = mediaInfo.id.id;
+		conn(stmts.updatePlaylistReady);
+
+		// empty means it wasn't loaded, keep the old one
+		if (!mediaInfo.metadata.empty()) {
+			std::vector<uint8_t> compressed;
+			int64_t dictionary = compressMetadata(mediaInfo.metadata, compressed);
+
+			stmts.replaceMediaMetadata.params.media      = mediaInfo.id.id;
+			stmts.replaceMediaMetadata.params.dictionary = dictionary;
+			stmts.replaceMediaMetadata.params.metadata   = compressed;
+			conn(stmts.replaceMediaMetadata);
+		}
+
+		updateSearch(stmts, mediaInfo.id.id, mediaInfo.title, mediaInfo.url, mediaInfo.metadata);
 
 		// if status is failed remove from playlist
 		if (mediaInfo.status == MediaStatus::Failed) {
 			LOG_INFO("Media {} {} \"{}\" status is failed, removing from playlist", mediaInfo.id.id, mediaInfo.url, mediaInfo.title);
-			conn(remove_from(playlist).where(playlist.media == mediaInfo.id.id));
+
+			std::vector<int64_t> removedIds;
+			stmts.selectPlaylistIdByMedia.params.media = mediaInfo.id.id;
+			for (const auto &row : conn(stmts.selectPlaylistIdByMedia)) {
+				removedIds.push_back(row.id);
+			}
+
+			stmts.removePlaylistMedia.params.media = mediaInfo.id.id;
+			conn(stmts.removePlaylistMedia);
+
+			for (auto id : removedIds) {
+				recordChange(conn, stmts, ChangeKind::PlaylistRemoved, id, mediaInfo.id.id);
+			}
 		}
 
-		// must be only one result from fetch
-		oldResult.pop_front();
-		assert(oldResult.empty());
-	});
+		return mediaInfo;
+	}, std::move(onCommit));
 }
 
 
 MediaInfoId Database::DatabaseImpl::getMediaInfo(MediaId id) {
-	return transactionValue<MediaInfoId>([&] (Connection &conn) {
+	return readTransactionValue<MediaInfoId>([&] (Connection &conn, ReadStatements &stmts) {
 		MediaInfoId mediaInfo(id);
 
-		auto result = conn(select(all_of(media))
-						 .from(media)
-						 .where(media.id == id.id)
-						);
+		stmts.selectMediaById.params.id = id.id;
+		auto result = conn(stmts.selectMediaById);
 
 		if (result.empty()) {
 			throw std::runtime_error("No media for MediaId (how did you make that?)");
@@ -548,82 +3145,227 @@ MediaInfoId Database::DatabaseImpl::getMediaInfo(MediaId id) {
 		const auto &row = result.front();
 		mediaFromRow(mediaInfo, row);
 
+		finishResult(result);
+
 		return mediaInfo;
 	});
 }
 
 
-tl::optional<HistoryItemMedia> Database::DatabaseImpl::popNextPlaylistItem() {
-	try {
-		return transactionValue<tl::optional<HistoryItemMedia> >([&] (Connection &conn) {
-			auto result = conn(select(playlist.id
-								  , playlist.media
-								  , playlist.queueTime
-								  , media.status
-								  , media.url
-								  , media.filename
-								  , media.title
-								  , media.length
-								  , media.filesize
-								  , media.metadata
-								  , media.metadataTime
-								  , media.errorMessage
-								 )
-							 .from(playlist
-								   .join(media)
-								   .on(playlist.media == media.id)
-								  )
-							 .where(media.status == static_cast<int>(MediaStatus::Ready))
-							 .order_by(playlist.queueTime.asc())
-							 .limit(1U)
-							);
+std::vector<MediaInfoId> Database::DatabaseImpl::searchMedia(const std::string &query, unsigned int offset, unsigned int limit) {
+	std::string match = makeMatchQuery(query);
+	if (match.empty()) {
+		return std::vector<MediaInfoId>();
+	}
 
+	return readTransactionValue<std::vector<MediaInfoId> >([&] (Connection &conn, ReadStatements &stmts) {
+		std::vector<int64_t> ids;
+
+		auto &search = stmts.searchMedia;
+		search.bind(1, match);
+		search.bind(2, limit);
+		search.bind(3, offset);
+		try {
+			while (search.step()) {
+				ids.push_back(search.columnInteger(0));
+			}
+		} catch (...) {
+			search.reset();
+			throw;
+		}
+		search.reset();
+
+		// a page is small so fetch them one at a time
+		std::vector<MediaInfoId> retval;
+		retval.reserve(ids.size());
+		for (auto id : ids) {
+			stmts.selectMediaById.params.id = id;
+			auto result = conn(stmts.selectMediaById);
 			if (result.empty()) {
-				return tl::optional<HistoryItemMedia>();
+				continue;
 			}
 
 			const auto &row = result.front();
+			MediaInfoId m(MediaId(row.id));
+			mediaFromRow(m, row);
+			retval.emplace_back(std::move(m));
 
-			conn(remove_from(playlist).where(playlist.id == row.id));
-			auto historyId = conn(insert_into(history).set(history.media     = row.media
-													   , history.queueTime = row.queueTime));
+			finishResult(result);
+		}
 
-			HistoryItemMedia p(HistoryItemId(historyId), MediaId(row.media));
-			p.queueTime = timeFromDB(row.queueTime);
-			p.startTime = Timestamp::clock::now();
-			mediaFromRow(p, row);
+		return retval;
+	});
+}
 
-			return tl::optional<HistoryItemMedia>(p);
-		});
-	} catch (sqlpp::exception &e) {
-		LOG_ERROR("caught sqlpp_exception in popNextPlaylistItem: {}", e.what());
-		return tl::optional<HistoryItemMedia>();
-	} catch (...) {
-        LOG_ERROR("caught unknown exception in popNextPlaylistItem");
-		return tl::optional<HistoryItemMedia>();
+
+std::vector<PlayStatsMedia> Database::DatabaseImpl::getPlayStats(StatsOrder order, unsigned int limit) {
+	return readTransactionValue<std::vector<PlayStatsMedia> >([&] (Connection &conn, ReadStatements &stmts) {
+		// statements differ only in order so their types differ too
+		auto fetch = [&] (auto &stmt) {
+			stmt.params.pageSize = limit;
+
+			std::vector<PlayStatsMedia> retval;
+			retval.reserve(limit);
+			for (const auto &row : conn(stmt)) {
+				PlayStatsMedia m(MediaId(row.media));
+				m.playCount      = row.playCount;
+				m.completedCount = row.completedCount;
+				m.skippedCount   = row.skippedCount;
+				m.skipVotes      = row.skipVotes;
+				m.lastPlayed     = timeFromDB(row.lastPlayed);
+				m.averageWatched = row.averageWatched;
+				mediaFromRow(m, row);
+				retval.emplace_back(std::move(m));
+			}
+
+			return retval;
+		};
+
+		switch (order) {
+		case StatsOrder::MostPlayed:
+			return fetch(stmts.selectMostPlayed);
+
+		case StatsOrder::MostSkipped:
+			return fetch(stmts.selectMostSkipped);
+
+		case StatsOrder::RecentlyPlayed:
+			return fetch(stmts.selectRecentlyPlayed);
+		}
+
+		throw std::logic_error("bad StatsOrder");
+	});
+}
+
+
+std::vector<PlayStatsMedia> Database::DatabaseImpl::getCachedMedia() {
+	return readTransactionValue<std::vector<PlayStatsMedia> >([&] (Connection &conn, ReadStatements &stmts) {
+		std::vector<PlayStatsMedia> retval;
+		for (const auto &row : conn(stmts.selectCachedMedia)) {
+			PlayStatsMedia m(MediaId(row.id));
+			mediaFromRow(m, row);
+			if (!row.lastPlayed.is_null()) {
+				m.lastPlayed = timeFromDB(row.lastPlayed.value());
+			}
+			retval.emplace_back(std::move(m));
+		}
+
+		return retval;
+	});
+}
+
+
+std::vector<Change> Database::DatabaseImpl::getChanges(uint64_t since, unsigned int limit) {
+	// don't return anything whose commit callbacks haven't run yet
+	uint64_t last = committedVersion.load();
+	if (since >= last) {
+		return std::vector<Change>();
 	}
+
+	return readTransactionValue<std::vector<Change> >([&] (Connection &conn, ReadStatements &stmts) {
+		stmts.selectChanges.params.version     = static_cast<int64_t>(since);
+		stmts.selectChanges.params.lastVersion = static_cast<int64_t>(last);
+		stmts.selectChanges.params.pageSize    = limit;
+
+		std::vector<Change> retval;
+		for (const auto &row : conn(stmts.selectChanges)) {
+			Change c;
+			c.version = row.version;
+			c.kind    = static_cast<ChangeKind>(int(row.kind));
+			c.item    = row.item;
+			c.media   = row.media;
+			retval.push_back(c);
+		}
+
+		// checked after reading since maintenance updates it before removing
+		if (since < prunedVersion.load()) {
+			Change reset;
+			reset.version = last;
+			retval.assign(1, reset);
+		}
+
+		return retval;
+	});
+}
+
+
+std::string Database::DatabaseImpl::getMediaMetadata(MediaId id) {
+	return readTransactionValue<std::string>([&] (Connection &conn, ReadStatements &stmts) {
+		stmts.selectMediaMetadata.params.media = id.id;
+		auto result = conn(stmts.selectMediaMetadata);
+
+		std::string metadata;
+		if (!result.empty()) {
+			const auto &row = result.front();
+			std::vector<uint8_t> stored = row.metadata.value();
+			if (row.dictionary.is_null()) {
+				// from before compression
+				metadata.assign(stored.begin(), stored.end());
+			} else {
+				metadata = decompressMetadata(row.dictionary, stored);
+			}
+		}
+
+		finishResult(result);
+
+		return metadata;
+	});
+}
+
+
+std::future<tl::optional<HistoryItemMedia> > Database::DatabaseImpl::popNextPlaylistItem(std::function<void(const tl::optional<HistoryItemMedia> &)> &&onCommit) {
+	return queueTransactionValue<tl::optional<HistoryItemMedia> >([] (Connection &conn, WriteStatements &stmts) {
+		auto result = conn(stmts.selectNextPlaylistItem);
+
+		if (result.empty()) {
+			return tl::optional<HistoryItemMedia>();
+		}
+
+		const auto &row = result.front();
+
+		stmts.removePlaylistItem.params.id = row.id;
+		conn(stmts.removePlaylistItem);
+
+		stmts.insertHistory.params.media     = row.media;
+		stmts.insertHistory.params.queueTime = timeToDB(timeFromDB(row.queueTime));
+		auto historyId = conn(stmts.insertHistory);
+
+		recordChange(conn, stmts, ChangeKind::PlaylistRemoved, row.id,    row.media);
+		recordChange(conn, stmts, ChangeKind::HistoryStarted,  historyId, row.media);
+
+		HistoryItemMedia p(HistoryItemId(historyId), MediaId(row.media));
+		p.queueTime = timeFromDB(row.queueTime);
+		p.startTime = Timestamp::clock::now();
+		mediaFromRow(p, row);
+
+		finishResult(result);
+
+		return tl::optional<HistoryItemMedia>(p);
+	}, std::move(onCommit));
 }
 
 
 void Database::DatabaseImpl::playlistItemFinished(const HistoryItemMedia &item) {
-	transaction([&] (Connection &conn) {
-		auto up = conn.prepare(update(history)
-							 .set(history.endTime      = parameter(history.endTime)
-								, history.finishReason = parameter(history.finishReason)
-								, history.skipCount    = parameter(history.skipCount)
-								, history.skipsNeeded  = parameter(history.skipsNeeded))
-							 .where(history.id == parameter(history.id))
-							);
-
-		up.params.id           = item.id.id;
-		up.params.endTime      = std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::system_clock::now());
-		if (item.historyStatus) {
-			up.params.finishReason = static_cast<int>(*item.historyStatus);
-		}
-		up.params.skipCount    = item.skipCount;
-		up.params.skipsNeeded  = item.skipsNeeded;
+	// nobody waits for this, errors are logged by the writer
+	auto endTime = std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::system_clock::now());
+	queueTransaction([id = item.id.id, media = item.media.id, endTime, historyStatus = item.historyStatus, skipCount = item.skipCount, skipsNeeded = item.skipsNeeded] (Connection &conn, WriteStatements &stmts) {
+		auto &up = stmts.updateHistory;
+
+		up.params.id           = id;
+		up.params.endTime      = endTime;
+		if (historyStatus) {
+			up.params.finishReason = static_cast<int>(*historyStatus);
+		} else {
+			up.params.finishReason.set_null();
+		}
+		up.params.skipCount    = skipCount;
+		up.params.skipsNeeded  = skipsNeeded;
 
 		conn(up);
+		recordChange(conn, stmts, ChangeKind::HistoryFinished, id, media);
+
+		// incrementally so reports don't have to scan history
+		stmts.updateMediaStats.bind(1, id);
+		stmts.updateMediaStats.execute();
 	});
 }
 
@@ -2,6 +2,8 @@
 #define DATABASE_H
 
 
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -19,6 +21,14 @@ class Config;
 struct MediaInfo;
 
 
+struct PlaylistBatch {
+	// one for each entry in the same order
+	std::vector<MediaInfoId>        media;
+	// entries which weren't on the playlist already
+	std::vector<PlaylistItemMedia>  added;
+};
+
+
 class Database {
 	struct DatabaseImpl;
 	std::unique_ptr<DatabaseImpl> impl;
@@ -37,31 +47,82 @@ public:
 
 	explicit Database(const Config &config);
 
+	// for tools, uses filename instead of the one in config
+	Database(const Config &config, const std::string &filename);
+
+	// waits until queued modifications are written
 	~Database();
 
 
-	MediaInfoId getOrAddMediaByURL(const std::string &url);
+	// modifications run on a writer thread which commits several at once
+	// onCommit callbacks run on that thread after commit, in the order the
+	// modifications were made. they must not wait for database modifications
 
-	void addToPlaylist(MediaId media);
+	// known video id finds the media even under another url
+	MediaInfoId getOrAddMediaByURL(const std::string &url, const std::string &extractor = std::string(), const std::string &videoId = std::string());
 
-	// media is not const, it can be changed in case of duplicates with different URLs
-	void updateMediaInfo(MediaInfoId &media);
+	// returns the new playlist item or nothing if media was already on playlist
+	tl::optional<PlaylistItemMedia> addToPlaylist(MediaId media, std::function<void(const tl::optional<PlaylistItemMedia> &)> onCommit);
+
+	// gets or adds each media like getOrAddMediaByURL and appends it to the
+	// playlist, all in one transaction. title and length are only used for
+	// new media
+	PlaylistBatch addMediaToPlaylist(const std::vector<MediaInfo> &entries, std::function<void(const PlaylistBatch &)> onCommit);
+
+	// doesn't wait for the write
+	// result can have a different id in case of duplicates with different URLs
+	std::future<MediaInfoId> updateMediaInfo(const MediaInfoId &media, std::function<void(const MediaInfoId &)> onCommit);
 
 	MediaInfoId getMediaInfo(MediaId id);
 
+	// empty if there is none
+	std::string getMediaMetadata(MediaId id);
+
+	// latest change whose commit callbacks have run, 0 if none
+	uint64_t getVersion();
+
+	// oldest first, newer than since and at most getVersion()
+	std::vector<Change> getChanges(uint64_t since, unsigned int limit);
+
 	std::vector<MediaInfoId> getAllMedia();
 
+	// newest first, ids less than before or from the newest if before is 0
+	std::vector<MediaInfoId> getMedia(uint64_t before, unsigned int limit);
+
+	// best match first, matches words starting with the ones in query
+	std::vector<MediaInfoId> searchMedia(const std::string &query, unsigned int offset, unsigned int limit);
+
+	// top list from aggregates kept up to date as plays finish
+	std::vector<PlayStatsMedia> getPlayStats(StatsOrder order, unsigned int limit);
+
+	// ready media, least recently played first
+	// only lastPlayed of the stats is loaded, it's unset if never played
+	std::vector<PlayStatsMedia> getCachedMedia();
+
+	// swaps places with the neighbouring item, returns both with their
+	// new positions or nothing if item is not found or already at the end
+	std::vector<PlaylistItem> movePlaylistItem(PlaylistItemId item, MoveDirection direction, std::function<void(const std::vector<PlaylistItem> &)> onCommit);
+
 	std::vector<PlaylistItemMedia> getPlaylist();
 
-	std::vector<HistoryItemMedia> getHistory();
+	// newest first, same paging as getMedia
+	std::vector<HistoryItemMedia> getHistory(uint64_t before, unsigned int limit);
 
 	void skip();
 
 	void getSkipCount();
 
-	tl::optional<HistoryItemMedia> popNextPlaylistItem();
+	tl::optional<HistoryItemMedia> popNextPlaylistItem(std::function<void(const tl::optional<HistoryItemMedia> &)> onCommit);
 
+	// doesn't wait for the write
 	void playlistItemFinished(const HistoryItemMedia &item);
+
+	// waits until all modifications made so far are committed and their callbacks have run
+	void flush();
+
+	// does a short piece of ANALYZE, vacuum and checkpoint work
+	// returns true if there's more to do, false when done or not due yet
+	bool maintenanceStep();
 };
 
 
@@ -1,15 +1,27 @@
 #include <dirent.h>
-
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <functional>
-#include <iomanip>
+#include <limits>
 #include <list>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <fmt/ostream.h>
 
+#include <nlohmann/json.hpp>
+
 #include <pybind11/embed.h>
 
 #include <url.hpp>
@@ -20,6 +32,8 @@
 #include "utuputki/Media.h"
 #include "utuputki/Utuputki.h"
 
+#include "ytdlp_helper.py.h"
+
 
 namespace py = pybind11;
 
@@ -71,6 +85,495 @@ PYBIND11_EMBEDDED_MODULE(utuputki_dl, m) {
 namespace utuputki {
 
 
+static std::string hostOf(const std::string &url) {
+	try {
+		return Url(url).host();
+	} catch (std::exception &) {
+		return std::string();
+	}
+}
+
+
+// media waiting for one stage and the workers processing it
+class WorkQueue {
+	std::mutex                                     mutex;
+	std::condition_variable                        cv;
+	bool                                           shutdown;
+	std::list<MediaInfoId>                         queue;
+	// seconds from the end of the current item until playlist media
+	// is expected to start, anything not here goes after them
+	std::unordered_map<MediaId, unsigned int>      deadlines;
+	// how many items of each host are being worked on
+	std::unordered_map<std::string, unsigned int>  activeHosts;
+	// 0 is unlimited
+	unsigned int                                   maxPerHost;
+	// items without a deadline wait until they get one
+	bool                                           deadlinesOnly;
+	std::vector<std::thread>                       workers;
+
+
+	WorkQueue()                                  = delete;
+
+	WorkQueue(const WorkQueue &other)            = delete;
+	WorkQueue &operator=(const WorkQueue &other) = delete;
+
+	WorkQueue(WorkQueue &&other)                 = delete;
+	WorkQueue &operator=(WorkQueue &&other)      = delete;
+
+public:
+
+	struct Job {
+		MediaInfoId  media;
+		// of the url when it was taken, media.url can change
+		std::string  host;
+	};
+
+
+	WorkQueue(unsigned int maxPerHost_, bool deadlinesOnly_)
+	: shutdown(false)
+	, maxPerHost(maxPerHost_)
+	, deadlinesOnly(deadlinesOnly_)
+	{
+	}
+
+	~WorkQueue() {
+		assert(workers.empty());
+	}
+
+	// only before start
+	std::list<MediaInfoId> &initialQueue() {
+		assert(workers.empty());
+		return queue;
+	}
+
+	void start(unsigned int count, std::function<void()> workerFunc) {
+		assert(workers.empty());
+		assert(count > 0);
+
+		shutdown = false;
+		workers.reserve(count);
+		for (unsigned int i = 0; i < count; i++) {
+			workers.emplace_back(workerFunc);
+		}
+	}
+
+	// waits for workers to finish their current job, queued ones stay
+	void stop() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			shutdown = true;
+			cv.notify_all();
+		}
+
+		for (auto &t : workers) {
+			t.join();
+		}
+		workers.clear();
+	}
+
+	void push(const MediaInfoId &media) {
+		std::unique_lock<std::mutex> lock(mutex);
+		queue.push_back(media);
+		cv.notify_one();
+	}
+
+	// replaces the old ones, queued items are picked by these from now on
+	void setDeadlines(std::unordered_map<MediaId, unsigned int> &&newDeadlines) {
+		std::unique_lock<std::mutex> lock(mutex);
+		deadlines = std::move(newDeadlines);
+
+		// something waiting might have one now
+		if (deadlinesOnly) {
+			cv.notify_all();
+		}
+	}
+
+	// item with the earliest deadline whose host isn't at its limit,
+	// oldest first when equal. nothing when shutting down
+	// finished must be called with the job when done with it
+	tl::optional<Job> pop() {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (true) {
+			if (shutdown) {
+				return tl::nullopt;
+			}
+
+			auto          best         = queue.end();
+			unsigned int  bestDeadline = std::numeric_limits<unsigned int>::max();
+			std::string   bestHost;
+			for (auto it = queue.begin(); it != queue.end(); it++) {
+				std::string host = hostOf(it->url);
+				if (maxPerHost != 0 && activeHosts[host] >= maxPerHost) {
+					continue;
+				}
+
+				auto d = deadlines.find(it->id);
+				if (deadlinesOnly && d == deadlines.end()) {
+					continue;
+				}
+
+				unsigned int deadline = (d != deadlines.end()) ? d->second : std::numeric_limits<unsigned int>::max();
+				if (best == queue.end() || deadline < bestDeadline) {
+					best         = it;
+					bestDeadline = deadline;
+					bestHost     = std::move(host);
+				}
+			}
+
+			if (best != queue.end()) {
+				if (bestDeadline != std::numeric_limits<unsigned int>::max()) {
+					LOG_DEBUG("{} is needed in {} seconds after the current one", best->url, bestDeadline);
+				}
+
+				activeHosts[bestHost]++;
+				Job job { std::move(*best), std::move(bestHost) };
+				queue.erase(best);
+
+				return job;
+			}
+
+			cv.wait(lock);
+		}
+	}
+
+	void finished(const Job &job) {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		auto it = activeHosts.find(job.host);
+		assert(it != activeHosts.end());
+		assert(it->second > 0);
+		it->second--;
+
+		// something else might have been waiting for this host
+		if (maxPerHost != 0) {
+			cv.notify_all();
+		}
+	}
+};
+
+
+// 0 if it doesn't exist
+static uint64_t fileSize(const std::string &path) {
+	struct stat statbuf;
+	memset(&statbuf, 0, sizeof(statbuf));
+
+	if (stat(path.c_str(), &statbuf) != 0) {
+		return 0;
+	}
+
+	return static_cast<uint64_t>(statbuf.st_size);
+}
+
+
+static bool parseBackend(const std::string &backend) {
+	if (backend == "embedded") {
+		return false;
+	} else if (backend == "process") {
+		return true;
+	}
+
+	throw std::runtime_error(fmt::format("Unknown downloader backend \"{}\"", backend));
+}
+
+
+// empty if missing or None
+static std::string infoString(const pybind11::handle &info, const char *key) {
+	pybind11::object value = info.attr("get")(key);
+	if (value.is_none()) {
+		return std::string();
+	}
+
+	return pybind11::str(value);
+}
+
+
+// bump when the stored fields change
+static const unsigned int metadataVersion = 1;
+
+
+// earliest expire= of the chosen formats' URLs, 0 when they don't say
+static uint64_t urlExpiry(const std::vector<std::string> &urls) {
+	uint64_t expires = 0;
+	for (const auto &url : urls) {
+		try {
+			Url parsed(url);
+			for (const auto &kv : parsed.query()) {
+				if (kv.key() != "expire") {
+					continue;
+				}
+
+				uint64_t t = std::stoull(kv.val());
+				if (expires == 0 || t < expires) {
+					expires = t;
+				}
+			}
+		} catch (std::exception &) {
+			// manifests and such, treat as unknown
+		}
+	}
+
+	return expires;
+}
+
+
+// only what we use goes to the database instead of the whole info dict
+// same fields as projectMetadata() in ytdlp_helper.py
+static nlohmann::json compactMetadata(const MediaInfo &media, const std::string &uploader, const std::string &thumbnail, const std::string &formatId, uint64_t expires) {
+	nlohmann::json metadata;
+	metadata["v"]             = metadataVersion;
+	metadata["id"]            = media.videoId.empty() ? nlohmann::json() : nlohmann::json(media.videoId);
+	metadata["extractor_key"] = media.extractor.empty() ? nlohmann::json() : nlohmann::json(media.extractor);
+	metadata["webpage_url"]   = media.url;
+	metadata["title"]         = media.title;
+	metadata["duration"]      = media.length;
+	metadata["uploader"]      = uploader;
+	metadata["thumbnail"]     = thumbnail;
+	metadata["format_id"]     = formatId;
+	metadata["expires"]       = expires;
+
+	return metadata;
+}
+
+
+// python running ytdlp_helper.py, talks to us through a socket on its
+// stdin and stdout
+class HelperProcess {
+	pid_t  pid;
+	int    fd;
+
+
+	HelperProcess()                                      = delete;
+
+	HelperProcess(const HelperProcess &other)            = delete;
+	HelperProcess &operator=(const HelperProcess &other) = delete;
+
+	HelperProcess(HelperProcess &&other)                 = delete;
+	HelperProcess &operator=(HelperProcess &&other)      = delete;
+
+	bool writeAll(const char *data, size_t size) {
+		while (size > 0) {
+			// no SIGPIPE if it's gone
+			ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			data += written;
+			size -= written;
+		}
+
+		return true;
+	}
+
+	bool readAll(char *data, size_t size) {
+		while (size > 0) {
+			ssize_t got = recv(fd, data, size, 0);
+			if (got < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			} else if (got == 0) {
+				return false;
+			}
+			data += got;
+			size -= got;
+		}
+
+		return true;
+	}
+
+public:
+
+	std::chrono::steady_clock::time_point  lastUsed;
+
+
+	HelperProcess(const std::string &python, unsigned int idleSeconds)
+	: pid(0)
+	, fd(-1)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+			throw std::system_error(errno, std::generic_category(), "socketpair failed");
+		}
+
+		std::string script(reinterpret_cast<const char *>(&ytdlp_helper_py[0]), ytdlp_helper_py_length);
+		// helper waits a bit longer than us so we never send to one that's exiting
+		std::string idle = std::to_string(idleSeconds + 5);
+		std::vector<char *> argv = { const_cast<char *>(python.c_str()), const_cast<char *>("-c"), const_cast<char *>(script.c_str()), const_cast<char *>(idle.c_str()), nullptr };
+
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, fds[1], 0);
+		posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+
+		int ret = posix_spawnp(&pid, python.c_str(), &actions, nullptr, argv.data(), environ);
+		posix_spawn_file_actions_destroy(&actions);
+		close(fds[1]);
+
+		if (ret != 0) {
+			close(fds[0]);
+			throw std::system_error(ret, std::generic_category(), fmt::format("Failed to start yt-dlp helper \"{}\"", python));
+		}
+
+		fd       = fds[0];
+		lastUsed = std::chrono::steady_clock::now();
+		LOG_DEBUG("Started yt-dlp helper {}", pid);
+	}
+
+	~HelperProcess() {
+		// it exits on end of file
+		close(fd);
+
+		int status = 0;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+		}
+		LOG_DEBUG("yt-dlp helper {} exited with status {}", pid, status);
+	}
+
+	// nothing if the helper died
+	// onEntries gets playlist entries as they come in, before the reply
+	tl::optional<nlohmann::json> request(const nlohmann::json &message, const std::function<void(const nlohmann::json &)> &onEntries, bool &replied) {
+		replied = false;
+
+		std::string data = message.dump();
+		uint32_t length  = htonl(data.size());
+		if (!writeAll(reinterpret_cast<const char *>(&length), sizeof(length)) || !writeAll(data.data(), data.size())) {
+			return tl::nullopt;
+		}
+
+		while (true) {
+			if (!readAll(reinterpret_cast<char *>(&length), sizeof(length))) {
+				return tl::nullopt;
+			}
+			data.resize(ntohl(length));
+			if (!readAll(&data[0], data.size())) {
+				return tl::nullopt;
+			}
+			replied = true;
+
+			auto frame   = nlohmann::json::parse(data);
+			auto entries = frame.find("entries");
+			if (entries != frame.end()) {
+				if (onEntries) {
+					onEntries(*entries);
+				}
+				continue;
+			}
+
+			auto log = frame.find("log");
+			if (log == frame.end()) {
+				return frame;
+			}
+
+			const std::string &level   = log->get_ref<const std::string &>();
+			const std::string &logText = frame.at("message").get_ref<const std::string &>();
+			if (level == "error") {
+				LOG_ERROR(logText);
+			} else if (level == "warning") {
+				LOG_WARNING(logText);
+			} else {
+				LOG_DEBUG(logText);
+			}
+		}
+	}
+};
+
+
+// helpers are started when needed and kept while they're used
+class HelperPool {
+	std::string                                  python;
+	std::chrono::seconds                         idleTime;
+	std::mutex                                   mutex;
+	// most recently used last
+	std::vector<std::unique_ptr<HelperProcess> > idle;
+
+
+	HelperPool()                                   = delete;
+
+	HelperPool(const HelperPool &other)            = delete;
+	HelperPool &operator=(const HelperPool &other) = delete;
+
+	HelperPool(HelperPool &&other)                 = delete;
+	HelperPool &operator=(HelperPool &&other)      = delete;
+
+	// nothing idle means start a new one
+	std::unique_ptr<HelperProcess> acquire() {
+		std::unique_lock<std::mutex> lock(mutex);
+		removeIdle();
+
+		if (idle.empty()) {
+			return std::unique_ptr<HelperProcess>();
+		}
+
+		auto helper = std::move(idle.back());
+		idle.pop_back();
+
+		return helper;
+	}
+
+	void release(std::unique_ptr<HelperProcess> &&helper) {
+		helper->lastUsed = std::chrono::steady_clock::now();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		removeIdle();
+		idle.emplace_back(std::move(helper));
+	}
+
+	// called with mutex held
+	void removeIdle() {
+		auto cutoff = std::chrono::steady_clock::now() - idleTime;
+		auto it = std::find_if(idle.begin(), idle.end(), [cutoff] (const std::unique_ptr<HelperProcess> &h) { return h->lastUsed >= cutoff; });
+		idle.erase(idle.begin(), it);
+	}
+
+public:
+
+	HelperPool(const std::string &python_, unsigned int idleSeconds)
+	: python(python_)
+	, idleTime(std::max(idleSeconds, 1u))
+	{
+	}
+
+	~HelperPool() = default;
+
+	// throws if yt-dlp fails or the helper can't be run
+	nlohmann::json request(const nlohmann::json &message, const std::function<void(const nlohmann::json &)> &onEntries = std::function<void(const nlohmann::json &)>()) {
+		auto helper = acquire();
+		bool reused = bool(helper);
+
+		while (true) {
+			if (!helper) {
+				helper.reset(new HelperProcess(python, idleTime.count()));
+			}
+
+			bool replied = false;
+			auto reply   = helper->request(message, onEntries, replied);
+			if (reply) {
+				release(std::move(helper));
+
+				auto error = reply->find("error");
+				if (error != reply->end()) {
+					throw std::runtime_error(error->get<std::string>());
+				}
+
+				return std::move(*reply);
+			}
+
+			helper.reset();
+			// an old one might have exited on its own, try once more with a new one
+			if (!reused || replied) {
+				throw std::runtime_error("yt-dlp helper exited");
+			}
+			reused = false;
+		}
+	}
+};
+
+
 struct Downloader::DownloaderImpl {
 	Utuputki                         &utuputki;
 
@@ -91,28 +594,50 @@ struct Downloader::DownloaderImpl {
 
 	bool                             verbose;
 
-	py::scoped_interpreter           interpreter;
-	pybind11::module                 jsonModule;
+	// embedded backend, python runs in our process
+	std::unique_ptr<py::scoped_interpreter>  interpreter;
 	pybind11::module                 utuputkiModule;
 	pybind11::module                 youtubeDLModule;
 	// after python is initialized we hold the GIL
 	// release it so threads can acquire it
 	// use scoped helper to make sure destructor happens automagically
-	py::gil_scoped_release           releaseGIL;
+	std::unique_ptr<py::gil_scoped_release>  releaseGIL;
 
-	std::unordered_set<std::string>  hostWhitelist;
+	// process backend, null when embedded
+	std::unique_ptr<HelperPool>      helpers;
 
-	std::mutex                       metadataMutex;
-	std::condition_variable          metadataCV;
-	bool                             shutdownMetadata;
-	std::list<MediaInfoId>           metadataQueue;
-	std::thread                      metadataThread;
+	std::unordered_set<std::string>  hostWhitelist;
 
-	std::mutex                       downloaderMutex;
-	std::condition_variable          downloaderCV;
-	bool                             shutdownDownloader;
-	std::list<MediaInfoId>           downloaderQueue;
-	std::thread                      downloaderThread;
+	unsigned int                     metadataWorkers;
+	unsigned int                     downloadWorkers;
+	// how far ahead of the player to download, 0 is unlimited
+	unsigned int                     prefetchItems;
+	unsigned int                     prefetchSeconds;
+
+	// playlist urls are added this many entries per transaction
+	unsigned int                     playlistBatch;
+	// 0 is unlimited
+	unsigned int                     maxPlaylistItems;
+
+	// 0 is unlimited
+	uint64_t                         maxCacheBytes;
+	uint64_t                         minFreeBytes;
+	// only one thread evicts at a time
+	std::mutex                       cacheMutex;
+	WorkQueue                        metadataQueue;
+	WorkQueue                        downloaderQueue;
+
+	// full info dict from the metadata worker, kept in memory until the
+	// download so it doesn't have to extract again
+	struct FreshInfo {
+		Timestamp         time;
+		uint64_t          expires;  // unix time, 0 if unknown
+		std::string       json;     // process backend
+		pybind11::object  info;     // embedded, only touch with GIL held
+	};
+	// by url
+	std::mutex                       freshInfoMutex;
+	std::unordered_map<std::string, FreshInfo>  freshInfo;
 
 	bool                             threadsStarted;
 
@@ -134,15 +659,32 @@ struct Downloader::DownloaderImpl {
 
 	void startThreads();
 
+	void stopThreads();
+
 	void metadataThreadFunc();
 
 	void downloaderThreadFunc();
 
+	void startEmbedded();
+
 	pybind11::dict createDownloaderOptions();
 
-	tl::optional<MediaInfoId> popMetadataQueue();
+	pybind11::object createYoutubeDL();
+
+	void setOutputTemplate(pybind11::object &downloader, const std::string &outtmpl);
+
+	nlohmann::json createHelperOptions();
 
-	tl::optional<MediaInfoId> popDownloadQueue();
+	uint64_t metadataFromJSON(MediaInfo &media, const nlohmann::json &reply);
+
+	// embedded backend must hold the GIL for these
+	void keepFreshInfo(const std::string &url, FreshInfo &&info);
+
+	tl::optional<FreshInfo> takeFreshInfo(const std::string &url);
+
+	void checkDownloadedFile(MediaInfoId &media, std::string finalFilename);
+
+	void evictCache(const MediaInfoId &downloaded);
 
 	template <typename T, typename F> T valueWithGIL(F &&f) {
 		T retval;
@@ -158,16 +700,51 @@ struct Downloader::DownloaderImpl {
 		f();
 	}
 
-	MediaInfoId addMedia(const std::string &mediaURL);
+	void addMedia(const std::string &mediaURL);
+
+	void addPlaylist(const std::string &url);
+
+	void addEntries(const std::vector<MediaInfo> &entries);
+
+	void queueMedia(MediaInfoId &media);
+
 
+	// returns when the chosen formats' URLs expire, 0 if unknown
+	uint64_t metadataFromPython(MediaInfo &media, pybind11::object &downloader, const pybind11::dict &info) {
+		auto start = std::chrono::steady_clock::now();
 
-	void metadataFromPython(MediaInfo &media, pybind11::object &downloader, const pybind11::dict &metadata) {
-		media.url           = pybind11::cast<std::string>(metadata["webpage_url"]);
-		media.filename      = pybind11::cast<std::string>(downloader.attr("prepare_filename")(metadata));
-		media.title         = pybind11::cast<std::string>(metadata["title"]);
-		media.length        = pybind11::cast<int        >(metadata["duration"]);
-		media.metadata      = pybind11::cast<std::string>(jsonModule.attr("dumps")(metadata));
+		media.url           = pybind11::cast<std::string>(info["webpage_url"]);
+		// relative to the cache, downloads set the template to an absolute path
+		media.filename      = pybind11::cast<std::string>(downloader.attr("prepare_filename")(info));
+		auto lastSlash = media.filename.find_last_of('/');
+		if (lastSlash != std::string::npos) {
+			media.filename = media.filename.substr(lastSlash + 1);
+		}
+		media.title         = pybind11::cast<std::string>(info["title"]);
+		media.length        = pybind11::cast<int        >(info["duration"]);
 		media.metadataTime  = Timestamp::clock::now();
+
+		// same as canonicalMedia() gives for the hosts it knows
+		if (info.contains("extractor_key") && info.contains("id") && !info["id"].is_none()) {
+			media.extractor = pybind11::cast<std::string>(info["extractor_key"]);
+			media.videoId   = pybind11::str(info["id"]);
+		}
+
+		std::vector<std::string> urls;
+		if (info.contains("requested_formats") && !info["requested_formats"].is_none()) {
+			for (auto requested : info["requested_formats"]) {
+				urls.push_back(infoString(requested, "url"));
+			}
+		} else {
+			urls.push_back(infoString(info, "url"));
+		}
+		uint64_t expires = urlExpiry(urls);
+
+		media.metadata      = compactMetadata(media, infoString(info, "uploader"), infoString(info, "thumbnail"), infoString(info, "format_id"), expires).dump();
+
+		LOG_DEBUG("Projecting metadata took {} us", std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+		return expires;
 	}
 };
 
@@ -234,48 +811,36 @@ Downloader::DownloaderImpl::DownloaderImpl(Utuputki &utuputki_, const Config &co
 , tempDirectory(config.get("downloader",   "tempDir",         "/tmp"))
 , maxMetadataAge(std::chrono::seconds(config.get("downloader", "maxmetadataage", 60)))
 , verbose(config.getBool("downloader", "verbose", false))
-, jsonModule(py::module::import("json"))
-, utuputkiModule(py::module::import("utuputki_dl"))
 , hostWhitelist({ "youtube.com", "www.youtube.com", "m.youtube.com", "youtu.be" })
-, shutdownMetadata(false)
-, shutdownDownloader(false)
+, metadataWorkers(std::max(config.get("downloader", "metadataWorkers", 1u), 1u))
+, downloadWorkers(std::max(config.get("downloader",  "downloadWorkers", 2u), 1u))
+, prefetchItems(config.get("downloader",   "prefetchItems",   0u))
+, prefetchSeconds(config.get("downloader", "prefetchMinutes", 0u) * 60)
+, playlistBatch(std::max(config.get("downloader", "playlistBatch", 100u), 1u))
+, maxPlaylistItems(config.get("downloader", "maxPlaylistItems", 1000u))
+, maxCacheBytes(config.getUInt64("downloader", "maxCacheBytes", 0))
+, minFreeBytes(config.getUInt64("downloader",  "minFreeBytes",  0))
+, metadataQueue(config.get("downloader",   "maxPerHost",      0u), false)
+, downloaderQueue(config.get("downloader", "maxPerHost",      0u), prefetchItems != 0 || prefetchSeconds != 0)
 , threadsStarted(false)
 {
-	std::string youtubeDlModuleName;
-
-	withGIL([&] () {
-		try {
-			youtubeDLModule = py::module_::import("yt_dlp");
-			LOG_INFO("Loaded yt-dlp");
-			youtubeDlModuleName = "yt_dlp";
-			return;
-		} catch (py::error_already_set &e) {
-			LOG_ERROR("Exception loading yt-dlp: {}", e.what());
-		}
-
-		try {
-			youtubeDLModule = py::module_::import("youtube_dl");
-			LOG_INFO("Loaded youtube-dl");
-			youtubeDlModuleName = "youtube_dl";
-			return;
-		} catch (py::error_already_set &e) {
-			LOG_ERROR("Exception loading youtube-dl: {}", e.what());
-		}
-
-		throw std::runtime_error("No yt-dlp or youtube-dl installed");
-	});
+	if (parseBackend(config.get("downloader", "backend", "embedded"))) {
+		unsigned int idleSeconds = config.get("downloader", "helperIdleSeconds", 60u);
+		helpers.reset(new HelperPool(config.get("downloader", "python", "python3"), idleSeconds));
+		LOG_INFO("Running yt-dlp in helper processes, idle ones exit after {} seconds", idleSeconds);
+
+		// fail now if there's no yt-dlp like embedded does
+		nlohmann::json request;
+		request["op"] = "version";
+		auto version  = helpers->request(request);
+		LOG_INFO("Helpers use {} version \"{}\"", version.at("module").get<std::string>(), version.at("version").get<std::string>());
+	} else {
+		startEmbedded();
+	}
 
 	cacheDirectory = checkDirectory(cacheDirectory, "cache");
 	tempDirectory  = checkDirectory(tempDirectory,  "temp");
 
-	withGIL([&] () {
-		try {
-			LOG_INFO("youtube-dl version \"{}\"", pybind11::cast<std::string>(py::module::import((youtubeDlModuleName + ".version").c_str()).attr("__version__")));
-		} catch (py::error_already_set &e) {
-			LOG_WARNING("Couldn't get youtube-dl version: {}", e.what());
-		}
-	});
-
 	LOG_INFO("Maximum length {}",        maxLength);
 	LOG_INFO("Maximum file size {}",     maxFileSize);
 	LOG_INFO("Maximum width {}",         maxWidth);
@@ -337,30 +902,76 @@ Downloader::DownloaderImpl::DownloaderImpl(Utuputki &utuputki_, const Config &co
 }
 
 
-Downloader::DownloaderImpl::~DownloaderImpl() {
-	assert(threadsStarted);
-
-	{
-		std::unique_lock<std::mutex> lock(metadataMutex);
-		shutdownMetadata = true;
-		metadataCV.notify_one();
-	}
-
-	{
-		std::unique_lock<std::mutex> lock(downloaderMutex);
-		shutdownDownloader = true;
-		downloaderCV.notify_one();
-	}
-
-	metadataThread.join();
-	downloaderThread.join();
-}
+void Downloader::DownloaderImpl::startEmbedded() {
+	interpreter.reset(new py::scoped_interpreter());
+	utuputkiModule = py::module::import("utuputki_dl");
+	releaseGIL.reset(new py::gil_scoped_release());
 
+	std::string youtubeDlModuleName;
 
-pybind11::dict Downloader::DownloaderImpl::createDownloaderOptions() {
-	pybind11::dict downloaderOptions{};
-	downloaderOptions["cachedir"]   = tempDirectory;
-	downloaderOptions["format"]     = format;
+	withGIL([&] () {
+		try {
+			youtubeDLModule = py::module_::import("yt_dlp");
+			LOG_INFO("Loaded yt-dlp");
+			youtubeDlModuleName = "yt_dlp";
+			return;
+		} catch (py::error_already_set &e) {
+			LOG_ERROR("Exception loading yt-dlp: {}", e.what());
+		}
+
+		try {
+			youtubeDLModule = py::module_::import("youtube_dl");
+			LOG_INFO("Loaded youtube-dl");
+			youtubeDlModuleName = "youtube_dl";
+			return;
+		} catch (py::error_already_set &e) {
+			LOG_ERROR("Exception loading youtube-dl: {}", e.what());
+		}
+
+		throw std::runtime_error("No yt-dlp or youtube-dl installed");
+	});
+
+	withGIL([&] () {
+		try {
+			LOG_INFO("youtube-dl version \"{}\"", pybind11::cast<std::string>(py::module::import((youtubeDlModuleName + ".version").c_str()).attr("__version__")));
+		} catch (py::error_already_set &e) {
+			LOG_WARNING("Couldn't get youtube-dl version: {}", e.what());
+		}
+	});
+}
+
+
+Downloader::DownloaderImpl::~DownloaderImpl() {
+	stopThreads();
+}
+
+
+void Downloader::DownloaderImpl::stopThreads() {
+	if (!threadsStarted) {
+		return;
+	}
+
+	// metadata workers feed downloaders so stop them first
+	metadataQueue.stop();
+	downloaderQueue.stop();
+
+	// python objects go away with the GIL held
+	if (helpers) {
+		freshInfo.clear();
+	} else {
+		withGIL([this] () {
+			freshInfo.clear();
+		});
+	}
+
+	threadsStarted = false;
+}
+
+
+pybind11::dict Downloader::DownloaderImpl::createDownloaderOptions() {
+	pybind11::dict downloaderOptions{};
+	downloaderOptions["cachedir"]   = tempDirectory;
+	downloaderOptions["format"]     = format;
 	downloaderOptions["logger"]     = utuputkiModule.attr("Logger")();
 	downloaderOptions["noplaylist"] = true;
 	downloaderOptions["outtmpl"]    = "%(id)s.%(ext)s";
@@ -370,87 +981,353 @@ pybind11::dict Downloader::DownloaderImpl::createDownloaderOptions() {
 }
 
 
-void Downloader::DownloaderImpl::downloaderThreadFunc() {
-	while (true) {
-		auto mediaOpt = popDownloadQueue();
+nlohmann::json Downloader::DownloaderImpl::createHelperOptions() {
+	// helper adds its own logger
+	nlohmann::json options;
+	options["cachedir"]   = tempDirectory;
+	options["format"]     = format;
+	options["noplaylist"] = true;
+	options["outtmpl"]    = "%(id)s.%(ext)s";
+	options["verbose"]    = verbose;
+
+	return options;
+}
+
+
+// returns when the chosen formats' URLs expire, 0 if unknown
+uint64_t Downloader::DownloaderImpl::metadataFromJSON(MediaInfo &media, const nlohmann::json &reply) {
+	const std::string &metadataText = reply.at("metadata").get_ref<const std::string &>();
+	auto metadata = nlohmann::json::parse(metadataText);
+
+	media.url           = metadata.at("webpage_url").get<std::string>();
+	media.filename      = reply.at("filename").get<std::string>();
+	media.title         = metadata.at("title").get<std::string>();
+	media.length        = metadata.at("duration").get<int>();
+	media.metadata      = metadataText;
+	media.metadataTime  = Timestamp::clock::now();
+
+	auto extractor = metadata.find("extractor_key");
+	auto id        = metadata.find("id");
+	if (extractor != metadata.end() && id != metadata.end() && !id->is_null()) {
+		media.extractor = extractor->get<std::string>();
+		media.videoId   = id->is_string() ? id->get<std::string>() : id->dump();
+	}
+
+	return metadata.value("expires", uint64_t(0));
+}
+
+
+// only a few are kept, they can be big
+static const size_t maxFreshInfo = 16;
+
+
+void Downloader::DownloaderImpl::keepFreshInfo(const std::string &url, FreshInfo &&info) {
+	std::unique_lock<std::mutex> lock(freshInfoMutex);
+
+	auto now = Timestamp::clock::now();
+	for (auto it = freshInfo.begin(); it != freshInfo.end(); ) {
+		if (now - it->second.time > maxMetadataAge) {
+			it = freshInfo.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	if (freshInfo.size() >= maxFreshInfo && freshInfo.find(url) == freshInfo.end()) {
+		auto oldest = freshInfo.begin();
+		for (auto it = freshInfo.begin(); it != freshInfo.end(); it++) {
+			if (it->second.time < oldest->second.time) {
+				oldest = it;
+			}
+		}
+		freshInfo.erase(oldest);
+	}
+
+	freshInfo[url] = std::move(info);
+}
+
+
+// empty when it has to be extracted again
+tl::optional<Downloader::DownloaderImpl::FreshInfo> Downloader::DownloaderImpl::takeFreshInfo(const std::string &url) {
+	std::unique_lock<std::mutex> lock(freshInfoMutex);
 
-		if (!mediaOpt) {
+	auto it = freshInfo.find(url);
+	if (it == freshInfo.end()) {
+		LOG_INFO("No metadata for \"{}\" in memory, extracting again", url);
+		return tl::optional<FreshInfo>();
+	}
+
+	FreshInfo info = std::move(it->second);
+	freshInfo.erase(it);
+
+	// an expiring URL could die in the middle of the download
+	auto age = Timestamp::clock::now() - info.time;
+	auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	if (age > maxMetadataAge) {
+		LOG_INFO("Metadata for \"{}\" too old, extracting again", url);
+		return tl::optional<FreshInfo>();
+	} else if (info.expires != 0 && info.expires < static_cast<uint64_t>(now) + 600) {
+		LOG_INFO("Format URLs of \"{}\" about to expire, extracting again", url);
+		return tl::optional<FreshInfo>();
+	}
+
+	return tl::optional<FreshInfo>(std::move(info));
+}
+
+
+// finalFilename is where it was told to download
+void Downloader::DownloaderImpl::checkDownloadedFile(MediaInfoId &media, std::string finalFilename) {
+	// youtube_dl sometimes lies about the file name, fix it
+	int exists = access(finalFilename.c_str(), F_OK);
+	if (exists == 0) {
+		// success
+		media.status = MediaStatus::Ready;
+		media.filesize = fileSize(finalFilename);
+	} else {
+		// try again with .mkv
+		auto lastDot = media.filename.find_last_of('.');
+		if (lastDot == std::string::npos) {
+			// no extension, fail
+			media.status       = MediaStatus::Failed;
+			media.errorMessage = "File does not exist after download, filename has no extension";
+		} else {
+			std::string mkv = media.filename.substr(0, lastDot) + ".mkv";
+			finalFilename   = cacheDirectory + "/" + mkv;
+			LOG_DEBUG("recheck \"{}\"", mkv);
+			exists = access(finalFilename.c_str(), F_OK);
+			if (exists == 0) {
+				LOG_INFO("Fixed \"{}\" extension to .mkv", media.filename);
+				media.filename     = mkv;
+				media.status       = MediaStatus::Ready;
+				media.filesize     = fileSize(finalFilename);
+			} else {
+				media.status       = MediaStatus::Failed;
+				media.errorMessage = "File does not exist after download, unable to fix filename";
+			}
+		}
+	}
+
+	if (media.status == MediaStatus::Failed) {
+		LOG_ERROR("Failed to load {}: file does not exist after finishing", media.filename);
+	}
+}
+
+
+// removes least recently played files until under maxCacheBytes and above
+// minFreeBytes. anything on the playlist or playing is kept
+void Downloader::DownloaderImpl::evictCache(const MediaInfoId &downloaded) {
+	if (maxCacheBytes == 0 && minFreeBytes == 0) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(cacheMutex);
+
+	std::unordered_set<MediaId> keep;
+	keep.insert(downloaded.id);
+	auto nowPlaying = utuputki.getNowPlaying();
+	if (nowPlaying) {
+		keep.insert(nowPlaying->media);
+	}
+	for (const auto &item : *utuputki.getPlaylist()) {
+		keep.insert(item.media);
+	}
+
+	// downloaded might not be written yet
+	auto cached = utuputki.getCachedMedia();
+	uint64_t total = 0;
+	bool downloadedListed = false;
+	for (auto &m : cached) {
+		if (m.id == downloaded.id) {
+			m.filesize       = downloaded.filesize;
+			downloadedListed = true;
+		} else if (m.filesize == 0) {
+			// downloaded before sizes were recorded
+			m.filesize = fileSize(cacheDirectory + "/" + m.filename);
+			if (m.filesize != 0) {
+				utuputki.updateMediaInfo(m);
+			}
+		}
+
+		total += m.filesize;
+	}
+	if (!downloadedListed) {
+		total += downloaded.filesize;
+	}
+
+	uint64_t needed = 0;
+	if (maxCacheBytes != 0 && total > maxCacheBytes) {
+		needed = total - maxCacheBytes;
+	}
+
+	if (minFreeBytes != 0) {
+		struct statvfs buf;
+		memset(&buf, 0, sizeof(buf));
+		if (statvfs(cacheDirectory.c_str(), &buf) != 0) {
+			LOG_ERROR("statvfs \"{}\" failed: {}", cacheDirectory, strerror(errno));
+		} else {
+			uint64_t freeBytes = static_cast<uint64_t>(buf.f_bavail) * buf.f_frsize;
+			if (freeBytes < minFreeBytes) {
+				needed = std::max(needed, minFreeBytes - freeBytes);
+			}
+		}
+	}
+
+	if (needed == 0) {
+		return;
+	}
+
+	LOG_INFO("Cache has {} bytes, evicting {} bytes", total, needed);
+
+	uint64_t freed = 0;
+	for (auto &m : cached) {
+		if (freed >= needed) {
 			break;
 		}
 
-		MediaInfoId &media = *mediaOpt;
+		if (keep.find(m.id) != keep.end()) {
+			continue;
+		}
 
-		LOG_INFO("Downloading \"{}\" ({})", media.url, media.title);
+		std::string path = cacheDirectory + "/" + m.filename;
+		if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+			LOG_ERROR("Failed to remove \"{}\": {}", path, strerror(errno));
+			continue;
+		}
 
-		withGIL([&] () {
-			try {
-				// we can't keep the downloader object around outside the GIL region
-				// it's destructor must be called with it held
+		LOG_INFO("Evicted \"{}\" ({} id {}), {} bytes", m.title, m.url, m.id.toString(), m.filesize);
+		freed      += m.filesize;
+		m.status    = MediaStatus::Evicted;
+		m.filesize  = 0;
+		utuputki.updateMediaInfo(m, [this] (const MediaInfoId &updated) {
+			if (updated.status != MediaStatus::Evicted) {
+				return;
+			}
 
-				pybind11::dict options    = createDownloaderOptions();
-				std::string finalFilename = cacheDirectory + "/" + media.filename;
-				options["outtmpl"]        = finalFilename;
+			// added to the playlist while we were evicting it, that saw it
+			// as ready and didn't queue it. commit callbacks run in order so
+			// the playlist has every add committed before this
+			auto playlist = utuputki.getPlaylist();
+			if (std::any_of(playlist->begin(), playlist->end(), [&] (const PlaylistItemMedia &item) { return item.media == updated.id; })) {
+				MediaInfoId again(updated);
+				queueMedia(again);
+			}
+		});
+	}
 
-				auto downloader           = youtubeDLModule.attr("YoutubeDL")(options);
-				auto metadata             = jsonModule.attr("loads")(media.metadata);
-				auto now                  = Timestamp::clock::now();
-				auto age                  = now - media.metadataTime;
+	if (freed < needed) {
+		LOG_WARNING("Could only evict {} of {} bytes, the rest is on the playlist", freed, needed);
+	}
+}
+
+
+// creating one registers every extractor so workers keep theirs
+// must be called with GIL held
+pybind11::object Downloader::DownloaderImpl::createYoutubeDL() {
+	auto start = std::chrono::steady_clock::now();
+	py::object downloader = youtubeDLModule.attr("YoutubeDL")(createDownloaderOptions());
+	LOG_INFO("Creating YoutubeDL took {} us, reused for the rest of this worker's media", std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+	return downloader;
+}
 
-				auto l = std::chrono::system_clock::to_time_t(media.metadataTime);
-				LOG_DEBUG("metadata time: {}  age: {}  max: {}", std::put_time(std::localtime(&l), "%F %T"), age.count(), maxMetadataAge.count());
-				if (age > maxMetadataAge) {
-					LOG_INFO("Metadata for \"{}\" too old, redownload", media.url);
-					metadata              = downloader.attr("extract_info")(media.url, false);
 
-					metadataFromPython(media, downloader, metadata);
+// must be called with GIL held
+void Downloader::DownloaderImpl::setOutputTemplate(pybind11::object &downloader, const std::string &outtmpl) {
+	auto start = std::chrono::steady_clock::now();
+
+	// yt-dlp turns it into a dict of templates per file type
+	py::dict params = downloader.attr("params");
+	py::object current = params["outtmpl"];
+	if (py::isinstance<py::dict>(current)) {
+		current["default"] = outtmpl;
+	} else {
+		params["outtmpl"] = outtmpl;
+	}
+
+	LOG_DEBUG("Per media YoutubeDL setup took {} us", std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+
+void Downloader::DownloaderImpl::downloaderThreadFunc() {
+	// embedded only, created on first use and kept
+	// only touch it with GIL held, including destruction
+	py::object youtubeDL;
+
+	while (true) {
+		auto job = downloaderQueue.pop();
+
+		if (!job) {
+			break;
+		}
+
+		MediaInfoId &media = job->media;
+
+		LOG_INFO("Downloading \"{}\" ({})", media.url, media.title);
+
+		std::string finalFilename = cacheDirectory + "/" + media.filename;
+		if (helpers) {
+			try {
+				nlohmann::json request;
+				request["op"]                 = "download";
+				request["url"]                = media.url;
+				request["options"]            = createHelperOptions();
+				request["options"]["outtmpl"] = finalFilename;
+				auto fresh = takeFreshInfo(media.url);
+				if (fresh) {
+					request["info"] = std::move(fresh->json);
 				}
-				downloader.attr("process_video_result")(metadata);
 
-				// youtube_dl sometimes lies about the file name, fix it
-				int exists = access(finalFilename.c_str(), F_OK);
-				if (exists == 0) {
-					// success
-					media.status = MediaStatus::Ready;
+				auto reply = helpers->request(request);
+				if (reply.contains("metadata")) {
+					metadataFromJSON(media, reply);
 				} else {
-					// try again with .mkv
-					auto lastDot = media.filename.find_last_of('.');
-					if (lastDot == std::string::npos) {
-						// no extension, fail
-						media.status       = MediaStatus::Failed;
-						media.errorMessage = "File does not exist after download, filename has no extension";
-					} else {
-						std::string mkv = media.filename.substr(0, lastDot) + ".mkv";
-						finalFilename   = cacheDirectory + "/" + mkv;
-						LOG_DEBUG("recheck \"{}\"", mkv);
-						exists = access(finalFilename.c_str(), F_OK);
-						if (exists == 0) {
-							LOG_INFO("Fixed \"{}\" extension to .mkv", media.filename);
-							media.filename     = mkv;
-							media.status       = MediaStatus::Ready;
-						} else {
-							media.status       = MediaStatus::Failed;
-							media.errorMessage = "File does not exist after download, unable to fix filename";
-						}
-					}
+					// unchanged, don't make updateMediaInfo write it again
+					media.metadata.clear();
 				}
 
-				if (media.status == MediaStatus::Failed) {
-					LOG_ERROR("Failed to load {}: file does not exist after finishing", media.filename);
-				}
-			} catch (py::error_already_set &e) {
-				LOG_ERROR("Caught python exception from downloader: {}", e.what());
-				media.status = MediaStatus::Failed;
-				media.errorMessage = e.what();
+				checkDownloadedFile(media, finalFilename);
 			} catch (std::exception &e) {
 				LOG_ERROR("Caught std::exception from downloader: {}", e.what());
 				media.status = MediaStatus::Failed;
 				media.errorMessage = e.what();
-			} catch (...) {
-				LOG_ERROR("Caught unknown exception from downloader");
-				media.status = MediaStatus::Failed;
-				media.errorMessage = "Unknown exception from downloader";
 			}
-		} );
+		} else {
+			withGIL([&] () {
+				try {
+					if (!youtubeDL) {
+						youtubeDL = createYoutubeDL();
+					}
+					setOutputTemplate(youtubeDL, finalFilename);
+
+					py::object info;
+					auto fresh = takeFreshInfo(media.url);
+					if (fresh) {
+						info                  = std::move(fresh->info);
+						// unchanged, don't make updateMediaInfo write it again
+						media.metadata.clear();
+					} else {
+						info                  = youtubeDL.attr("extract_info")(media.url, false);
+
+						metadataFromPython(media, youtubeDL, info);
+					}
+					youtubeDL.attr("process_video_result")(info);
+
+					checkDownloadedFile(media, finalFilename);
+				} catch (py::error_already_set &e) {
+					LOG_ERROR("Caught python exception from downloader: {}", e.what());
+					media.status = MediaStatus::Failed;
+					media.errorMessage = e.what();
+				} catch (std::exception &e) {
+					LOG_ERROR("Caught std::exception from downloader: {}", e.what());
+					media.status = MediaStatus::Failed;
+					media.errorMessage = e.what();
+				} catch (...) {
+					LOG_ERROR("Caught unknown exception from downloader");
+					media.status = MediaStatus::Failed;
+					media.errorMessage = "Unknown exception from downloader";
+				}
+			} );
+		}
 
         try {
 			utuputki.updateMediaInfo(media);
@@ -459,39 +1336,84 @@ void Downloader::DownloaderImpl::downloaderThreadFunc() {
 		} catch (...) {
 			LOG_ERROR("updateMediaInfo exception");
 		}
+
+		downloaderQueue.finished(*job);
+
+		if (media.status == MediaStatus::Ready) {
+			try {
+				evictCache(media);
+			} catch (std::exception &e) {
+				LOG_ERROR("evictCache exception: \"{}\"", e.what());
+			}
+		}
+	}
+
+	if (youtubeDL) {
+		withGIL([&] () {
+			youtubeDL = py::object();
+		});
 	}
 }
 
 
 void Downloader::DownloaderImpl::metadataThreadFunc() {
+	// embedded only, see downloaderThreadFunc
+	py::object youtubeDL;
+
 	while (true) {
-		auto mediaOpt = popMetadataQueue();
+		auto job = metadataQueue.pop();
 
-		if (!mediaOpt) {
+		if (!job) {
 			break;
 		}
 
-		MediaInfoId &media = *mediaOpt;
+		MediaInfoId &media = job->media;
 
 		LOG_DEBUG("Getting metadata for \"{}\"", media.url);
-		withGIL([&] () {
+		if (helpers) {
 			try {
-				// we can't keep the downloader object around outside the GIL region
-				// its destructor must be called with GIL held
-				py::object downloader = youtubeDLModule.attr("YoutubeDL")(createDownloaderOptions());
-				py::object result = downloader.attr("extract_info")(media.url, false);
+				nlohmann::json request;
+				request["op"]       = "metadata";
+				request["url"]      = media.url;
+				request["options"]  = createHelperOptions();
+
+				auto reply = helpers->request(request);
 
-				metadataFromPython(media, downloader, result);
+				FreshInfo fresh;
+				fresh.expires       = metadataFromJSON(media, reply);
+				fresh.time          = media.metadataTime;
+				fresh.json          = std::move(reply.at("info").get_ref<std::string &>());
+				keepFreshInfo(media.url, std::move(fresh));
 
 				media.status        = MediaStatus::Downloading;
 			} catch (std::exception &e) {
 				media.status        = MediaStatus::Failed;
 				media.errorMessage  = e.what();
-			} catch (...) {
-				media.status        = MediaStatus::Failed;
-				media.errorMessage  = "Unknown exception from metadata downloader";
 			}
-		});
+		} else {
+			withGIL([&] () {
+				try {
+					if (!youtubeDL) {
+						youtubeDL = createYoutubeDL();
+					}
+					py::object result = youtubeDL.attr("extract_info")(media.url, false);
+
+					FreshInfo fresh;
+					fresh.expires       = metadataFromPython(media, youtubeDL, result);
+					fresh.time          = media.metadataTime;
+					fresh.info          = std::move(result);
+					keepFreshInfo(media.url, std::move(fresh));
+
+					media.status        = MediaStatus::Downloading;
+				} catch (std::exception &e) {
+					media.status        = MediaStatus::Failed;
+					media.errorMessage  = e.what();
+				} catch (...) {
+					media.status        = MediaStatus::Failed;
+					media.errorMessage  = "Unknown exception from metadata downloader";
+				}
+			});
+		}
 
 		if (media.length > maxLength) {
 			LOG_INFO("Media {} \"{}\" length {} exceeds max length {}", media.url, media.title, media.length, maxLength);
@@ -500,81 +1422,170 @@ void Downloader::DownloaderImpl::metadataThreadFunc() {
 		}
 
 		try {
-			utuputki.updateMediaInfo(media);
+			// download after it's written since the id can change
+			utuputki.updateMediaInfo(media, [this] (const MediaInfoId &updated) {
+				if (updated.status != MediaStatus::Downloading) {
+					return;
+				}
+
+				downloaderQueue.push(updated);
+			});
 		} catch (std::exception &e) {
 			LOG_ERROR("updateMediaInfo exception: {}", e.what());
 		} catch (...) {
 			LOG_ERROR("updateMediaInfo unknown exception");
 		}
 
-		if (media.status == MediaStatus::Downloading) {
-			std::unique_lock<std::mutex> lock(downloaderMutex);
-			downloaderQueue.emplace_back(std::move(media));
-			downloaderCV.notify_one();
-		}
+		metadataQueue.finished(*job);
+	}
+
+	if (youtubeDL) {
+		withGIL([&] () {
+			youtubeDL = py::object();
+		});
 	}
 }
 
 
-tl::optional<MediaInfoId> Downloader::DownloaderImpl::popMetadataQueue() {
-	std::unique_lock<std::mutex> lock(metadataMutex);
+Downloader::Downloader(Utuputki &utuputki, const Config &config)
+: impl(new DownloaderImpl(utuputki, config))
+{
 
-	while (true) {
-		if (shutdownMetadata) {
-			return tl::optional<MediaInfoId>();
-		}
+}
 
-		if (!metadataQueue.empty()) {
-			MediaInfoId retval = metadataQueue.front();
-			metadataQueue.pop_front();
 
-			return retval;
-		}
+Downloader::~Downloader() {
+}
 
-		metadataCV.wait(lock);
-	}
+
+void Downloader::addMedia(const std::string &mediaURL) {
+	assert(impl);
+
+	impl->addMedia(mediaURL);
 }
 
 
-tl::optional<MediaInfoId> Downloader::DownloaderImpl::popDownloadQueue() {
-	std::unique_lock<std::mutex> lock(downloaderMutex);
+struct CanonicalMedia {
+	std::string  url;
+	std::string  extractor;
+	std::string  videoId;
+};
 
-	while (true) {
-		if (shutdownDownloader) {
-			return tl::optional<MediaInfoId>();
-		}
 
-		if (!downloaderQueue.empty()) {
-			MediaInfoId retval = downloaderQueue.front();
-			downloaderQueue.pop_front();
+static bool isYoutubeId(const std::string &id) {
+	if (id.size() != 11) {
+		return false;
+	}
 
-			return retval;
+	for (char c : id) {
+		if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') {
+			return false;
 		}
+	}
 
-		downloaderCV.wait(lock);
+	return true;
+}
+
+
+static tl::optional<CanonicalMedia> canonicalYoutube(const std::string &id) {
+	if (!isYoutubeId(id)) {
+		return tl::nullopt;
 	}
+
+	CanonicalMedia c;
+	c.url       = "https://www.youtube.com/watch?v=" + id;
+	c.extractor = "Youtube";
+	c.videoId   = id;
+
+	return c;
 }
 
 
-Downloader::Downloader(Utuputki &utuputki, const Config &config)
-: impl(new DownloaderImpl(utuputki, config))
-{
+// extractor and id like yt-dlp would give, without asking it
+// nothing if we don't know this kind of url
+static tl::optional<CanonicalMedia> canonicalMedia(const Url &url) {
+	const std::string &host = url.host();
+	const std::string &path = url.path();
+	std::string id;
+
+	if (host == "youtu.be") {
+		id = path.substr(1);
+	} else if (host == "youtube.com" || host == "www.youtube.com" || host == "m.youtube.com") {
+		if (path == "/watch") {
+			for (const auto &kv : url.query()) {
+				if (kv.key() == "v") {
+					id = kv.val();
+					break;
+				}
+			}
+		} else {
+			for (const char *prefix : { "/shorts/", "/embed/", "/live/", "/v/" }) {
+				size_t len = strlen(prefix);
+				if (path.compare(0, len, prefix) == 0) {
+					id = path.substr(len);
+					break;
+				}
+			}
+		}
+	}
 
+	return canonicalYoutube(id);
 }
 
 
-Downloader::~Downloader() {
+// playlist or channel, added as all of its videos
+static bool isPlaylistURL(const Url &url) {
+	const std::string &host = url.host();
+	if (host != "youtube.com" && host != "www.youtube.com" && host != "m.youtube.com") {
+		return false;
+	}
+
+	const std::string &path = url.path();
+	if (path == "/playlist") {
+		return true;
+	}
+
+	for (const char *prefix : { "/@", "/channel/", "/c/", "/user/" }) {
+		if (path.compare(0, strlen(prefix), prefix) == 0) {
+			return true;
+		}
+	}
+
+	return false;
 }
 
 
-MediaInfoId Downloader::addMedia(const std::string &mediaURL) {
-	assert(impl);
+// flat playlist entry from yt-dlp, nothing if it's not a video we know
+// like another tab of a channel
+static tl::optional<MediaInfo> playlistEntry(const std::string &url, const std::string &extractor, const std::string &id, const std::string &title, unsigned int length) {
+	tl::optional<CanonicalMedia> canonical;
+	if (extractor == "Youtube") {
+		// older versions only give the id as url
+		canonical = canonicalYoutube(id);
+	} else {
+		try {
+			canonical = canonicalMedia(Url(url));
+		} catch (std::exception &) {
+		}
+	}
+
+	if (!canonical) {
+		LOG_DEBUG("Skipping playlist entry {} \"{}\"", extractor, url);
+		return tl::nullopt;
+	}
 
-	return impl->addMedia(mediaURL);
+	MediaInfo media;
+	media.url       = std::move(canonical->url);
+	media.extractor = std::move(canonical->extractor);
+	media.videoId   = std::move(canonical->videoId);
+	media.title     = title;
+	media.length    = length;
+
+	return media;
 }
 
 
-MediaInfoId Downloader::DownloaderImpl::addMedia(const std::string &mediaURL) {
+void Downloader::DownloaderImpl::addMedia(const std::string &mediaURL) {
 	assert(!mediaURL.empty());
 
 	LOG_INFO("addMedia \"{}\"", mediaURL);
@@ -592,8 +1603,128 @@ MediaInfoId Downloader::DownloaderImpl::addMedia(const std::string &mediaURL) {
 		throw BadHostException(fmt::format("Host {} not whitelisted", parsedURL.host()));
 	}
 
+	if (isPlaylistURL(parsedURL)) {
+		addPlaylist(parsedURL.str());
+		return;
+	}
+
 	std::string normalizedURL = parsedURL.str();
-	auto media = utuputki.getOrAddMediaByURL(normalizedURL);
+	std::string extractor;
+	std::string videoId;
+
+	auto canonical = canonicalMedia(parsedURL);
+	if (canonical) {
+		LOG_DEBUG("canonical: {} {} \"{}\"", canonical->extractor, canonical->videoId, canonical->url);
+		normalizedURL = std::move(canonical->url);
+		extractor     = std::move(canonical->extractor);
+		videoId       = std::move(canonical->videoId);
+	}
+
+	MediaInfo entry;
+	entry.url       = std::move(normalizedURL);
+	entry.extractor = std::move(extractor);
+	entry.videoId   = std::move(videoId);
+
+	addEntries({ entry });
+}
+
+
+void Downloader::DownloaderImpl::addPlaylist(const std::string &url) {
+	LOG_INFO("Adding entries of playlist \"{}\"", url);
+
+	unsigned int added = 0;
+	std::vector<MediaInfo> batch;
+	batch.reserve(playlistBatch);
+	auto flush = [&] () {
+		if (batch.empty()) {
+			return;
+		}
+
+		addEntries(batch);
+		added += batch.size();
+		batch.clear();
+	};
+
+	if (helpers) {
+		nlohmann::json request;
+		request["op"]       = "playlist";
+		request["url"]      = url;
+		request["options"]  = createHelperOptions();
+		request["options"]["noplaylist"]   = false;
+		request["options"]["extract_flat"] = "in_playlist";
+		request["batch"]    = playlistBatch;
+		request["limit"]    = maxPlaylistItems;
+
+		helpers->request(request, [&] (const nlohmann::json &entries) {
+			for (const auto &e : entries) {
+				auto media = playlistEntry(e.at("url").get<std::string>(), e.at("ie_key").get<std::string>(), e.at("id").get<std::string>(), e.at("title").get<std::string>(), e.at("duration").get<unsigned int>());
+				if (media) {
+					batch.emplace_back(std::move(*media));
+				}
+			}
+			flush();
+		});
+	} else {
+		withGIL([&] () {
+			auto options = createDownloaderOptions();
+			options["noplaylist"]   = false;
+			options["extract_flat"] = "in_playlist";
+			py::object youtubeDL = youtubeDLModule.attr("YoutubeDL")(options);
+
+			// not processing leaves entries as a generator which fetches
+			// more pages as it goes
+			py::object info = youtubeDL.attr("extract_info")(url, py::arg("download") = false, py::arg("process") = false);
+			// channels point to their videos tab
+			for (unsigned int i = 0; i < 3; i++) {
+				std::string type = infoString(info, "_type");
+				if (type != "url" && type != "url_transparent") {
+					break;
+				}
+				info = youtubeDL.attr("extract_info")(infoString(info, "url"), py::arg("download") = false, py::arg("process") = false);
+			}
+
+			py::object entries = info.attr("get")("entries");
+			if (entries.is_none()) {
+				throw std::runtime_error(fmt::format("No entries in playlist \"{}\"", url));
+			}
+
+			unsigned int seen = 0;
+			for (auto e : entries) {
+				if (maxPlaylistItems != 0 && seen >= maxPlaylistItems) {
+					LOG_INFO("Playlist \"{}\" has more than {} entries, ignoring the rest", url, maxPlaylistItems);
+					break;
+				}
+				seen++;
+
+				py::object duration = e.attr("get")("duration");
+				unsigned int length = duration.is_none() ? 0 : static_cast<unsigned int>(pybind11::cast<double>(duration));
+				auto media = playlistEntry(infoString(e, "url"), infoString(e, "ie_key"), infoString(e, "id"), infoString(e, "title"), length);
+				if (media) {
+					batch.emplace_back(std::move(*media));
+				}
+
+				if (batch.size() >= playlistBatch) {
+					// database doesn't need python
+					py::gil_scoped_release release;
+					flush();
+				}
+			}
+		});
+		flush();
+	}
+
+	LOG_INFO("Added {} media from playlist \"{}\"", added, url);
+}
+
+
+void Downloader::DownloaderImpl::addEntries(const std::vector<MediaInfo> &entries) {
+	for (auto &media : utuputki.addMediaToPlaylist(entries)) {
+		queueMedia(media);
+	}
+}
+
+
+void Downloader::DownloaderImpl::queueMedia(MediaInfoId &media) {
 	switch (media.status) {
 	case MediaStatus::Failed:
 		// if state is errored, clear it and try again
@@ -605,21 +1736,26 @@ MediaInfoId Downloader::DownloaderImpl::addMedia(const std::string &mediaURL) {
 	case MediaStatus::Initial: {
 
 		// new media, add to metadata queue
-		std::unique_lock<std::mutex> lock(metadataMutex);
-
-		bool wasEmpty = metadataQueue.empty();
-		metadataQueue.push_back(media);
-		if (wasEmpty) {
-			metadataCV.notify_one();
-		}
+		metadataQueue.push(media);
+		break;
 	}
 
+	case MediaStatus::Evicted:
+		// download it again, same as after metadata
+		media.status = MediaStatus::Downloading;
+		utuputki.updateMediaInfo(media, [this] (const MediaInfoId &updated) {
+			if (updated.status != MediaStatus::Downloading) {
+				return;
+			}
+
+			downloaderQueue.push(updated);
+		});
+		break;
+
 	case MediaStatus::Downloading:
 	case MediaStatus::Ready:
 		break;
 	}
-
-	return media;
 }
 
 
@@ -630,6 +1766,13 @@ void Downloader::startThreads() {
 }
 
 
+void Downloader::stopThreads() {
+	assert(impl);
+
+	impl->stopThreads();
+}
+
+
 void Downloader::DownloaderImpl::startThreads() {
 	assert(!threadsStarted);
 
@@ -638,14 +1781,29 @@ void Downloader::DownloaderImpl::startThreads() {
 	// less methods we need to add to Utuputki and Database classes
 	// the other threads are not started yet
 	// so we can access the queues without locking
+	auto &initialMetadata  = metadataQueue.initialQueue();
+	auto &initialDownloads = downloaderQueue.initialQueue();
+	std::unordered_set<MediaId> onPlaylist;
+	for (const auto &item : *utuputki.getPlaylist()) {
+		onPlaylist.insert(item.media);
+	}
 	for (auto &m : utuputki.getAllMedia()) {
 		switch (m.status) {
 		case MediaStatus::Initial:
-			metadataQueue.emplace_back(std::move(m));
+			initialMetadata.emplace_back(std::move(m));
 			break;
 
 		case MediaStatus::Downloading:
-			downloaderQueue.emplace_back(std::move(m));
+			initialDownloads.emplace_back(std::move(m));
+			break;
+
+		case MediaStatus::Evicted:
+			// eviction can race with adding it to the playlist
+			if (onPlaylist.find(m.id) != onPlaylist.end()) {
+				m.status = MediaStatus::Downloading;
+				utuputki.updateMediaInfo(m);
+				initialDownloads.emplace_back(std::move(m));
+			}
 			break;
 
 		default:
@@ -653,16 +1811,50 @@ void Downloader::DownloaderImpl::startThreads() {
 		}
 	}
 
-	LOG_INFO("Initially need metadata for {} media", metadataQueue.size());
-	LOG_INFO("Initially need to download {} media", downloaderQueue.size());
+	LOG_INFO("Initially need metadata for {} media", initialMetadata.size());
+	LOG_INFO("Initially need to download {} media", initialDownloads.size());
 
-	metadataThread   = std::thread(std::bind(&DownloaderImpl::metadataThreadFunc,   this));
-	downloaderThread = std::thread(std::bind(&DownloaderImpl::downloaderThreadFunc, this));
+	LOG_INFO("Starting {} metadata and {} download workers", metadataWorkers, downloadWorkers);
+	if (prefetchItems != 0 || prefetchSeconds != 0) {
+		LOG_INFO("Downloading at most {} items or {} seconds ahead, rest waits on the playlist", prefetchItems, prefetchSeconds);
+	}
+	if (maxCacheBytes != 0 || minFreeBytes != 0) {
+		LOG_INFO("Evicting least recently played media above {} bytes of cache or below {} bytes free", maxCacheBytes, minFreeBytes);
+	}
+	metadataQueue.start(metadataWorkers,   std::bind(&DownloaderImpl::metadataThreadFunc,   this));
+	downloaderQueue.start(downloadWorkers, std::bind(&DownloaderImpl::downloaderThreadFunc, this));
 
 	threadsStarted = true;
 }
 
 
+void Downloader::playlistChanged(const std::vector<PlaylistItemMedia> &playlist) {
+	assert(impl);
+
+	// metadata too since downloads wait for it
+	// but only download what's inside the prefetch window
+	std::unordered_map<MediaId, unsigned int> deadlines;
+	std::unordered_map<MediaId, unsigned int> downloadDeadlines;
+	unsigned int start = 0;
+	unsigned int index = 0;
+	for (const auto &item : playlist) {
+		deadlines.emplace(item.media, start);
+
+		bool inWindow = (impl->prefetchItems == 0 || index < impl->prefetchItems)
+		             && (impl->prefetchSeconds == 0 || start < impl->prefetchSeconds);
+		if (inWindow) {
+			downloadDeadlines.emplace(item.media, start);
+		}
+
+		start += item.length;
+		index++;
+	}
+
+	impl->metadataQueue.setDeadlines(std::move(deadlines));
+	impl->downloaderQueue.setDeadlines(std::move(downloadDeadlines));
+}
+
+
 std::string Downloader::getCacheDirectory() const {
 	assert(impl);
 
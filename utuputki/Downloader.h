@@ -3,8 +3,10 @@
 
 
 #include <memory>
+#include <vector>
 
 #include "Media.h"
+#include "Playlist.h"
 
 
 namespace utuputki {
@@ -35,7 +37,14 @@ public:
 
 	void startThreads();
 
-	MediaInfoId addMedia(const std::string &mediaURL);
+	// waits for current work to finish, queued work is dropped
+	void stopThreads();
+
+	// adds it to the playlist, or every entry of a playlist or channel
+	void addMedia(const std::string &mediaURL);
+
+	// work for media needed soonest goes first
+	void playlistChanged(const std::vector<PlaylistItemMedia> &playlist);
 
 	std::string getCacheDirectory() const;
 };
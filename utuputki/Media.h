@@ -4,6 +4,7 @@
 
 #include <cassert>
 #include <cstdint>
+#include <functional>
 #include <string>
 
 #include "utuputki/Timestamp.h"
@@ -28,6 +29,7 @@ class MediaId {
 	}
 
 	friend class Database;
+	friend struct std::hash<MediaId>;
 
 public:
 
@@ -62,6 +64,8 @@ enum class MediaStatus : uint8_t {
 	, Downloading
 	, Ready
 	, Failed
+	// file was removed from the cache, downloaded again when added
+	, Evicted
 };
 
 
@@ -71,10 +75,13 @@ struct MediaInfo {
 	std::string   filename;
 	std::string   title;
 	unsigned int  length;  // in seconds
-	unsigned int  filesize;  // in bytes
-	std::string   metadata;
+	uint64_t      filesize;  // in bytes
+	std::string   metadata;  // not loaded by default, empty when not loaded
 	Timestamp     metadataTime;
 	std::string   errorMessage;
+	// identify the video regardless of URL, empty when unknown or not loaded
+	std::string   extractor;
+	std::string   videoId;
 
 
 	MediaInfo()
@@ -113,7 +120,73 @@ struct MediaInfoId : public MediaInfo {
 };
 
 
+struct PlayStats {
+	unsigned int  playCount;
+	unsigned int  completedCount;
+	unsigned int  skippedCount;
+	unsigned int  skipVotes;
+	Timestamp     lastPlayed;
+	float         averageWatched;  // fraction of length, 0 to 1
+
+
+	PlayStats()
+	: playCount(0)
+	, completedCount(0)
+	, skippedCount(0)
+	, skipVotes(0)
+	, averageWatched(0.0f)
+	{
+	}
+
+	PlayStats(const PlayStats &other)            = default;
+	PlayStats &operator=(const PlayStats &other) = default;
+
+	PlayStats(PlayStats &&other)                 = default;
+	PlayStats &operator=(PlayStats &&other)      = default;
+
+	~PlayStats()                                 = default;
+};
+
+
+struct PlayStatsMedia : public PlayStats, public MediaInfoId {
+	explicit PlayStatsMedia(const MediaId &id_)
+	: MediaInfoId(id_)
+	{
+	}
+
+	PlayStatsMedia()                                       = delete;
+
+	PlayStatsMedia(const PlayStatsMedia &other)            = default;
+	PlayStatsMedia &operator=(const PlayStatsMedia &other) = default;
+
+	PlayStatsMedia(PlayStatsMedia &&other)                 = default;
+	PlayStatsMedia &operator=(PlayStatsMedia &&other)      = default;
+
+	~PlayStatsMedia()                                      = default;
+};
+
+
+enum class StatsOrder : uint8_t {
+	  MostPlayed
+	, MostSkipped
+	, RecentlyPlayed
+};
+
+
 }  // namespace utuputki
 
 
+namespace std {
+
+
+template <> struct hash<utuputki::MediaId> {
+	size_t operator()(const utuputki::MediaId &media) const {
+		return hash<uint64_t>()(media.id);
+	}
+};
+
+
+}  // namespace std
+
+
 #endif  // MEDIA_H
@@ -1,4 +1,5 @@
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <thread>
 
@@ -78,7 +79,11 @@ struct Player::PlayerImpl {
 	std::mutex                      helpMutex;
 	std::condition_variable         helpCV;
 	bool                            onStandby;
+	// false once it has finished, it must be started again then
+	bool                            standbyPlaying;
 	bool                            skipped;
+	// set with every helpCV notify, the wait might not have started yet
+	bool                            notified;
 
 
 	PlayerImpl()                                   = delete;
@@ -103,6 +108,8 @@ struct Player::PlayerImpl {
 		// we must wake thread anyway to put it back
 
 		std::unique_lock<std::mutex> lock(helpMutex);
+		standbyPlaying = false;
+		notified       = true;
 		helpCV.notify_one();
 	}
 
@@ -124,7 +131,9 @@ Player::PlayerImpl::PlayerImpl(Utuputki &utuputki_, const Config &config)
 , standby(instance, mediaOpen, mediaRead, mediaSeek, mediaClose)
 , shutdownFlag(false)
 , onStandby(true)
+, standbyPlaying(false)
 , skipped(false)
+, notified(false)
 {
 	instance.logSet(std::bind(&PlayerImpl::logCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 
@@ -256,15 +265,44 @@ void Player::PlayerImpl::run() {
 			if (currentlyPlaying) {
 				currentMedia = VLC::Media(instance, cacheDirectory + "/" + currentlyPlaying->filename, VLC::Media::FromType::FromPath);
 				mediaPlayer.setMedia(currentMedia);
-				onStandby = false;
-			} else {
+				mediaPlayer.play();
+				onStandby      = false;
+				standbyPlaying = false;
+			} else if (!standbyPlaying) {
+				// coming back after a maintenance cycle it's still playing,
+				// restarting it every time would make it jump
 				mediaPlayer.setMedia(standby);
-				onStandby = true;
+				mediaPlayer.play();
+				onStandby      = true;
+				standbyPlaying = true;
+			}
+			skipped  = false;
+			notified = false;
+
+			// nothing is playing so do database maintenance, pausing between
+			// steps so others get the database too
+			// helpMutex is released during a step so notifying isn't held up
+			// by it, anything that came in meanwhile is seen in notified
+			bool maintained = false;
+			if (onStandby) {
+				while (!notified && !shutdownFlag) {
+					lock.unlock();
+					bool more = utuputki.databaseMaintenance();
+					lock.lock();
+					if (!more) {
+						break;
+					}
+
+					maintained = true;
+					helpCV.wait_for(lock, std::chrono::milliseconds(10), [this] () { return notified; });
+				}
 			}
-			mediaPlayer.play();
-			skipped = false;
 
-			helpCV.wait(lock);
+			// a wakeup racing with the timeout looks like a timeout
+			// so check the playlist again instead of waiting
+			if (!maintained && !notified) {
+				helpCV.wait(lock);
+			}
 		}
 
 		if (currentlyPlaying) {
@@ -278,7 +316,8 @@ void Player::PlayerImpl::run() {
 
 void Player::PlayerImpl::skipCurrent() {
 	std::unique_lock<std::mutex> lock(helpMutex);
-	skipped = true;
+	skipped  = true;
+	notified = true;
 	helpCV.notify_one();
 
 }
@@ -290,6 +329,7 @@ void Player::PlayerImpl::notifyMediaUpdate() {
 	std::unique_lock<std::mutex> lock(helpMutex);
 	if (onStandby) {
 		LOG_DEBUG("notifyMediaUpdate notify_one");
+		notified = true;
 		helpCV.notify_one();
 	}
 }
@@ -303,6 +343,7 @@ void Player::shutdown(bool immediate) {
 	{
 		std::unique_lock<std::mutex> lock(impl->helpMutex);
 		if (immediate || impl->onStandby) {
+			impl->notified = true;
 			impl->helpCV.notify_one();
 		}
 	}
@@ -116,15 +116,24 @@ enum class HistoryStatus : uint8_t {
 };
 
 
+enum class MoveDirection : uint8_t {
+	  Up    // towards the front, played sooner
+	, Down
+};
+
+
 struct PlaylistItem {
 	PlaylistItemId  id;
 	MediaId         media;
 	Timestamp       queueTime;
+	// only the order matters, not the values
+	int64_t         position;
 
 
 	PlaylistItem(const PlaylistItemId &id_, const MediaId &media_)
 	: id(id_)
 	, media(media_)
+	, position(0)
 	{
 	}
 
@@ -204,6 +213,43 @@ struct HistoryItemMedia : public HistoryItem, public MediaInfo {
 };
 
 
+// values are stored in the database, only add to the end
+enum class ChangeKind : uint8_t {
+	  Reset            // too much changed to describe, reload everything
+	, MediaUpdated     // item is media id
+	, PlaylistAdded    // item is playlist item id
+	, PlaylistRemoved  // item is playlist item id
+	, HistoryStarted   // item is history item id
+	, HistoryFinished  // item is history item id
+	, PlaylistMoved    // item is playlist item id
+};
+
+
+struct Change {
+	uint64_t    version;
+	ChangeKind  kind;
+	uint64_t    item;
+	uint64_t    media;
+
+
+	Change()
+	: version(0)
+	, kind(ChangeKind::Reset)
+	, item(0)
+	, media(0)
+	{
+	}
+
+	Change(const Change &other)            = default;
+	Change &operator=(const Change &other) = default;
+
+	Change(Change &&other)                 = default;
+	Change &operator=(Change &&other)      = default;
+
+	~Change()                              = default;
+};
+
+
 }  // namespace utuputki
 
 
@@ -34,6 +34,12 @@ struct Utuputki::UtuputkiImpl {
 	struct sigaction                oldSigactionHUP;
 	struct sigaction                oldSigactionInt;
 
+	// only changed from database commit callbacks so it sees
+	// changes in the same order as the database
+	// mutex only protects swapping the pointer
+	mutable std::mutex              playlistMutex;
+	PlaylistSnapshot                playlist;
+
 	// c++17 TODO shared_mutex (rwlock)
 	std::mutex                      nowPlayingMutex;
 	tl::optional<HistoryItemMedia>  nowPlaying;
@@ -60,14 +66,26 @@ struct Utuputki::UtuputkiImpl {
 
 	void reExec(bool immediate);
 
+	PlaylistSnapshot getPlaylist() const;
+
+	template <typename F> void modifyPlaylist(F &&f);
+
+	void reloadPlaylist();
+
+	void addToPlaylist(MediaId media);
+
+	std::vector<MediaInfoId> addMediaToPlaylist(const std::vector<MediaInfo> &entries);
+
+	bool movePlaylistItem(const std::string &itemId, MoveDirection direction);
+
+	void updateMediaInfo(const MediaInfoId &media, std::function<void(const MediaInfoId &)> &&onCommit);
+
 	tl::optional<HistoryItemMedia> popNextPlaylistItem();
 
 	void playlistItemFinished(HistoryItemMedia &item, HistoryStatus finishReason);
 
 	tl::optional<HistoryItemMedia> getNowPlaying();
 
-	std::vector<HistoryItemMedia> getHistory();
-
 	unsigned int calculateNeededSkips();
 
 	void skipVideo(const std::string &media, const std::string &client);
@@ -110,10 +128,18 @@ Utuputki::UtuputkiImpl::UtuputkiImpl(Utuputki &utuputki)
 			throw std::runtime_error("setrlimit failed");
 		}
 	}
+
+	reloadPlaylist();
 }
 
 
 Utuputki::UtuputkiImpl::~UtuputkiImpl() {
+	// stop everything that could make database changes and then wait for
+	// the queued ones. their callbacks use the webserver and player
+	// which are destroyed before the database
+	webServer.stopServer();
+	downloader.stopThreads();
+	database.flush();
 }
 
 
@@ -129,8 +155,166 @@ void Utuputki::UtuputkiImpl::reExec(bool immediate) {
 }
 
 
+PlaylistSnapshot Utuputki::UtuputkiImpl::getPlaylist() const {
+	std::unique_lock<std::mutex> lock(playlistMutex);
+	return playlist;
+}
+
+
+template <typename F> void Utuputki::UtuputkiImpl::modifyPlaylist(F &&f) {
+	// readers might still be using the old one so modify a copy
+	auto newPlaylist = std::make_shared<std::vector<PlaylistItemMedia> >(*getPlaylist());
+	f(*newPlaylist);
+	downloader.playlistChanged(*newPlaylist);
+
+	std::unique_lock<std::mutex> lock(playlistMutex);
+	playlist = std::move(newPlaylist);
+}
+
+
+// a reload earlier in the same write batch already has everything the
+// batch committed, including items added after it
+static void appendIfMissing(std::vector<PlaylistItemMedia> &p, const PlaylistItemMedia &item) {
+	auto present = std::find_if(p.begin(), p.end(), [&] (const PlaylistItemMedia &i) { return i.id == item.id; });
+	if (present == p.end()) {
+		p.push_back(item);
+	}
+}
+
+
+void Utuputki::UtuputkiImpl::reloadPlaylist() {
+	auto newPlaylist = std::make_shared<const std::vector<PlaylistItemMedia> >(database.getPlaylist());
+
+	LOG_DEBUG("loaded playlist with {} items", newPlaylist->size());
+	downloader.playlistChanged(*newPlaylist);
+
+	std::unique_lock<std::mutex> lock(playlistMutex);
+	playlist = std::move(newPlaylist);
+}
+
+
+void Utuputki::UtuputkiImpl::addToPlaylist(MediaId media) {
+	// wait so the playlist page shows it after redirect
+	database.addToPlaylist(media, [this] (const tl::optional<PlaylistItemMedia> &item) {
+		if (!item) {
+			return;
+		}
+
+		// newest queue time so it goes last
+		modifyPlaylist([&] (std::vector<PlaylistItemMedia> &p) {
+			appendIfMissing(p, *item);
+		});
+
+		webServer.notifyAddedToPlaylist(*item);
+	});
+}
+
+
+std::vector<MediaInfoId> Utuputki::UtuputkiImpl::addMediaToPlaylist(const std::vector<MediaInfo> &entries) {
+	auto batch = database.addMediaToPlaylist(entries, [this] (const PlaylistBatch &committed) {
+		if (committed.added.empty()) {
+			return;
+		}
+
+		modifyPlaylist([&] (std::vector<PlaylistItemMedia> &p) {
+			for (const auto &item : committed.added) {
+				appendIfMissing(p, item);
+			}
+		});
+
+		for (const auto &item : committed.added) {
+			webServer.notifyAddedToPlaylist(item);
+		}
+	});
+
+	return std::move(batch.media);
+}
+
+
+bool Utuputki::UtuputkiImpl::movePlaylistItem(const std::string &itemId, MoveDirection direction) {
+	// ids only come from the database, look it up on the playlist
+	auto snapshot = getPlaylist();
+	auto it = std::find_if(snapshot->begin(), snapshot->end(), [&] (const PlaylistItemMedia &i) { return i.id.toString() == itemId; });
+	if (it == snapshot->end()) {
+		return false;
+	}
+
+	// wait so the playlist page shows it after redirect
+	auto moved = database.movePlaylistItem(it->id, direction, [this] (const std::vector<PlaylistItem> &items) {
+		if (items.empty()) {
+			return;
+		}
+
+		modifyPlaylist([&] (std::vector<PlaylistItemMedia> &p) {
+			for (auto &i : p) {
+				for (const auto &m : items) {
+					if (i.id == m.id) {
+						i.position = m.position;
+					}
+				}
+			}
+
+			std::stable_sort(p.begin(), p.end(), [] (const PlaylistItemMedia &a, const PlaylistItemMedia &b) { return a.position < b.position; });
+		});
+
+		webServer.notifyPlaylistMoved(items);
+	});
+
+	return !moved.empty();
+}
+
+
+void Utuputki::UtuputkiImpl::updateMediaInfo(const MediaInfoId &media, std::function<void(const MediaInfoId &)> &&onCommit) {
+	MediaId oldId = media.id;
+
+	database.updateMediaInfo(media, [this, oldId, onCommit = std::move(onCommit)] (const MediaInfoId &updated) {
+		if (updated.id != oldId) {
+			// merged with another media, playlist items might have been
+			// repointed or removed. rare enough to just reload
+			reloadPlaylist();
+		} else {
+			modifyPlaylist([&] (std::vector<PlaylistItemMedia> &p) {
+				if (updated.status == MediaStatus::Failed) {
+					// database removed these
+					p.erase(std::remove_if(p.begin(), p.end(), [&] (const PlaylistItemMedia &item) { return item.media == updated.id; }), p.end());
+					return;
+				}
+
+				for (auto &item : p) {
+					if (item.media == updated.id) {
+						static_cast<MediaInfo &>(item) = updated;
+						// keep the snapshot small, nobody reads it from there
+						item.metadata.clear();
+					}
+				}
+			});
+		}
+
+		webServer.notifyMediaUpdated(updated);
+
+		if (updated.status == MediaStatus::Ready) {
+			// notify player, if it's on standby it might decide to wake up now
+			player.notifyMediaUpdate();
+		}
+
+		if (onCommit) {
+			onCommit(updated);
+		}
+	});
+}
+
+
 tl::optional<HistoryItemMedia> Utuputki::UtuputkiImpl::popNextPlaylistItem() {
-	auto item = database.popNextPlaylistItem();
+	auto item = database.popNextPlaylistItem([this] (const tl::optional<HistoryItemMedia> &popped) {
+		if (!popped) {
+			return;
+		}
+
+		// media is on the playlist at most once
+		modifyPlaylist([&] (std::vector<PlaylistItemMedia> &p) {
+			p.erase(std::remove_if(p.begin(), p.end(), [&] (const PlaylistItemMedia &i) { return i.media == popped->media; }), p.end());
+		});
+	});
 
 	{
 		std::unique_lock<std::mutex> lock(nowPlayingMutex);
@@ -330,33 +514,58 @@ bool Utuputki::shouldReExec() const {
 void Utuputki::addMedia(const std::string &mediaURL) {
 	assert(impl);
 
-	auto media = impl->downloader.addMedia(mediaURL);
-
-		addToPlaylist(media.id);
+	// adds to the playlist itself, playlist urls add many in batches
+	impl->downloader.addMedia(mediaURL);
 }
 
 
-MediaInfoId Utuputki::getOrAddMediaByURL(const std::string &url) {
+MediaInfoId Utuputki::getOrAddMediaByURL(const std::string &url, const std::string &extractor, const std::string &videoId) {
 	assert(impl);
 	assert(!url.empty());
 
-	return impl->database.getOrAddMediaByURL(url);
+	return impl->database.getOrAddMediaByURL(url, extractor, videoId);
+}
+
+
+std::vector<MediaInfoId> Utuputki::addMediaToPlaylist(const std::vector<MediaInfo> &entries) {
+	assert(impl);
+
+	return impl->addMediaToPlaylist(entries);
 }
 
 
 void Utuputki::addToPlaylist(MediaId media) {
 	assert(impl);
 
-	impl->webServer.notifyAddedToPlaylist(impl->database.getMediaInfo(media));
+	impl->addToPlaylist(media);
+}
 
-	return impl->database.addToPlaylist(media);
+
+bool Utuputki::movePlaylistItem(const std::string &item, MoveDirection direction) {
+	assert(impl);
+
+	return impl->movePlaylistItem(item, direction);
+}
+
+
+PlaylistSnapshot Utuputki::getPlaylist() const {
+	assert(impl);
+
+	return impl->getPlaylist();
 }
 
 
-std::vector<PlaylistItemMedia> Utuputki::getPlaylist() {
+uint64_t Utuputki::getVersion() {
 	assert(impl);
 
-	return impl->database.getPlaylist();
+	return impl->database.getVersion();
+}
+
+
+std::vector<Change> Utuputki::getChanges(uint64_t since, unsigned int limit) {
+	assert(impl);
+
+	return impl->database.getChanges(since, limit);
 }
 
 
@@ -367,15 +576,45 @@ std::vector<MediaInfoId> Utuputki::getAllMedia(){
 }
 
 
-void Utuputki::updateMediaInfo(MediaInfoId &media) {
+std::vector<MediaInfoId> Utuputki::getMedia(uint64_t before, unsigned int limit) {
+	assert(impl);
+
+	return impl->database.getMedia(before, limit);
+}
+
+
+std::vector<MediaInfoId> Utuputki::searchMedia(const std::string &query, unsigned int offset, unsigned int limit) {
 	assert(impl);
 
-	impl->database.updateMediaInfo(media);
+	return impl->database.searchMedia(query, offset, limit);
+}
 
-	if (media.status == MediaStatus::Ready) {
-		// notify player, if it's on standby it might decide to wake up now
-		impl->player.notifyMediaUpdate();
-	}
+
+std::vector<PlayStatsMedia> Utuputki::getPlayStats(StatsOrder order, unsigned int limit) {
+	assert(impl);
+
+	return impl->database.getPlayStats(order, limit);
+}
+
+
+std::vector<PlayStatsMedia> Utuputki::getCachedMedia() {
+	assert(impl);
+
+	return impl->database.getCachedMedia();
+}
+
+
+void Utuputki::updateMediaInfo(const MediaInfoId &media, std::function<void(const MediaInfoId &)> onCommit) {
+	assert(impl);
+
+	impl->updateMediaInfo(media, std::move(onCommit));
+}
+
+
+std::string Utuputki::getMediaMetadata(MediaId media) {
+	assert(impl);
+
+	return impl->database.getMediaMetadata(media);
 }
 
 
@@ -400,10 +639,10 @@ tl::optional<HistoryItemMedia> Utuputki::getNowPlaying() const {
 }
 
 
-std::vector<HistoryItemMedia> Utuputki::getHistory() {
+std::vector<HistoryItemMedia> Utuputki::getHistory(uint64_t before, unsigned int limit) {
 	assert(impl);
 
-	return impl->database.getHistory();
+	return impl->database.getHistory(before, limit);
 }
 
 
@@ -414,6 +653,13 @@ std::string Utuputki::getCacheDirectory() const {
 }
 
 
+bool Utuputki::databaseMaintenance() {
+	assert(impl);
+
+	return impl->database.maintenanceStep();
+}
+
+
 void Utuputki::skipVideo(const std::string &media, const std::string &client) {
 	assert(impl);
 
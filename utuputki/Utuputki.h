@@ -2,6 +2,7 @@
 #define UTUPUTKI_H
 
 
+#include <functional>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -26,6 +27,10 @@ public:
 struct MediaInfo;
 
 
+// never modified after creation, changes replace it with a new one
+typedef std::shared_ptr<const std::vector<PlaylistItemMedia> > PlaylistSnapshot;
+
+
 class Utuputki {
 	struct UtuputkiImpl;
 	std::unique_ptr<UtuputkiImpl> impl;
@@ -49,15 +54,41 @@ public:
 
 	void addMedia(const std::string &mediaURL);
 
-	MediaInfoId getOrAddMediaByURL(const std::string &url);
+	MediaInfoId getOrAddMediaByURL(const std::string &url, const std::string &extractor = std::string(), const std::string &videoId = std::string());
 
 	void addToPlaylist(MediaId media);
 
-	std::vector<PlaylistItemMedia> getPlaylist();
+	// waits for the write, returns the media for each entry
+	std::vector<MediaInfoId> addMediaToPlaylist(const std::vector<MediaInfo> &entries);
+
+	// false if item is not on the playlist or already at that end
+	bool movePlaylistItem(const std::string &item, MoveDirection direction);
+
+	// doesn't touch the database, safe to call often
+	PlaylistSnapshot getPlaylist() const;
+
+	// read this before getPlaylist, the snapshot includes at least
+	// every change up to it
+	uint64_t getVersion();
+
+	std::vector<Change> getChanges(uint64_t since, unsigned int limit);
 
 	std::vector<MediaInfoId> getAllMedia();
 
-	void updateMediaInfo(MediaInfoId &media);
+	std::vector<MediaInfoId> getMedia(uint64_t before, unsigned int limit);
+
+	std::vector<MediaInfoId> searchMedia(const std::string &query, unsigned int offset, unsigned int limit);
+
+	std::vector<PlayStatsMedia> getPlayStats(StatsOrder order, unsigned int limit);
+
+	std::vector<PlayStatsMedia> getCachedMedia();
+
+	// doesn't wait for the database write
+	// onCommit gets the media after commit, its id is different if it
+	// was merged with an existing media
+	void updateMediaInfo(const MediaInfoId &media, std::function<void(const MediaInfoId &)> onCommit = std::function<void(const MediaInfoId &)>());
+
+	std::string getMediaMetadata(MediaId media);
 
 	tl::optional<HistoryItemMedia> popNextPlaylistItem();
 
@@ -66,10 +97,13 @@ public:
 
 	tl::optional<HistoryItemMedia> getNowPlaying() const;
 
-	std::vector<HistoryItemMedia> getHistory();
+	std::vector<HistoryItemMedia> getHistory(uint64_t before, unsigned int limit);
 
 	std::string getCacheDirectory() const;
 
+	// call repeatedly when idle until it returns false
+	bool databaseMaintenance();
+
 	void skipVideo(const std::string &media, const std::string &client);
 };
 
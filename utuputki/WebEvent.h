@@ -0,0 +1,38 @@
+#ifndef WEBEVENT_H
+#define WEBEVENT_H
+
+
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+
+namespace utuputki {
+
+
+// websocket event message as sent to clients
+// data is an object or an array of them depending on the event
+inline std::string webEventMessage(const char *type, nlohmann::json &&data) {
+	// clients don't use metadata
+	if (data.is_object()) {
+		data.erase("metadata");
+	} else if (data.is_array()) {
+		for (auto &item : data) {
+			if (item.is_object()) {
+				item.erase("metadata");
+			}
+		}
+	}
+
+	nlohmann::json event;
+	event["type"] = type;
+	event["data"] = std::move(data);
+
+	return event.dump(-1, ' ', false, nlohmann::detail::error_handler_t::replace);
+}
+
+
+}  // namespace utuputki
+
+
+#endif  // WEBEVENT_H
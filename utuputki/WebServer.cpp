@@ -1,4 +1,5 @@
 #include <cctype>
+#include <cerrno>
 #include <cstring>
 
 #include <mutex>
@@ -15,6 +16,7 @@
 #include "utuputki/Logger.h"
 #include "utuputki/Utils.h"
 #include "utuputki/Utuputki.h"
+#include "utuputki/WebEvent.h"
 #include "utuputki/WebServer.h"
 
 #include "listMedia.template.h"
@@ -22,6 +24,8 @@
 #include "header.template.h"
 #include "history.template.h"
 #include "playlist.template.h"
+#include "search.template.h"
+#include "stats.template.h"
 #include "utuputki.css.h"
 #include "utuputki.js.h"
 
@@ -108,7 +112,64 @@ static Format getFormatParameter(struct mg_connection *conn, Format def) {
 }
 
 
-std::array<const char *, 4> statusNames = { "Fetching metadata", "Downloading", "Ready", "Failed" };
+static uint64_t getUIntParameter(struct mg_connection *conn, const char *name, uint64_t def) {
+	std::string str;
+	if (!CivetServer::getParam(conn, name, str) || str.empty()) {
+		return def;
+	}
+
+	if (!std::all_of(str.begin(), str.end(), [] (char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+		return def;
+	}
+
+	errno = 0;
+	uint64_t value = strtoull(str.c_str(), nullptr, 10);
+	if (errno != 0) {
+		return def;
+	}
+
+	return value;
+}
+
+
+// templates don't escape so anything the user typed must be escaped before
+static std::string escapeHTML(const std::string &str) {
+	std::string result;
+	result.reserve(str.size());
+
+	for (char c : str) {
+		switch (c) {
+		case '&':
+			result += "&amp;";
+			break;
+
+		case '<':
+			result += "&lt;";
+			break;
+
+		case '>':
+			result += "&gt;";
+			break;
+
+		case '"':
+			result += "&quot;";
+			break;
+
+		case '\'':
+			result += "&#39;";
+			break;
+
+		default:
+			result += c;
+			break;
+		}
+	}
+
+	return result;
+}
+
+
+std::array<const char *, 5> statusNames = { "Fetching metadata", "Downloading", "Ready", "Failed", "Removed from cache" };
 
 
 static const char *statusString(MediaStatus s) {
@@ -119,6 +180,17 @@ static const char *statusString(MediaStatus s) {
 }
 
 
+std::array<const char *, 7> changeKindNames = { "reset", "mediaUpdated", "playlistAdded", "playlistRemoved", "historyStarted", "historyFinished", "playlistMoved" };
+
+
+static const char *changeKindString(ChangeKind k) {
+	auto index = static_cast<unsigned int>(k);
+	assert(index < changeKindNames.size());
+
+	return changeKindNames[index];
+}
+
+
 static std::string formatLength(unsigned int seconds) {
 	if (seconds < 3600) {
 		unsigned int minutes = seconds / 60;
@@ -168,10 +240,21 @@ void to_json(json &j, const MediaInfoId &item) {
 }
 
 
+void to_json(json &j, const PlaylistItem &item) {
+	j = json {
+		  { "id",            item.id.toString()     }
+		, { "mediaId",       item.media.toString()  }
+		, { "position",      item.position          }
+	};
+}
+
+
 void to_json(json &j, const PlaylistItemMedia &item) {
 	j = jsonFromMediaInfo(item);
+	j["mediaId"]       = item.media.toString();
 	j["id"]            = item.id.toString();
 	j["queueTime"]     = item.queueTime;
+	j["position"]      = item.position;
 }
 
 
@@ -188,6 +271,30 @@ void to_json(json &j, const HistoryItemMedia &item) {
 }
 
 
+void to_json(json &j, const Change &change) {
+	j = json {
+		  { "version",       std::to_string(change.version)  }
+		, { "type",          changeKindString(change.kind)   }
+		, { "id",            std::to_string(change.item)     }
+		, { "mediaId",       std::to_string(change.media)    }
+	};
+}
+
+
+void to_json(json &j, const PlayStatsMedia &item) {
+	j = jsonFromMediaInfo(item);
+	j["id"]             = item.id.toString();
+	j["playCount"]      = item.playCount;
+	j["completedCount"] = item.completedCount;
+	j["skippedCount"]   = item.skippedCount;
+	j["skipVotes"]      = item.skipVotes;
+	j["lastPlayed"]     = item.lastPlayed;
+	j["averageWatched"] = item.averageWatched;
+	// metadata is never loaded here
+	j.erase("metadata");
+}
+
+
 struct WebServer::WebServerImpl {
 
 	class UtuputkiServer final : public CivetServer {
@@ -445,9 +552,13 @@ struct WebServer::WebServerImpl {
 		bool handleGet(WebServerImpl *impl_, const std::string & /* client */, struct mg_connection *conn) override {
 			json jsonData;
 
+			PageParameters page = impl_->getPageParameters(conn);
+			auto historyItems   = impl_->utuputki.getHistory(page.before, page.limit + 1);
+			impl_->finishPage(jsonData, page, historyItems);
+
 			jsonData["title"]          = "Utuputki history";
 			auto history = json::array();
-			for (const auto &historyItem : impl_->utuputki.getHistory()) {
+			for (const auto &historyItem : historyItems) {
 				json historyJson = historyItem;
 				historyJson["startTimeReadable"]  = impl_->formatLocalTime(historyItem.startTime);
 				historyJson["endTimeReadable"]    = impl_->formatLocalTime(historyItem.endTime);
@@ -500,8 +611,12 @@ struct WebServer::WebServerImpl {
 		bool handleGet(WebServerImpl *impl_, const std::string & /* client */, struct mg_connection *conn) override {
 			json jsonData;
 
+			PageParameters page = impl_->getPageParameters(conn);
+			auto media          = impl_->utuputki.getMedia(page.before, page.limit + 1);
+			impl_->finishPage(jsonData, page, media);
+
 			jsonData["title"]          = "Utuputki media";
-			jsonData["allMedia"]       = impl_->utuputki.getAllMedia();
+			jsonData["allMedia"]       = std::move(media);
 			jsonData["refreshSeconds"] = 60;
 
 			MIMEType mimeType = MIMEType::TextHTML;
@@ -515,6 +630,116 @@ struct WebServer::WebServerImpl {
 	};
 
 
+	class SearchHandler final : public RequestHandler {
+		SearchHandler(const SearchHandler &other)            = delete;
+		SearchHandler &operator=(const SearchHandler &other) = delete;
+
+		SearchHandler(SearchHandler &&other)                 = delete;
+		SearchHandler &operator=(SearchHandler &&other)      = delete;
+
+	public:
+
+		SearchHandler() {
+		}
+
+
+		const char *name() const override {
+			return "search";
+		}
+
+
+		bool handleGet(WebServerImpl *impl_, const std::string & /* client */, struct mg_connection *conn) override {
+			json jsonData;
+
+			std::string query;
+			CivetServer::getParam(conn, "q", query);
+
+			// ranked results can't be paged by id so use an offset
+			PageParameters page = impl_->getPageParameters(conn);
+			unsigned int offset = static_cast<unsigned int>(std::min(getUIntParameter(conn, "offset", 0), uint64_t(std::numeric_limits<unsigned int>::max() - page.limit - 1)));
+			auto results        = impl_->utuputki.searchMedia(query, offset, page.limit + 1);
+			if (results.size() > page.limit) {
+				results.pop_back();
+				jsonData["nextOffset"] = offset + page.limit;
+			}
+			if (offset != 0) {
+				jsonData["prevOffset"] = offset - std::min(offset, page.limit);
+			}
+
+			std::string queryURL;
+			CivetServer::urlEncode(query, queryURL);
+
+			jsonData["title"]          = "Utuputki search";
+			jsonData["query"]          = query;
+			jsonData["queryHTML"]      = escapeHTML(query);
+			jsonData["queryURL"]       = queryURL;
+			jsonData["offset"]         = offset;
+			jsonData["limit"]          = page.limit;
+			jsonData["results"]        = std::move(results);
+			jsonData["refreshSeconds"] = 600;
+
+			MIMEType mimeType = MIMEType::TextHTML;
+			std::string output;
+
+			Format fmt = getFormatParameter(conn, Format::HTML);
+			std::tie(output, mimeType) = impl_->formatOutput(jsonData, fmt, impl_->getSearchTemplate());
+
+			return sendOK(conn, mimeType, output);
+		}
+	};
+
+
+	class StatsHandler final : public RequestHandler {
+		StatsHandler(const StatsHandler &other)            = delete;
+		StatsHandler &operator=(const StatsHandler &other) = delete;
+
+		StatsHandler(StatsHandler &&other)                 = delete;
+		StatsHandler &operator=(StatsHandler &&other)      = delete;
+
+	public:
+
+		StatsHandler() {
+		}
+
+
+		const char *name() const override {
+			return "stats";
+		}
+
+
+		bool handleGet(WebServerImpl *impl_, const std::string & /* client */, struct mg_connection *conn) override {
+			json jsonData;
+
+			unsigned int limit = static_cast<unsigned int>(std::min(getUIntParameter(conn, "limit", impl_->statsSize), uint64_t(impl_->maxPageSize)));
+			if (limit == 0) {
+				limit = impl_->statsSize;
+			}
+
+			json recentlyPlayed = json::array();
+			for (const auto &item : impl_->utuputki.getPlayStats(StatsOrder::RecentlyPlayed, limit)) {
+				json j = item;
+				j["lastPlayedReadable"] = impl_->formatLocalTime(item.lastPlayed);
+				recentlyPlayed.push_back(std::move(j));
+			}
+
+			jsonData["title"]          = "Utuputki statistics";
+			jsonData["limit"]          = limit;
+			jsonData["mostPlayed"]     = impl_->utuputki.getPlayStats(StatsOrder::MostPlayed,  limit);
+			jsonData["mostSkipped"]    = impl_->utuputki.getPlayStats(StatsOrder::MostSkipped, limit);
+			jsonData["recentlyPlayed"] = std::move(recentlyPlayed);
+			jsonData["refreshSeconds"] = 600;
+
+			MIMEType mimeType = MIMEType::TextHTML;
+			std::string output;
+
+			Format fmt = getFormatParameter(conn, Format::HTML);
+			std::tie(output, mimeType) = impl_->formatOutput(jsonData, fmt, impl_->getStatsTemplate());
+
+			return sendOK(conn, mimeType, output);
+		}
+	};
+
+
 	class SkipHandler final : public RequestHandler {
 		SkipHandler(const SkipHandler &other)            = delete;
 		SkipHandler &operator=(const SkipHandler &other) = delete;
@@ -546,6 +771,121 @@ struct WebServer::WebServerImpl {
 	};
 
 
+	class MovePlaylistItemHandler final : public RequestHandler {
+		MovePlaylistItemHandler(const MovePlaylistItemHandler &other)            = delete;
+		MovePlaylistItemHandler &operator=(const MovePlaylistItemHandler &other) = delete;
+
+		MovePlaylistItemHandler(MovePlaylistItemHandler &&other)                 = delete;
+		MovePlaylistItemHandler &operator=(MovePlaylistItemHandler &&other)      = delete;
+
+	public:
+
+		MovePlaylistItemHandler() {
+		}
+
+
+		const char *name() const override {
+			return "movePlaylistItem";
+		}
+
+
+		bool handlePost(WebServerImpl *impl_, const std::string & /* client */, struct mg_connection *conn) override {
+			std::string item;
+			if (!CivetServer::getParam(conn, "item", item)) {
+				return sendError(conn, 400, "No item key");
+			}
+
+			std::string directionString;
+			CivetServer::getParam(conn, "direction", directionString);
+
+			MoveDirection direction = MoveDirection::Up;
+			if (directionString == "up") {
+				direction = MoveDirection::Up;
+			} else if (directionString == "down") {
+				direction = MoveDirection::Down;
+			} else {
+				return sendError(conn, 400, "Direction must be up or down");
+			}
+
+			// already at the end or just played isn't worth an error page
+			impl_->utuputki.movePlaylistItem(item, direction);
+
+			// redirect back to playlist
+			return sendRedirect(conn, "/");
+		}
+	};
+
+
+	class EventsHandler final : public CivetWebSocketHandler {
+		EventsHandler(const EventsHandler &other)            = delete;
+		EventsHandler &operator=(const EventsHandler &other) = delete;
+
+		EventsHandler(EventsHandler &&other)                 = delete;
+		EventsHandler &operator=(EventsHandler &&other)      = delete;
+
+
+		static WebServerImpl *getImpl(CivetServer *server_) {
+			assert(server_);
+
+			auto utuServer       = static_cast<UtuputkiServer *>(server_);
+			assert(utuServer);
+
+			WebServerImpl *impl_ = utuServer->impl;
+			assert(impl_);
+
+			return impl_;
+		}
+
+	public:
+
+		EventsHandler() {
+		}
+
+
+		bool handleConnection(CivetServer *server_, const struct mg_connection * /* conn */) override {
+			WebServerImpl *impl_ = getImpl(server_);
+
+			std::unique_lock<std::mutex> lock(impl_->webSocketMutex);
+			// every websocket holds a civetweb worker thread for its whole lifetime
+			// refuse extra ones so normal requests still get served
+			// the client falls back to reloading the page
+			if (impl_->webSocketClients.size() >= impl_->maxWebSocketClients) {
+				LOG_WARNING("Too many websocket clients ({}), refusing new one", impl_->webSocketClients.size());
+				return false;
+			}
+
+			return true;
+		}
+
+
+		void handleReadyState(CivetServer *server_, struct mg_connection *conn) override {
+			WebServerImpl *impl_ = getImpl(server_);
+
+			std::unique_lock<std::mutex> lock(impl_->webSocketMutex);
+			impl_->webSocketClients.insert(conn);
+
+			LOG_DEBUG("websocket client connected, {} total", impl_->webSocketClients.size());
+		}
+
+
+		bool handleData(CivetServer * /* server_ */, struct mg_connection * /* conn */, int /* bits */, char * /* data */, size_t /* data_len */) override {
+			// clients don't send anything we care about
+			// keep the connection open
+			return true;
+		}
+
+
+		void handleClose(CivetServer *server_, const struct mg_connection *conn) override {
+			WebServerImpl *impl_ = getImpl(server_);
+
+			std::unique_lock<std::mutex> lock(impl_->webSocketMutex);
+			impl_->webSocketClients.erase(const_cast<struct mg_connection *>(conn));
+
+			LOG_DEBUG("websocket client disconnected, {} left", impl_->webSocketClients.size());
+		}
+	};
+
+
 	class PlaylistHandler final : public RequestHandler {
 		PlaylistHandler(const PlaylistHandler &other)            = delete;
 		PlaylistHandler &operator=(const PlaylistHandler &other) = delete;
@@ -567,7 +907,13 @@ struct WebServer::WebServerImpl {
 		bool handleGet(WebServerImpl *impl_, const std::string & /* client */, struct mg_connection *conn) override {
 			json jsonData;
 
+			// must be read before the snapshot
+			uint64_t version = impl_->utuputki.getVersion();
+			PlaylistSnapshot snapshot = impl_->utuputki.getPlaylist();
+			Format fmt = getFormatParameter(conn, Format::HTML);
+
 			jsonData["title"]      = "Utuputki playlist";
+			jsonData["version"]    = std::to_string(version);
 			tl::optional<HistoryItemMedia> nowPlaying = impl_->utuputki.getNowPlaying();
 			jsonData["nowPlaying"] = nowPlaying;
 
@@ -588,16 +934,30 @@ struct WebServer::WebServerImpl {
 				refreshSeconds = std::min(refreshSeconds, left + 1);
 			}
 
-			json playlist = impl_->utuputki.getPlaylist();
-
 			// hax to fix webpage where nothing is playing but playlist has stuff
 			// tends to happen after skip
-			if (!nowPlaying && !playlist.empty()) {
+			if (!nowPlaying && !snapshot->empty()) {
 				refreshSeconds = 1;
 			}
 
 			jsonData["refreshSeconds"] = refreshSeconds;
 
+			// JSON clients can ask for only what changed since a version they have
+			uint64_t since = getUIntParameter(conn, "since", std::numeric_limits<uint64_t>::max());
+			if (fmt != Format::HTML && since <= version) {
+				// false if too far behind, then send everything
+				if (impl_->getPlaylistChanges(jsonData, *snapshot, since)) {
+					std::string output;
+					MIMEType mimeType;
+					std::tie(output, mimeType) = impl_->formatOutput(jsonData, fmt, impl_->getPlaylistTemplate());
+
+					return sendOK(conn, mimeType, output);
+				}
+			}
+			jsonData["full"]           = true;
+
+			json playlist = *snapshot;
+
 			// calculate start times
 			unsigned int cumulativeLength = 0;
 			Timestamp now = Timestamp::clock::now();
@@ -619,7 +979,6 @@ struct WebServer::WebServerImpl {
 			MIMEType mimeType = MIMEType::TextHTML;
 			std::string output;
 
-			Format fmt = getFormatParameter(conn, Format::HTML);
 			std::tie(output, mimeType) = impl_->formatOutput(jsonData, fmt, impl_->getPlaylistTemplate());
 
 			return sendOK(conn, mimeType, output);
@@ -679,6 +1038,13 @@ struct WebServer::WebServerImpl {
 	};
 
 
+	struct PageParameters {
+		// 0 means start from the newest
+		uint64_t      before = 0;
+		unsigned int  limit  = 0;
+	};
+
+
 	Utuputki                                     &utuputki;
 
 	std::vector<std::string>                     serverOptions;
@@ -701,8 +1067,18 @@ struct WebServer::WebServerImpl {
 	inja::Template                               listMediaTemplate;
 	ListMediaHandler                             listMediaHandler;
 
+	inja::Template                               searchTemplate;
+	SearchHandler                                searchHandler;
+
+	inja::Template                               statsTemplate;
+	StatsHandler                                 statsHandler;
+
+	MovePlaylistItemHandler                      movePlaylistItemHandler;
+
 	SkipHandler                                  skipHandler;
 
+	EventsHandler                                eventsHandler;
+
 	StaticHandler                                cssHandler;
 	StaticHandler                                jsHandler;
 
@@ -713,6 +1089,15 @@ struct WebServer::WebServerImpl {
 	Duration                                     clientTimeout;
 	Timestamp                                    nextClientCleanup;
 
+	std::mutex                                   webSocketMutex;
+	std::unordered_set<struct mg_connection *>   webSocketClients;
+	unsigned int                                 maxWebSocketClients;
+
+	unsigned int                                 pageSize;
+	unsigned int                                 maxPageSize;
+	unsigned int                                 maxChanges;
+	unsigned int                                 statsSize;
+
 
 #ifdef OVERRIDE_TEMPLATES
 
@@ -752,6 +1137,14 @@ struct WebServer::WebServerImpl {
 		return getTemplate("listMedia.template", listMediaTemplate);
 	}
 
+	inja::Template                               getSearchTemplate() {
+		return getTemplate("search.template", searchTemplate);
+	}
+
+	inja::Template                               getStatsTemplate() {
+		return getTemplate("stats.template", statsTemplate);
+	}
+
 #else // OVERRIDE_TEMPLATES
 
 	const inja::Template                         &getPlaylistTemplate() {
@@ -766,6 +1159,14 @@ struct WebServer::WebServerImpl {
 		return listMediaTemplate;
 	}
 
+	const inja::Template                         &getSearchTemplate() {
+		return searchTemplate;
+	}
+
+	const inja::Template                         &getStatsTemplate() {
+		return statsTemplate;
+	}
+
 
 #endif // OVERRIDE_TEMPLATES
 
@@ -789,6 +1190,27 @@ struct WebServer::WebServerImpl {
 
 	void startServer();
 
+	void stopServer();
+
+	void broadcastEvent(const char *type, json &&data);
+
+	PageParameters getPageParameters(struct mg_connection *conn) const;
+
+	bool getPlaylistChanges(json &jsonData, const std::vector<PlaylistItemMedia> &snapshot, uint64_t since);
+
+	// items were fetched with one extra to find out if there's a next page
+	template <typename T> void finishPage(json &jsonData, const PageParameters &page, std::vector<T> &items) const {
+		jsonData["limit"] = page.limit;
+		if (page.before != 0) {
+			jsonData["before"] = std::to_string(page.before);
+		}
+
+		if (items.size() > page.limit) {
+			items.erase(items.begin() + page.limit, items.end());
+			jsonData["nextBefore"] = items.back().id.toString();
+		}
+	}
+
 	std::string formatLocalTime(Timestamp time) {
 		return date::format("%X", make_zoned(localTimeZone, time));
 	}
@@ -874,18 +1296,39 @@ WebServer::WebServerImpl::WebServerImpl(Utuputki &utuputki_, const Config &confi
 , playlistTemplate()
 , historyTemplate()
 , listMediaTemplate()
+, searchTemplate()
+, statsTemplate()
 , cssHandler(utuputki_css, utuputki_css_length, MIMEType::TextCSS, "utuputki.css")
 , jsHandler(utuputki_js, utuputki_js_length, MIMEType::TextJavaScript, "utuputki.js")
 , localTimeZone(date::current_zone())
 , clientTimeout(std::chrono::seconds(config.get("webserver", "clientTimeoutSeconds", 600)))
 , nextClientCleanup(Timestamp::clock::now() + clientTimeout)
+, maxWebSocketClients(config.get("webserver", "maxWebSocketClients", 20))
+, pageSize(config.get("webserver", "pageSize", 100))
+, maxPageSize(config.get("webserver", "maxPageSize", 1000))
+, maxChanges(config.get("webserver", "maxChanges", 1000))
+, statsSize(config.get("webserver", "statsSize", 20))
 {
+	if (pageSize == 0) {
+		pageSize = 1;
+	}
+
+	if (maxPageSize < pageSize) {
+		maxPageSize = pageSize;
+	}
+
+	if (statsSize == 0) {
+		statsSize = 1;
+	}
+
 	environment.include_template("footer.template", environment.parse(std::string_view(reinterpret_cast<const char *>(&footer_template[0]), footer_template_length)));
 	environment.include_template("header.template", environment.parse(std::string_view(reinterpret_cast<const char *>(&header_template[0]), header_template_length)));
 
 	playlistTemplate  = environment.parse(std::string_view(reinterpret_cast<const char *>(&playlist_template[0]), playlist_template_length));
 	historyTemplate   = environment.parse(std::string_view(reinterpret_cast<const char *>(&history_template[0]), history_template_length));
 	listMediaTemplate = environment.parse(std::string_view(reinterpret_cast<const char *>(&listMedia_template[0]), listMedia_template_length));
+	searchTemplate    = environment.parse(std::string_view(reinterpret_cast<const char *>(&search_template[0]), search_template_length));
+	statsTemplate     = environment.parse(std::string_view(reinterpret_cast<const char *>(&stats_template[0]), stats_template_length));
 
 	{
 		auto forwardersList = config.getList("webserver", "forwarders");
@@ -903,10 +1346,32 @@ void WebServer::WebServerImpl::startServer() {
 	server->addHandler("/addMedia",      addMediaHandler);
 	server->addHandler("/history",       historyHandler);
 	server->addHandler("/media",         listMediaHandler);
+	server->addHandler("/search",        searchHandler);
+	server->addHandler("/stats",         statsHandler);
 	server->addHandler("/playlist",      playlistHandler);
+	server->addHandler("/playlist/move", movePlaylistItemHandler);
 	server->addHandler("/skip",          skipHandler);
 	server->addHandler("/utuputki.css",  cssHandler);
 	server->addHandler("/utuputki.js",   jsHandler);
+
+	server->addWebSocketHandler("/events", eventsHandler);
+}
+
+
+void WebServer::WebServerImpl::broadcastEvent(const char *type, json &&data) {
+	std::string message = webEventMessage(type, std::move(data));
+
+	std::unique_lock<std::mutex> lock(webSocketMutex);
+
+	LOG_DEBUG("broadcast {} to {} websocket clients", type, webSocketClients.size());
+
+	for (auto conn : webSocketClients) {
+		int retval = mg_websocket_write(conn, MG_WEBSOCKET_OPCODE_TEXT, message.data(), message.size());
+		if (retval <= 0) {
+			// civetweb calls handleClose for it, nothing else to do
+			LOG_DEBUG("mg_websocket_write failed: {}", retval);
+		}
+	}
 }
 
 
@@ -914,6 +1379,73 @@ WebServer::WebServerImpl::~WebServerImpl() {
 }
 
 
+void WebServer::WebServerImpl::stopServer() {
+	// CivetServer destructor waits for handlers to finish
+	server.reset();
+}
+
+
+WebServer::WebServerImpl::PageParameters WebServer::WebServerImpl::getPageParameters(struct mg_connection *conn) const {
+	PageParameters page;
+
+	page.before = getUIntParameter(conn, "before", 0);
+	page.limit  = static_cast<unsigned int>(std::min(getUIntParameter(conn, "limit", pageSize), uint64_t(maxPageSize)));
+	if (page.limit == 0) {
+		page.limit = pageSize;
+	}
+
+	return page;
+}
+
+
+bool WebServer::WebServerImpl::getPlaylistChanges(json &jsonData, const std::vector<PlaylistItemMedia> &snapshot, uint64_t since) {
+	// one extra to find out if there's too many
+	std::vector<Change> changes = utuputki.getChanges(since, maxChanges + 1);
+	if (changes.size() > maxChanges) {
+		return false;
+	}
+
+	// ids are only exposed as strings
+	std::unordered_set<std::string> changedItems;
+	std::unordered_set<std::string> changedMedia;
+	for (const auto &c : changes) {
+		switch (c.kind) {
+		case ChangeKind::Reset:
+			return false;
+
+		case ChangeKind::PlaylistAdded:
+		case ChangeKind::PlaylistMoved:
+			changedItems.insert(std::to_string(c.item));
+			break;
+
+		case ChangeKind::MediaUpdated:
+			changedMedia.insert(std::to_string(c.media));
+			break;
+
+		case ChangeKind::PlaylistRemoved:
+		case ChangeKind::HistoryStarted:
+		case ChangeKind::HistoryFinished:
+			break;
+		}
+	}
+
+	// current state of everything added or updated which is still on the playlist
+	json items = json::array();
+	for (const auto &item : snapshot) {
+		if (changedItems.count(item.id.toString()) != 0 || changedMedia.count(item.media.toString()) != 0) {
+			items.push_back(item);
+		}
+	}
+
+	jsonData["full"]     = false;
+	jsonData["since"]    = std::to_string(since);
+	jsonData["changes"]  = changes;
+	jsonData["playlist"] = items;
+
+	return true;
+}
+
+
 unsigned int WebServer::WebServerImpl::getNumActiveClients() {
 	unsigned int n;
 
@@ -969,18 +1501,41 @@ WebServer::~WebServer() {
 }
 
 
-void WebServer::notifyAddedToPlaylist(const MediaInfoId & /* media */) {
-	// TODO: websocket thing goes here
+void WebServer::notifyAddedToPlaylist(const PlaylistItemMedia &item) {
+	assert(impl);
+
+	impl->broadcastEvent("addedToPlaylist", item);
+}
+
+
+void WebServer::notifyPlaylistMoved(const std::vector<PlaylistItem> &items) {
+	assert(impl);
+
+	impl->broadcastEvent("playlistMoved", items);
 }
 
 
-void WebServer::notifyNowPlaying(const HistoryItemMedia & /* media */) {
-	// TODO: websocket thing goes here
+void WebServer::notifyMediaUpdated(const MediaInfoId &media) {
+	assert(impl);
+
+	impl->broadcastEvent("mediaUpdated", media);
 }
 
 
-void WebServer::notifyPlaylistItemFinished(const HistoryItemMedia & /* media */) {
-	// TODO: websocket thing goes here
+void WebServer::notifyNowPlaying(const HistoryItemMedia &media) {
+	assert(impl);
+
+	json j = media;
+	j["leftSeconds"] = media.length;
+
+	impl->broadcastEvent("nowPlaying", std::move(j));
+}
+
+
+void WebServer::notifyPlaylistItemFinished(const HistoryItemMedia &media) {
+	assert(impl);
+
+	impl->broadcastEvent("playlistItemFinished", media);
 }
 
 
@@ -998,4 +1553,11 @@ void WebServer::startServer() {
 }
 
 
+void WebServer::stopServer() {
+	assert(impl);
+
+	impl->stopServer();
+}
+
+
 }  // namespace utuputki
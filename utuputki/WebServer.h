@@ -2,8 +2,10 @@
 #define WEBSERVER_H
 
 #include <memory>
+#include <vector>
 
 #include "utuputki/Media.h"
+#include "utuputki/Playlist.h"
 
 
 namespace utuputki {
@@ -33,7 +35,11 @@ public:
 
 	~WebServer();
 
-	void notifyAddedToPlaylist(const MediaInfoId &media);
+	void notifyAddedToPlaylist(const PlaylistItemMedia &item);
+
+	void notifyPlaylistMoved(const std::vector<PlaylistItem> &items);
+
+	void notifyMediaUpdated(const MediaInfoId &media);
 
 	void notifyNowPlaying(const HistoryItemMedia &media);
 
@@ -42,6 +48,9 @@ public:
 	unsigned int getNumActiveClients();
 
 	void startServer();
+
+	// no more requests are handled after this returns
+	void stopServer();
 };
 
 
@@ -0,0 +1,417 @@
+#include <cstdio>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <random>
+
+#include <fmt/format.h>
+#include <sqlite3.h>
+
+#include "utuputki/Config.h"
+#include "utuputki/Database.h"
+#include "utuputki/Logger.h"
+
+
+using namespace utuputki;
+
+
+// for titles so search has something to find
+static const std::array<const char *, 32> words = {
+	  "acoustic", "ballad", "blues", "cover", "dance", "disco", "electric", "funk"
+	, "guitar", "heavy", "jazz", "karaoke", "live", "love", "metal", "midnight"
+	, "night", "official", "orchestra", "piano", "punk", "remix", "rock", "session"
+	, "soul", "summer", "symphony", "theme", "tribute", "unplugged", "video", "winter"
+};
+
+
+static void execute(sqlite3 *db, const std::string &sql) {
+	char *error = nullptr;
+	int retval = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error);
+	if (retval != SQLITE_OK) {
+		std::string message = error ? error : sqlite3_errstr(retval);
+		sqlite3_free(error);
+		throw std::runtime_error(fmt::format("\"{}\" failed: {}", sql, message));
+	}
+}
+
+
+static int64_t countRows(sqlite3 *db, const char *table) {
+	std::string sql = fmt::format("SELECT COUNT(*) FROM {};", table);
+
+	sqlite3_stmt *stmt = nullptr;
+	if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(fmt::format("Failed to prepare \"{}\": {}", sql, sqlite3_errmsg(db)));
+	}
+
+	int64_t count = 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		count = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	return count;
+}
+
+
+static bool hasTable(sqlite3 *db, const char *table) {
+	sqlite3_stmt *stmt = nullptr;
+	if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?1;", -1, &stmt, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(fmt::format("Failed to prepare table check: {}", sqlite3_errmsg(db)));
+	}
+
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	bool found = (sqlite3_step(stmt) == SQLITE_ROW);
+	sqlite3_finalize(stmt);
+
+	return found;
+}
+
+
+// benchmarks modify the database, don't let them near a real one
+static void checkGenerated(const std::string &filename) {
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+		// doesn't exist yet
+		sqlite3_close(db);
+		return;
+	}
+
+	try {
+		if (hasTable(db, "media") && countRows(db, "media") != 0 && !hasTable(db, "dbbench")) {
+			throw std::runtime_error(fmt::format("{} was not generated by dbbench, refusing to use it", filename));
+		}
+	} catch (...) {
+		sqlite3_close(db);
+		throw;
+	}
+
+	sqlite3_close(db);
+}
+
+
+static std::string mediaURL(uint64_t id) {
+	return fmt::format("https://www.youtube.com/watch?v={:011}", id);
+}
+
+
+// fills the tables directly, going through Database would take hours
+// urls are made by mediaURL so benchmarks can find them
+static void generate(const std::string &filename, unsigned int numMedia, unsigned int numHistory, unsigned int numPlaylist) {
+	sqlite3 *db = nullptr;
+	if (sqlite3_open(filename.c_str(), &db) != SQLITE_OK) {
+		throw std::runtime_error(fmt::format("Failed to open {}: {}", filename, sqlite3_errmsg(db)));
+	}
+
+	try {
+		if (countRows(db, "media") != 0) {
+			printf("%s already has media, not generating\n", filename.c_str());
+			sqlite3_close(db);
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		printf("Generating %u media, %u history items and %u playlist items...\n", numMedia, numHistory, numPlaylist);
+
+		execute(db, "BEGIN;");
+
+		// checkGenerated looks for this
+		execute(db, "CREATE TABLE dbbench (generated TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP);");
+		execute(db, "INSERT INTO dbbench DEFAULT VALUES;");
+
+		execute(db, "CREATE TEMP TABLE words (id INTEGER PRIMARY KEY, word TEXT NOT NULL);");
+		for (unsigned int i = 0; i < words.size(); i++) {
+			execute(db, fmt::format("INSERT INTO words (id, word) VALUES ({}, '{}');", i, words[i]));
+		}
+
+		execute(db, fmt::format(
+			"INSERT INTO media (id, status, url, filename, title, length, filesize, metadataTime, errorMessage, extractor, videoId)"
+			" WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < {0})"
+			" SELECT i, 2, printf('https://www.youtube.com/watch?v=%011d', i), printf('%011d.mp4', i)"
+			// referencing i makes sqlite evaluate the subqueries for every row
+			", (SELECT word FROM words WHERE id = (abs(random()) + i * 0) % {1}) || ' ' || (SELECT word FROM words WHERE id = (abs(random()) + i * 0) % {1}) || ' ' || i"
+			", 60 + abs(random()) % 540, 1000000 + abs(random()) % 100000000, '2020-01-01 00:00:00', ''"
+			", 'Youtube', printf('%011d', i)"
+			" FROM n;"
+			, numMedia, words.size()));
+
+		execute(db,
+			"INSERT INTO mediaMetadata (media, metadata)"
+			" SELECT id, json_object('v', 1, 'title', title, 'uploader', 'uploader ' || (id % 1000), 'duration', length) FROM media;");
+
+		execute(db,
+			"INSERT INTO mediaSearch (rowid, title, url, uploader)"
+			" SELECT id, title, url, 'uploader ' || (id % 1000) FROM media;");
+
+		// about three minutes apart, ending now
+		execute(db, fmt::format(
+			"INSERT INTO history (id, media, queueTime, startTime, skipCount, skipsNeeded, endTime, finishReason)"
+			" WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < {0})"
+			" SELECT i, 1 + abs(random()) % {1}"
+			", datetime('now', printf('-%d seconds', ({0} - i) * 200 + 60))"
+			", datetime('now', printf('-%d seconds', ({0} - i) * 200))"
+			", abs(random()) % 3, 3"
+			", datetime('now', printf('-%d seconds', ({0} - i) * 200 - 20 - abs(random()) % 180))"
+			", abs(random()) % 5 = 0"
+			" FROM n;"
+			, numHistory, numMedia));
+
+		execute(db,
+			"INSERT INTO mediaStats (media, playCount, completedCount, skippedCount, skipVotes, lastPlayed, averageWatched)"
+			" SELECT history.media, COUNT(*), SUM(history.finishReason IS 0), SUM(history.finishReason IS 1), SUM(history.skipCount), MAX(history.startTime)"
+			", AVG(CASE WHEN media.length > 0 THEN MIN(1.0, MAX(0.0, (julianday(history.endTime) - julianday(history.startTime)) * 86400.0 / media.length)) ELSE 0.0 END)"
+			" FROM history JOIN media ON media.id = history.media"
+			" GROUP BY history.media;");
+
+		// all media are ready
+		execute(db, fmt::format(
+			"INSERT INTO playlist (media, queueTime, position, ready)"
+			" SELECT m, datetime('now'), row_number() OVER (), 1 FROM ("
+			" WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < {0})"
+			" SELECT DISTINCT 1 + abs(random()) % {1} AS m FROM n);"
+			, numPlaylist, numMedia));
+
+		execute(db, "COMMIT;");
+		execute(db, "ANALYZE;");
+
+		auto end = std::chrono::steady_clock::now();
+		printf("Generated in %.1f s\n", std::chrono::duration<double>(end - start).count());
+	} catch (...) {
+		sqlite3_close(db);
+		throw;
+	}
+
+	sqlite3_close(db);
+}
+
+
+class Benchmark {
+	std::mt19937_64  rng;
+	uint64_t         numMedia;
+
+
+	Benchmark(const Benchmark &other)            = delete;
+	Benchmark &operator=(const Benchmark &other) = delete;
+
+	Benchmark(Benchmark &&other)                 = delete;
+	Benchmark &operator=(Benchmark &&other)      = delete;
+
+public:
+
+	explicit Benchmark(uint64_t numMedia_)
+	: rng(12345)
+	, numMedia(numMedia_)
+	{
+		printf("%-40s %8s %10s %10s %10s\n", "", "calls", "p50 us", "p99 us", "max us");
+	}
+
+
+	uint64_t randomMedia() {
+		return std::uniform_int_distribution<uint64_t>(1, numMedia)(rng);
+	}
+
+
+	template <typename F> void run(const char *name, unsigned int iterations, F &&f) {
+		if (iterations == 0) {
+			return;
+		}
+
+		std::vector<double> samples;
+		samples.reserve(iterations);
+
+		for (unsigned int i = 0; i < iterations; i++) {
+			auto start = std::chrono::steady_clock::now();
+			f(i);
+			auto end = std::chrono::steady_clock::now();
+
+			samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+		}
+
+		std::sort(samples.begin(), samples.end());
+
+		auto percentile = [&] (unsigned int p) {
+			return samples[std::min(samples.size() - 1, samples.size() * p / 100)];
+		};
+
+		printf("%-40s %8u %10.1f %10.1f %10.1f\n", name, iterations, percentile(50), percentile(99), samples.back());
+	}
+};
+
+
+int main(int argc, char *argv[]) {
+	if (argc > 2) {
+		printf("Usage: %s [config file]\n", argv[0]);
+		return 1;
+	}
+
+	try {
+		Config config((argc > 1) ? argv[1] : "dbbench.conf");
+		Logger logger(config);
+
+		unsigned int numMedia    = std::max(config.get("dbbench", "media",    1000000), 1u);
+		unsigned int numHistory  = config.get("dbbench", "history",  10000000);
+		unsigned int numPlaylist = config.get("dbbench", "playlist", 1000);
+		unsigned int iterations  = config.get("dbbench", "iterations", 1000);
+		// some calls read everything, don't repeat those too often
+		unsigned int bulkIterations = std::max(iterations / 100, 1u);
+
+		// not the default of utuputki so it doesn't find the real one
+		std::string filename = config.get("database", "file", "dbbench.sqlite");
+		checkGenerated(filename);
+
+		{
+			// creates the schema
+			Database db(config, filename);
+		}
+		generate(filename, numMedia, numHistory, numPlaylist);
+
+		Database db(config, filename);
+		Benchmark bench(numMedia);
+
+		// MediaIds only come from the database, collect some up front
+		std::vector<MediaId> mediaIds;
+		mediaIds.reserve(iterations);
+		while (mediaIds.size() < iterations) {
+			for (const auto &m : db.getMedia(bench.randomMedia() + 1, 1)) {
+				mediaIds.push_back(m.id);
+			}
+		}
+
+		// compresses the generated metadata like on a real database
+		bench.run("maintenance until done", 1, [&] (unsigned int) {
+			while (db.maintenanceStep()) {
+			}
+		});
+
+		bench.run("getPlaylist", iterations, [&] (unsigned int) {
+			db.getPlaylist();
+		});
+
+		bench.run("getAllMedia", bulkIterations, [&] (unsigned int) {
+			db.getAllMedia();
+		});
+
+		bench.run("getCachedMedia", bulkIterations, [&] (unsigned int) {
+			db.getCachedMedia();
+		});
+
+		bench.run("getMedia newest", iterations, [&] (unsigned int) {
+			db.getMedia(0, 100);
+		});
+
+		bench.run("getMedia random page", iterations, [&] (unsigned int) {
+			db.getMedia(bench.randomMedia(), 100);
+		});
+
+		bench.run("getHistory newest", iterations, [&] (unsigned int) {
+			db.getHistory(0, 100);
+		});
+
+		bench.run("getHistory random page", iterations, [&] (unsigned int) {
+			db.getHistory(1 + bench.randomMedia() * std::max(numHistory, 1u) / numMedia, 100);
+		});
+
+		bench.run("getMediaInfo", iterations, [&] (unsigned int i) {
+			db.getMediaInfo(mediaIds[i]);
+		});
+
+		bench.run("getMediaMetadata", iterations, [&] (unsigned int i) {
+			db.getMediaMetadata(mediaIds[i]);
+		});
+
+		bench.run("searchMedia one word", iterations, [&] (unsigned int i) {
+			db.searchMedia(words[i % words.size()], 0, 100);
+		});
+
+		bench.run("searchMedia two words", iterations, [&] (unsigned int i) {
+			db.searchMedia(fmt::format("{} {}", words[i % words.size()], words[(i / words.size()) % words.size()]), 0, 100);
+		});
+
+		bench.run("getPlayStats most played", iterations, [&] (unsigned int) {
+			db.getPlayStats(StatsOrder::MostPlayed, 20);
+		});
+
+		bench.run("getPlayStats most skipped", iterations, [&] (unsigned int) {
+			db.getPlayStats(StatsOrder::MostSkipped, 20);
+		});
+
+		bench.run("getPlayStats recently played", iterations, [&] (unsigned int) {
+			db.getPlayStats(StatsOrder::RecentlyPlayed, 20);
+		});
+
+		bench.run("getOrAddMediaByURL existing", iterations, [&] (unsigned int) {
+			db.getOrAddMediaByURL(mediaURL(bench.randomMedia()));
+		});
+
+		bench.run("getOrAddMediaByURL video id", iterations, [&] (unsigned int) {
+			uint64_t id = bench.randomMedia();
+			db.getOrAddMediaByURL(fmt::format("https://youtu.be/{:011}", id), "Youtube", fmt::format("{:011}", id));
+		});
+
+		bench.run("getOrAddMediaByURL new", iterations, [&] (unsigned int i) {
+			db.getOrAddMediaByURL(fmt::format("https://bench/new/{}", i));
+		});
+
+		bench.run("updateMediaInfo", iterations, [&] (unsigned int i) {
+			auto media = db.getMediaInfo(mediaIds[i]);
+			media.title = fmt::format("updated {}", i);
+			db.updateMediaInfo(media, std::function<void(const MediaInfoId &)>()).get();
+		});
+
+		// each call merges a fresh media into an existing one
+		{
+			std::vector<MediaInfoId> fresh;
+			fresh.reserve(iterations);
+			for (unsigned int i = 0; i < iterations; i++) {
+				fresh.push_back(db.getOrAddMediaByURL(fmt::format("https://bench/merge/{}", i)));
+			}
+
+			bench.run("updateMediaInfo URL merge", iterations, [&] (unsigned int i) {
+				MediaInfoId media = fresh[i];
+				media.url = mediaURL(bench.randomMedia());
+				db.updateMediaInfo(media, std::function<void(const MediaInfoId &)>()).get();
+			});
+		}
+
+		bench.run("addToPlaylist", iterations, [&] (unsigned int i) {
+			db.addToPlaylist(mediaIds[i], std::function<void(const tl::optional<PlaylistItemMedia> &)>());
+		});
+
+		{
+			auto playlist = db.getPlaylist();
+			if (!playlist.empty()) {
+				bench.run("movePlaylistItem", iterations, [&] (unsigned int i) {
+					db.movePlaylistItem(playlist[i % playlist.size()].id, (i % 2) ? MoveDirection::Down : MoveDirection::Up, std::function<void(const std::vector<PlaylistItem> &)>());
+				});
+			}
+		}
+
+		bench.run("popNextPlaylistItem + finished", iterations, [&] (unsigned int) {
+			auto item = db.popNextPlaylistItem(std::function<void(const tl::optional<HistoryItemMedia> &)>());
+			if (item) {
+				item->historyStatus = HistoryStatus::Completed;
+				db.playlistItemFinished(*item);
+				db.flush();
+			}
+		});
+
+		bench.run("getChanges", iterations, [&] (unsigned int) {
+			uint64_t version = db.getVersion();
+			db.getChanges(version - std::min(version, uint64_t(100)), 1000);
+		});
+
+		bench.run("updateMediaInfo async x100 + flush", bulkIterations, [&] (unsigned int) {
+			for (unsigned int j = 0; j < 100; j++) {
+				auto media = db.getOrAddMediaByURL(mediaURL(bench.randomMedia()));
+				media.title = "async";
+				db.updateMediaInfo(media, std::function<void(const MediaInfoId &)>());
+			}
+			db.flush();
+		});
+	} catch (std::exception &e) {
+		printf("Exception: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+#include <cstdio>
+
+#include <set>
+
+#include <fmt/format.h>
+#include <sqlite3.h>
+
+#include "utuputki/Config.h"
+#include "utuputki/Database.h"
+#include "utuputki/Logger.h"
+
+
+using namespace utuputki;
+
+
+// create_database.sql from before any migrations
+static const char *baselineSchema =
+	"CREATE TABLE media ("
+	"  id             INTEGER PRIMARY KEY"
+	", status         INTEGER NOT NULL DEFAULT 0"
+	", url            TEXT    UNIQUE NOT NULL"
+	", filename       TEXT"
+	", title          TEXT"
+	", length         INTEGER"
+	", filesize       INTEGER"
+	", metadata       TEXT"
+	", metadataTime   TIMESTAMP"
+	", errorMessage   TEXT"
+	"  CHECK (status >= 0 AND status <= 3)"
+	");"
+	"CREATE TABLE playlist ("
+	"  id             INTEGER PRIMARY KEY"
+	", media          INTEGER NOT NULL"
+	", queueTime      TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP"
+	", FOREIGN KEY (media) REFERENCES media"
+	");"
+	"CREATE TABLE history ("
+	"  id            INTEGER PRIMARY KEY"
+	", media         INTEGER NOT NULL"
+	", queueTime     TIMESTAMP NOT NULL"
+	", startTime     TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP"
+	", skipCount     INTEGER NOT NULL DEFAULT 0"
+	", skipsNeeded   INTEGER NOT NULL DEFAULT 0"
+	", endTime       TIMESTAMP"
+	", finishReason  INTEGER"
+	", FOREIGN KEY (media) REFERENCES media"
+	"  CHECK (finishReason >= 0 AND finishReason <= 1)"
+	");";
+
+
+static const char *baselineData =
+	"INSERT INTO media (id, status, url, filename, title, length, filesize, metadata, metadataTime, errorMessage) VALUES"
+	"  (1, 2, 'https://www.youtube.com/watch?v=aaaaaaaaaaa', 'aaaaaaaaaaa.mp4', 'first video', 200, 1000000"
+	"  , '{\"id\": \"aaaaaaaaaaa\", \"extractor_key\": \"Youtube\", \"title\": \"first video\", \"duration\": 200, \"uploader\": \"someone\", \"formats\": []}'"
+	"  , '2020-01-01 00:00:00', '')"
+	", (2, 3, 'https://www.youtube.com/watch?v=bbbbbbbbbbb', NULL, NULL, NULL, NULL, NULL, NULL, 'failed')"
+	", (3, 0, 'https://www.youtube.com/watch?v=ccccccccccc', NULL, NULL, NULL, NULL, '', NULL, '');"
+	"INSERT INTO playlist (id, media, queueTime) VALUES"
+	"  (1, 3, '2020-01-02 00:00:00')"
+	", (2, 1, '2020-01-01 00:00:00');"
+	"INSERT INTO history (id, media, queueTime, startTime, skipCount, skipsNeeded, endTime, finishReason) VALUES"
+	"  (1, 1, '2020-01-01 00:00:00', '2020-01-01 00:01:00', 0, 3, '2020-01-01 00:04:20', 0)"
+	", (2, 1, '2020-01-01 00:05:00', '2020-01-01 00:06:00', 3, 3, '2020-01-01 00:07:00', 1)"
+	", (3, 1, '2020-01-01 00:08:00', '2020-01-01 00:09:00', 0, 3, NULL, NULL);";
+
+
+static unsigned int failures = 0;
+
+
+static void check(bool condition, const std::string &what) {
+	if (!condition) {
+		printf("FAILED: %s\n", what.c_str());
+		failures++;
+	}
+}
+
+
+static void execute(sqlite3 *db, const std::string &sql) {
+	char *error = nullptr;
+	int retval = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error);
+	if (retval != SQLITE_OK) {
+		std::string message = error ? error : sqlite3_errstr(retval);
+		sqlite3_free(error);
+		throw std::runtime_error(fmt::format("\"{}\" failed: {}", sql, message));
+	}
+}
+
+
+static sqlite3 *openRaw(const std::string &filename) {
+	sqlite3 *db = nullptr;
+	if (sqlite3_open(filename.c_str(), &db) != SQLITE_OK) {
+		std::string message = sqlite3_errmsg(db);
+		sqlite3_close(db);
+		throw std::runtime_error(fmt::format("Failed to open {}: {}", filename, message));
+	}
+
+	return db;
+}
+
+
+static int64_t queryInteger(sqlite3 *db, const char *sql) {
+	sqlite3_stmt *stmt = nullptr;
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(fmt::format("Failed to prepare \"{}\": {}", sql, sqlite3_errmsg(db)));
+	}
+
+	int64_t result = 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		result = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	return result;
+}
+
+
+// names of tables and indices, column order differs between migrated and
+// created tables so comparing the sql is no use
+static std::set<std::string> schemaNames(sqlite3 *db) {
+	const char *sql = "SELECT type || ' ' || name FROM sqlite_master WHERE name NOT LIKE 'sqlite_%' AND name NOT LIKE 'mediaSearch_%';";
+
+	sqlite3_stmt *stmt = nullptr;
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(fmt::format("Failed to prepare \"{}\": {}", sql, sqlite3_errmsg(db)));
+	}
+
+	std::set<std::string> names;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		names.insert(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+	}
+	sqlite3_finalize(stmt);
+
+	return names;
+}
+
+
+// version and tables of a database made by this program from scratch
+static void freshSchema(const Config &config, const std::string &filename, int64_t &version, std::set<std::string> &names) {
+	std::string freshFilename = filename + ".fresh";
+	remove(freshFilename.c_str());
+
+	{
+		Database db(config, freshFilename);
+	}
+
+	sqlite3 *db = openRaw(freshFilename);
+	version = queryInteger(db, "PRAGMA user_version;");
+	names   = schemaNames(db);
+	sqlite3_close(db);
+}
+
+
+int main(int argc, char *argv[]) {
+	if (argc > 2) {
+		printf("Usage: %s [config file]\n", argv[0]);
+		return 1;
+	}
+
+	try {
+		Config config((argc > 1) ? argv[1] : "migrationtest.conf");
+		Logger logger(config);
+
+		// passed to Database, its own default is the real database
+		std::string filename = config.get("database", "file", "migrationtest.sqlite");
+		// would be overwritten, also the test must start from a known state
+		remove(filename.c_str());
+		remove((filename + "-wal").c_str());
+		remove((filename + "-shm").c_str());
+
+		{
+			sqlite3 *db = openRaw(filename);
+			execute(db, baselineSchema);
+			execute(db, baselineData);
+			sqlite3_close(db);
+		}
+
+		// migrate and check the data survived
+		{
+			Database db(config, filename);
+
+			auto media = db.getAllMedia();
+			check(media.size() == 3, fmt::format("3 media after migration, got {}", media.size()));
+
+			auto playlist = db.getPlaylist();
+			check(playlist.size() == 2, fmt::format("2 playlist items after migration, got {}", playlist.size()));
+			if (playlist.size() == 2) {
+				// position comes from queueTime
+				check(playlist[0].url == "https://www.youtube.com/watch?v=aaaaaaaaaaa", "playlist ordered by queue time");
+			}
+
+			auto history = db.getHistory(0, 10);
+			check(history.size() == 3, fmt::format("3 history items after migration, got {}", history.size()));
+
+			for (const auto &m : media) {
+				std::string metadata = db.getMediaMetadata(m.id);
+				if (m.url == "https://www.youtube.com/watch?v=aaaaaaaaaaa") {
+					check(metadata.find("\"uploader\":\"someone\"") != std::string::npos, fmt::format("metadata projected, got {}", metadata));
+				} else {
+					check(metadata.empty(), fmt::format("no metadata for {}", m.url));
+				}
+			}
+
+			check(db.getChanges(0, 100).empty(), "no changes after migration");
+
+			while (db.maintenanceStep()) {
+			}
+		}
+
+		int64_t freshVersion = 0;
+		std::set<std::string> freshNames;
+		freshSchema(config, filename, freshVersion, freshNames);
+
+		sqlite3 *db = openRaw(filename);
+		int64_t version = queryInteger(db, "PRAGMA user_version;");
+		check(version == freshVersion, fmt::format("user_version {} after migration, fresh database has {}", version, freshVersion));
+		check(schemaNames(db) == freshNames, "migrated database has the same tables and indices as a fresh one");
+		check(queryInteger(db, "SELECT COUNT(*) FROM pragma_foreign_key_check;") == 0, "foreign keys consistent after migration");
+		sqlite3_close(db);
+	} catch (std::exception &e) {
+		printf("Exception: \"%s\"\n", e.what());
+		return 1;
+	}
+
+	if (failures != 0) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+
+	return 0;
+}
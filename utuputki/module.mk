@@ -18,9 +18,11 @@ FILES:= \
 
 $(dir)/Database.o: DatabaseGenerated.h create_database.sql.h
 
+$(dir)/Downloader.o: ytdlp_helper.py.h
+
 $(dir)/Player.o: standby.png.h
 
-$(dir)/WebServer.o: listMedia.template.h footer.template.h header.template.h history.template.h playlist.template.h utuputki.css.h utuputki.js.h
+$(dir)/WebServer.o: listMedia.template.h footer.template.h header.template.h history.template.h playlist.template.h search.template.h stats.template.h utuputki.css.h utuputki.js.h
 
 
 DatabaseGenerated.h: $(TOPDIR)/create_database.sql
@@ -30,17 +32,32 @@ DatabaseGenerated.h: $(TOPDIR)/create_database.sql
 SRC_$(d):=$(addprefix $(d)/,$(FILES))
 
 
+dbbench_MODULES:=date fmt sqlite3 zlib
+dbbench_SRC:=$(foreach f, Config.cpp Database.cpp dbbench.cpp Logger.cpp, $(dir)/$(f))
+
+
+migrationtest_MODULES:=date fmt sqlite3 zlib
+migrationtest_SRC:=$(foreach f, Config.cpp Database.cpp Logger.cpp migrationtest.cpp, $(dir)/$(f))
+
+
+webeventtest_MODULES:=
+webeventtest_SRC:=$(dir)/webeventtest.cpp
+
+
 embed_MODULES:=fmt
 embed_SRC:=$(foreach f, embed.cpp Utils.cpp, $(dir)/$(f))
 
 
-utuputki_MODULES:=civetweb date fmt libvlcpp python sqlite3 cxxurl
+utuputki_MODULES:=civetweb date fmt libvlcpp python sqlite3 cxxurl zlib
 utuputki_SRC:=$(SRC_$(d))
 
 
 PROGRAMS+= \
+	dbbench \
 	embed \
+	migrationtest \
 	utuputki \
+	webeventtest \
 	# empty line
 
 
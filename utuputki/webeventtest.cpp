@@ -0,0 +1,61 @@
+#include <cstdio>
+
+#include <string>
+
+#include "utuputki/WebEvent.h"
+
+
+using namespace utuputki;
+using namespace nlohmann;
+
+
+static unsigned int failures = 0;
+
+
+static void check(bool condition, const std::string &what) {
+	if (!condition) {
+		printf("FAILED: %s\n", what.c_str());
+		failures++;
+	}
+}
+
+
+int main() {
+	try {
+		// notifyPlaylistMoved sends an array of items like this
+		json moved = json::array();
+		moved.push_back(json { { "id", "1" }, { "mediaId", "10" }, { "position", 2 } });
+		moved.push_back(json { { "id", "2" }, { "mediaId", "20" }, { "position", 1 } });
+
+		auto event = json::parse(webEventMessage("playlistMoved", std::move(moved)));
+		check(event["type"] == "playlistMoved", "playlistMoved event has its type");
+		check(event["data"].is_array() && event["data"].size() == 2, "playlistMoved event has both items");
+		if (event["data"].size() == 2) {
+			check(event["data"][0]["position"] == 2, "playlistMoved items keep their positions");
+		}
+
+		// the rest send a single media
+		json media { { "id", "10" }, { "title", "a video" }, { "metadata", "{}" } };
+		event = json::parse(webEventMessage("mediaUpdated", std::move(media)));
+		check(event["type"] == "mediaUpdated", "mediaUpdated event has its type");
+		check(event["data"]["title"] == "a video", "mediaUpdated event has the media");
+		check(!event["data"].contains("metadata"), "metadata is not sent to clients");
+
+		json items = json::array();
+		items.push_back(json { { "id", "1" }, { "metadata", "{}" } });
+		event = json::parse(webEventMessage("test", std::move(items)));
+		check(!event["data"][0].contains("metadata"), "metadata is not sent in arrays either");
+	} catch (std::exception &e) {
+		printf("Exception: \"%s\"\n", e.what());
+		return 1;
+	}
+
+	if (failures != 0) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+
+	return 0;
+}
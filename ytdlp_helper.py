@@ -0,0 +1,242 @@
+# runs yt-dlp for utuputki in a separate process
+# started as python3 -c <this> <idle seconds>
+# stdin and stdout carry frames: 4 byte big endian length, then that much
+# UTF-8 JSON. each request gets any number of log frames and then a reply
+# playlist requests also get frames of entries before the reply
+import json
+import os
+import select
+import struct
+import sys
+import time
+import urllib.parse
+
+
+protocolIn  = os.fdopen(os.dup(0), 'rb', buffering=0)
+protocolOut = os.fdopen(os.dup(1), 'wb', buffering=0)
+
+# stray prints must not end up in the protocol
+os.dup2(2, 1)
+nullIn = os.open(os.devnull, os.O_RDONLY)
+os.dup2(nullIn, 0)
+os.close(nullIn)
+
+idleSeconds = float(sys.argv[1]) if len(sys.argv) > 1 else 60.0
+
+
+youtubeDL     = None
+youtubeDLName = None
+for name in ('yt_dlp', 'youtube_dl'):
+    try:
+        youtubeDL     = __import__(name)
+        youtubeDLName = name
+        break
+    except ImportError:
+        pass
+
+
+def readExact(count):
+    data = b''
+    while len(data) < count:
+        try:
+            chunk = protocolIn.read(count - len(data))
+        except ConnectionResetError:
+            # same as end of file
+            return None
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def readFrame():
+    header = readExact(4)
+    if header is None:
+        return None
+
+    (length,) = struct.unpack('>I', header)
+    data = readExact(length)
+    if data is None:
+        return None
+
+    return json.loads(data.decode('utf-8'))
+
+
+def writeFrame(message):
+    data = json.dumps(message).encode('utf-8')
+    protocolOut.write(struct.pack('>I', len(data)) + data)
+
+
+class Logger:
+    def debug(self, message):
+        writeFrame({'log': 'debug', 'message': message})
+
+    def warning(self, message):
+        writeFrame({'log': 'warning', 'message': message})
+
+    def error(self, message):
+        writeFrame({'log': 'error', 'message': message})
+
+
+# creating one registers every extractor so keep it while options stay the same
+cachedOptions    = None
+cachedDownloader = None
+
+
+def getDownloader(options):
+    global cachedOptions, cachedDownloader
+
+    outtmpl = options.pop('outtmpl', None)
+    key     = json.dumps(options, sort_keys=True)
+    if key != cachedOptions:
+        start = time.monotonic()
+        options['logger'] = Logger()
+        cachedDownloader  = youtubeDL.YoutubeDL(options)
+        cachedOptions     = key
+        Logger().debug('Creating YoutubeDL took {} us'.format(int((time.monotonic() - start) * 1000000)))
+
+    if outtmpl is not None:
+        # yt-dlp turns it into a dict of templates per file type
+        params = cachedDownloader.params
+        if isinstance(params.get('outtmpl'), dict):
+            params['outtmpl']['default'] = outtmpl
+        else:
+            params['outtmpl'] = outtmpl
+
+    return cachedDownloader
+
+
+# when the chosen formats' URLs stop working, 0 when they don't say
+def urlExpiry(info):
+    formats = info.get('requested_formats') or [info]
+    expires = 0
+    for f in formats:
+        query = urllib.parse.parse_qs(urllib.parse.urlparse(f.get('url') or '').query)
+        for value in query.get('expire', []):
+            if value.isdigit() and (expires == 0 or int(value) < expires):
+                expires = int(value)
+    return expires
+
+
+# only what utuputki uses is stored, same fields as compactMetadata() in Downloader.cpp
+def projectMetadata(info):
+    return {'v':             1,
+            'id':            str(info['id']) if info.get('id') is not None else None,
+            'extractor_key': info.get('extractor_key'),
+            'webpage_url':   info['webpage_url'],
+            'title':         info['title'],
+            'duration':      int(info.get('duration') or 0),
+            'uploader':      info.get('uploader') or '',
+            'thumbnail':     info.get('thumbnail') or '',
+            'format_id':     info.get('format_id') or '',
+            'expires':       urlExpiry(info)}
+
+
+# the full info is only kept in memory until the download
+# filename is relative to the cache, downloads set outtmpl to an absolute path
+def metadataReply(downloader, info, full):
+    reply = {'metadata': json.dumps(projectMetadata(info)), 'filename': os.path.basename(downloader.prepare_filename(info))}
+    if full:
+        reply['info'] = json.dumps(info)
+    return reply
+
+
+def playlistEntries(downloader, url):
+    # not processing leaves entries as a generator which fetches more
+    # pages as it goes
+    info = downloader.extract_info(url, False, process=False)
+    # channels point to their videos tab
+    for _ in range(3):
+        if info.get('_type') not in ('url', 'url_transparent'):
+            break
+        info = downloader.extract_info(info['url'], False, process=False)
+
+    entries = info.get('entries')
+    if entries is None:
+        raise RuntimeError('No entries in playlist ' + url)
+
+    return entries
+
+
+def sendPlaylist(request):
+    # different options from the cached one so don't replace it
+    options           = request['options']
+    options['logger'] = Logger()
+    downloader        = youtubeDL.YoutubeDL(options)
+
+    batch = []
+    count = 0
+    for entry in playlistEntries(downloader, request['url']):
+        if request['limit'] and count >= request['limit']:
+            Logger().debug('Playlist has more than {} entries, ignoring the rest'.format(request['limit']))
+            break
+        count += 1
+
+        batch.append({'url':      entry.get('url') or '',
+                      'ie_key':   entry.get('ie_key') or '',
+                      'id':       str(entry.get('id') or ''),
+                      'title':    entry.get('title') or '',
+                      'duration': int(entry.get('duration') or 0)})
+        if len(batch) >= request['batch']:
+            writeFrame({'entries': batch})
+            batch = []
+
+    if batch:
+        writeFrame({'entries': batch})
+
+    return {}
+
+
+def handle(request):
+    if youtubeDL is None:
+        raise RuntimeError('No yt-dlp or youtube-dl installed')
+
+    op = request['op']
+    if op == 'version':
+        version = __import__(youtubeDLName + '.version', fromlist=['__version__'])
+        return {'module': youtubeDLName, 'version': version.__version__}
+
+    if op == 'playlist':
+        return sendPlaylist(request)
+
+    downloader = getDownloader(request['options'])
+
+    if op == 'metadata':
+        info = downloader.extract_info(request['url'], False)
+        return metadataReply(downloader, info, True)
+
+    if op == 'download':
+        # fresh metadata goes back to be saved, reused info doesn't
+        reply = {}
+        if request.get('info'):
+            info = json.loads(request['info'])
+        else:
+            info  = downloader.extract_info(request['url'], False)
+            reply = metadataReply(downloader, info, False)
+
+        downloader.process_video_result(info)
+        return reply
+
+    raise RuntimeError('Unknown op ' + str(op))
+
+
+while True:
+    # exit when idle, utuputki starts a new one when needed
+    (readable, _, _) = select.select([protocolIn], [], [], idleSeconds)
+    if not readable:
+        break
+
+    request = readFrame()
+    if request is None:
+        break
+
+    try:
+        reply = handle(request)
+    except Exception as e:
+        reply = {'error': str(e)}
+
+    try:
+        writeFrame(reply)
+    except OSError:
+        # utuputki gave up on us in the middle of a request
+        break